@@ -0,0 +1,15 @@
+; ========================================================================
+; Loop whose exit compare reads a register the loop also changes.
+; Fast-forwarding has to step the compare by the difference of both
+; strides: cx - dx goes -10, -8, ... and the loop ends at cx = dx = 15.
+; ========================================================================
+
+bits 16
+
+mov cx, 0
+mov dx, 10
+loop_start:
+	add cx, 3
+	add dx, 1
+	cmp cx, dx
+	jnz loop_start
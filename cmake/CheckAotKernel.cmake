@@ -0,0 +1,44 @@
+# Builds the kernel of a listing with --aot-build and checks its final state, clocks and memory
+# against the interpreter. Run with cmake -DSIMULATOR=... -DSOURCE_DIR=... -DLISTING=...
+# -DWORK_DIR=... -P CheckAotKernel.cmake
+
+# Both sides write memoryDump.data to their working directory, one directory per listing
+get_filename_component(NAME ${LISTING} NAME)
+set(RUN_DIR ${WORK_DIR}/${NAME})
+set(KERNEL ${RUN_DIR}/kernel)
+file(REMOVE_RECURSE ${RUN_DIR})
+file(MAKE_DIRECTORY ${RUN_DIR})
+
+execute_process(
+    COMMAND ${SIMULATOR} ${SOURCE_DIR}/${LISTING} --exec --no-trace --cyclesEstimate --dump --aot-build ${KERNEL}
+    WORKING_DIRECTORY ${RUN_DIR}
+    OUTPUT_VARIABLE INTERPRETED
+    ERROR_VARIABLE COMPILE_ERRORS
+    RESULT_VARIABLE RESULT)
+if(NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "emitted kernel of ${LISTING} doesn't build:\n${COMPILE_ERRORS}")
+endif()
+file(RENAME ${RUN_DIR}/memoryDump.data ${RUN_DIR}/interpreted.data)
+
+execute_process(COMMAND ${KERNEL} --dump WORKING_DIRECTORY ${RUN_DIR} OUTPUT_VARIABLE COMPILED RESULT_VARIABLE RESULT)
+if(NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "emitted kernel failed")
+endif()
+
+# Final registers, flags and clocks, both print them the same way
+string(FIND "${INTERPRETED}" "Final registers:" BEGIN)
+string(SUBSTRING "${INTERPRETED}" ${BEGIN} -1 INTERPRETED)
+string(FIND "${COMPILED}" "Final registers:" BEGIN)
+string(SUBSTRING "${COMPILED}" ${BEGIN} -1 COMPILED)
+string(STRIP "${INTERPRETED}" INTERPRETED)
+string(STRIP "${COMPILED}" COMPILED)
+if(NOT INTERPRETED STREQUAL COMPILED)
+    message(FATAL_ERROR "emitted kernel differs from interpreter:\n${COMPILED}\n--- interpreter ---\n${INTERPRETED}")
+endif()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${RUN_DIR}/interpreted.data ${RUN_DIR}/memoryDump.data
+    RESULT_VARIABLE RESULT)
+if(NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "memory of emitted kernel differs from interpreter")
+endif()
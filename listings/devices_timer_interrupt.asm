@@ -0,0 +1,25 @@
+; ========================================================================
+; Counts timer interrupts in bx until there are 5 of them. Run with
+; --devices --timer <clocks>, the timer is IRQ 0 and raises vector 8,
+; whose handler address lives at 8 * 4 = 0x20.
+; ========================================================================
+
+bits 16
+
+mov word [0x20], 18 ; timer_handler
+mov sp, 0x8000
+sti
+
+wait_loop:
+	cmp bx, 5
+	jne wait_loop
+	cli
+	je done ; zero flag is still set by the compare
+
+timer_handler:
+	add bx, 1
+	mov al, 0x20 ; end of interrupt
+	out 0x20, al
+	iret
+
+done:
@@ -0,0 +1,19 @@
+; ========================================================================
+; Word accesses at 0xFFFF wrap their high byte around to address 0.
+; The store, the load and the push/pop pair all straddle the end of
+; memory, every iteration adds 0x12 to bx and dx ends as a copy of bx.
+; Address 0 goes through di, which stays 0.
+; ========================================================================
+
+bits 16
+
+mov cx, 100
+loop_start:
+	mov word [0xffff], 0x1234
+	mov ax, [di]
+	add bx, ax
+	mov sp, 1
+	push bx
+	pop dx
+	mov word [di], 0
+	loop loop_start
@@ -0,0 +1,178 @@
+#pragma once
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "Defines.h"
+#include "CpuNames.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "ControlFlowGraph.h"
+
+// Translates decoded operations into a C++ translation unit built on AotRuntime.h.
+// Every basic block becomes a label with straight-line code, jumps become gotos.
+// Programs with operations the runtime can't run (string, call/ret, system...) are refused.
+// Build the output with the simulator sources on the include path, e.g.
+//   g++ -std=c++20 -O2 -I src kernel.cpp -o kernel
+// or let BuildAotKernel run the compiler the simulator was built with (--aot-build).
+
+// Set by CMake, the defaults expect a compiler on PATH and the repository as working directory
+#ifndef X8086_AOT_CXX
+#define X8086_AOT_CXX "c++"
+#endif
+#ifndef X8086_AOT_INCLUDE_DIR
+#define X8086_AOT_INCLUDE_DIR "src"
+#endif
+
+constexpr const char* opIndexNames[] = { "ADD", "MOV", "", "", "", "SUB", "", "CMP" };
+constexpr const char* opJumpNames[] = { "jo", "jno", "jb", "jnb", "je", "jne", "jbe", "ja", "js", "jns", "jp", "jnp", "jl", "jnl", "jle", "jnle" };
+constexpr const char* opLoopNames[] = { "loopnz", "loopz", "loop", "jcxz" };
+
+std::string AotRegisterName(RegisterIndex reg)
+{
+    return reg == RegisterIndex::None ? "RegisterIndex::None" : std::string("RegisterIndex::") + registerNames[reg];
+}
+
+// Returns empty string for operands the runtime doesn't know
+std::string AotOperandType(const Operand& operand)
+{
+    switch (operand.type)
+    {
+    case Operand::Type::Register:
+        return "AotReg<" + AotRegisterName(operand.reg) + ">";
+    case Operand::Type::Immediate:
+        return "AotImm<" + std::to_string(operand.immVal.value) + ">";
+    case Operand::Type::Memory:
+        return "AotMem<" + AotRegisterName(operand.mem.registers[0]) + ", " + AotRegisterName(operand.mem.registers[1]) + ", "
+            + std::to_string(operand.mem.disp) + ", " + (operand.mem.pointsToWord ? "true" : "false") + ">";
+    default:
+        return "";
+    }
+}
+
+bool AotSupportsOperation(const Operation& op)
+{
+    if (op.type == Operation::Type::Stack)
+    {
+        return (op.opStackIndex == OpStack::push || op.opStackIndex == OpStack::pop) && op.operands[0].type == Operand::Type::Register;
+    }
+    if (op.type != Operation::Type::Operation)
+    {
+        return op.type == Operation::Type::Jump || op.type == Operation::Type::Loop;
+    }
+    return (op.opIndex == OpIndex::MOV || op.opIndex == OpIndex::ADD || op.opIndex == OpIndex::SUB || op.opIndex == OpIndex::CMP)
+        && op.operands[0].type != Operand::Type::Immediate
+        && !AotOperandType(op.operands[0]).empty()
+        && !AotOperandType(op.operands[1]).empty();
+}
+
+// First operation in the graph the runtime can't run, -1 when the whole program compiles
+int AotUnsupportedIp(const std::unordered_map<int, Operation>& operations, const ControlFlowGraph& cfg)
+{
+    for (const auto& [start, block] : cfg.blocks)
+    {
+        for (u16 ip : block.operationIps)
+        {
+            if (!AotSupportsOperation(operations.at(ip)))
+            {
+                return ip;
+            }
+        }
+    }
+    return -1;
+}
+
+std::string AotLabel(int ip)
+{
+    std::stringstream stream;
+    stream << "block_" << std::hex << ip;
+    return stream.str();
+}
+
+// Either jumps to the block at ip or leaves the kernel there
+std::string AotGoto(const ControlFlowGraph& cfg, int ip)
+{
+    if (cfg.Find(ip))
+    {
+        return "goto " + AotLabel(ip) + ";";
+    }
+    return "{ ipReg = " + std::to_string(ip) + "; return; }";
+}
+
+// Expects AotUnsupportedIp to have found nothing
+void EmitCpp(const std::unordered_map<int, Operation>& operations, const ControlFlowGraph& cfg, const std::string& path, const std::string& sourceName)
+{
+    std::ofstream out{ path };
+    out << "// Generated by x8086-simulator --emit-cpp from " << sourceName << "\n"
+        << "#include \"AotRuntime.h\"\n\n"
+        << "void RunKernel()\n{\n"
+        << "    " << AotGoto(cfg, cfg.entry) << "\n";
+
+    for (const auto& [start, block] : cfg.blocks)
+    {
+        // Cycles and steps are summed per block
+        u64 blockCycles = 0;
+        for (u16 ip : block.operationIps)
+        {
+            blockCycles += CycleEstimation(operations.at(ip), staticStringRepetitions);
+        }
+
+        out << "\n" << AotLabel(start) << ":\n"
+            << "    aotCycles += " << blockCycles << ";\n"
+            << "    aotSteps += " << block.operationIps.size() << ";\n";
+
+        for (u16 ip : block.operationIps)
+        {
+            const Operation& op = operations.at(ip);
+            switch (op.type)
+            {
+            case Operation::Type::Operation:
+                out << "    AotExecute<OpIndex::" << opIndexNames[op.opIndex] << ", "
+                    << AotOperandType(op.operands[0]) << ", " << AotOperandType(op.operands[1]) << ">();\n";
+                break;
+            case Operation::Type::Jump:
+                out << "    if (AotJump<OpJump::" << opJumpNames[op.opJumpIndex] << ">()) " << AotGoto(cfg, block.taken) << "\n";
+                break;
+            case Operation::Type::Loop:
+                out << "    if (AotLoop<OpLoop::" << opLoopNames[op.opLoopIndex] << ">()) " << AotGoto(cfg, block.taken) << "\n";
+                break;
+            case Operation::Type::Stack:
+                out << "    " << (op.opStackIndex == OpStack::push ? "AotPush<" : "AotPop<") << AotOperandType(op.operands[0]) << ">();\n";
+                break;
+            default:
+                break;
+            }
+        }
+
+        out << "    " << AotGoto(cfg, block.fallthrough) << "\n";
+    }
+
+    out << "}\n\n"
+        << "int main(int argc, char** argv)\n{\n"
+        << "    RunKernel();\n"
+        << "    PrintFinalState();\n"
+        << "    std::cout << \"\\nTotal clocks: \" << aotCycles << \" (\" << aotSteps << \" steps)\\n\";\n"
+        << "    if (argc > 1 && std::string(argv[1]) == \"--dump\")\n"
+        << "    {\n"
+        << "        AotDumpMemory();\n"
+        << "    }\n"
+        << "    return 0;\n"
+        << "}\n";
+}
+
+// Emits exePath.cpp and compiles it into exePath, false when the compiler fails
+bool BuildAotKernel(const std::unordered_map<int, Operation>& operations, const ControlFlowGraph& cfg, const std::string& exePath, const std::string& sourceName)
+{
+    const std::string sourcePath = exePath + ".cpp";
+    EmitCpp(operations, cfg, sourcePath, sourceName);
+#ifdef _MSC_VER
+    const std::string command = std::string("\"" X8086_AOT_CXX "\" /nologo /std:c++20 /O2 /EHsc /I \"" X8086_AOT_INCLUDE_DIR "\" \"")
+        + sourcePath + "\" /Fe:\"" + exePath + "\"";
+#else
+    const std::string command = std::string("\"" X8086_AOT_CXX "\" -std=c++20 -O2 -I \"" X8086_AOT_INCLUDE_DIR "\" \"")
+        + sourcePath + "\" -o \"" + exePath + "\"";
+#endif
+    return std::system(command.c_str()) == 0;
+}
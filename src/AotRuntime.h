@@ -0,0 +1,157 @@
+#pragma once
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "Helpers.h"
+#include "MachineState.h"
+
+// Runtime for C++ translation units emitted by --emit-cpp.
+// Every instruction becomes AotExecute<op, Dst, Src>() where operands are types,
+// so register slots, addresses and widths are all known to the compiler
+
+u64 aotCycles = 0;
+u64 aotSteps = 0;
+
+template <RegisterIndex reg>
+struct AotReg
+{
+    static constexpr bool wide = !IsByteRegister(reg);
+
+    static u16 Read()
+    {
+        if constexpr (wide)
+            return registersMem[GetRegisterSlot(reg)];
+        else
+            return reinterpret_cast<u8*>(&registersMem[GetRegisterSlot(reg)])[IsHighByteRegister(reg)];
+    }
+
+    static void Write(u16 value)
+    {
+        if constexpr (wide)
+            registersMem[GetRegisterSlot(reg)] = value;
+        else
+            reinterpret_cast<u8*>(&registersMem[GetRegisterSlot(reg)])[IsHighByteRegister(reg)] = u8(value);
+    }
+};
+
+template <s16 value>
+struct AotImm
+{
+    static u16 Read() { return (u16)value; }
+};
+
+template <RegisterIndex reg0, RegisterIndex reg1, s16 disp, bool isWide>
+struct AotMem
+{
+    static constexpr bool wide = isWide;
+
+    static u16 Address()
+    {
+        u16 address = (u16)disp;
+        if constexpr (reg0 != RegisterIndex::None) address += registersMem[GetRegisterSlot(reg0)];
+        if constexpr (reg1 != RegisterIndex::None) address += registersMem[GetRegisterSlot(reg1)];
+        return address;
+    }
+
+    static u16 Read()
+    {
+        const u16 address = Address();
+        if constexpr (wide)
+            return (mainMemory[u16(address + 1)] << 8) | mainMemory[address];
+        else
+            return mainMemory[address];
+    }
+
+    static void Write(u16 value)
+    {
+        const u16 address = Address();
+        mainMemory[address] = value & 0xFF;
+        if constexpr (wide)
+            mainMemory[u16(address + 1)] = value >> 8;
+    }
+};
+
+// Word at sp, ss is always 0 and the word wraps around like any other
+struct AotStackTop
+{
+    static u16& Pointer()
+    {
+        return registersMem[GetRegisterSlot(RegisterIndex::sp)];
+    }
+
+    static u16 Read()
+    {
+        const u16 sp = Pointer();
+        return (mainMemory[u16(sp + 1)] << 8) | mainMemory[sp];
+    }
+
+    static void Write(u16 value)
+    {
+        const u16 sp = Pointer();
+        mainMemory[sp] = value & 0xFF;
+        mainMemory[u16(sp + 1)] = value >> 8;
+    }
+};
+
+template <OpIndex op, typename Dst, typename Src>
+inline void AotExecute()
+{
+    const u16 data = Src::Read();
+    if constexpr (op == OpIndex::MOV)
+    {
+        Dst::Write(data);
+    }
+    else
+    {
+        const u16 result = ArithmeticResult(op, Dst::Read(), data, Dst::wide);
+        if constexpr (op != OpIndex::CMP)
+            Dst::Write(result);
+        flags[Flag::FLAG_ZERO] = result == 0;
+        flags[Flag::FLAG_SIGNED] = ArithmeticSign(result, Dst::wide);
+    }
+}
+
+template <OpJump jump>
+inline bool AotJump()
+{
+    return IsJumpConditionMet(jump);
+}
+
+template <OpLoop loop>
+inline bool AotLoop()
+{
+    u16& cx = registersMem[GetRegisterSlot(RegisterIndex::cx)];
+    if constexpr (loop == OpLoop::jcxz)
+    {
+        return cx == 0;
+    }
+    cx -= 1;
+    return IsLoopConditionMet(loop, cx);
+}
+
+// push sp stores the already decremented value, as the 8086 does
+template <typename Src>
+inline void AotPush()
+{
+    AotStackTop::Pointer() -= 2;
+    AotStackTop::Write(Src::Read());
+}
+
+template <typename Dst>
+inline void AotPop()
+{
+    const u16 value = AotStackTop::Read();
+    AotStackTop::Pointer() += 2;
+    Dst::Write(value);
+}
+
+// Same file --dump of the simulator writes
+inline void AotDumpMemory()
+{
+    std::ofstream memoryDumpFile{ "memoryDump.data", std::ios::binary };
+    memoryDumpFile.write(reinterpret_cast<const char*>(mainMemory), mainMemoryLimit);
+}
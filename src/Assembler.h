@@ -0,0 +1,736 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuNames.h"
+#include "CpuOperations.h"
+#include "Helpers.h"
+
+// Assembles the NASM subset the listings are written in straight into a machine image:
+// bits 16, mov/add/sub/cmp with register, memory and immediate operands, byte/word size
+// specifiers, push/pop of word registers, in/out through al or ax, cli/sti/iret, labels,
+// and the conditional jumps, loops and jcxz (with NASM aliases).
+// Encodings are picked the way NASM picks them, so listings assemble to their prebuilt
+// binaries byte for byte: register to register uses the r/m-destination opcode, zero
+// displacements are dropped except for [bp], word immediates that fit a signed byte use
+// the sign-extended form, and accumulator forms are used for al/ax with immediates
+// and for mov to and from direct addresses.
+// Jumps are always short, labels may be used before they are defined and are patched
+// once the whole source is read.
+
+struct AssembledProgram
+{
+    std::vector<u8> image;
+    std::string error;      // empty on success
+    int errorLine = 0;
+};
+
+struct JumpMnemonic
+{
+    const char* name;
+    u8 opcode;
+};
+
+constexpr JumpMnemonic jumpMnemonics[] = {
+    {"jo", 0x70},     {"jno", 0x71},
+    {"jb", 0x72},     {"jnae", 0x72},   {"jc", 0x72},
+    {"jnb", 0x73},    {"jae", 0x73},    {"jnc", 0x73},
+    {"je", 0x74},     {"jz", 0x74},
+    {"jne", 0x75},    {"jnz", 0x75},
+    {"jbe", 0x76},    {"jna", 0x76},
+    {"ja", 0x77},     {"jnbe", 0x77},
+    {"js", 0x78},     {"jns", 0x79},
+    {"jp", 0x7A},     {"jpe", 0x7A},
+    {"jnp", 0x7B},    {"jpo", 0x7B},
+    {"jl", 0x7C},     {"jnge", 0x7C},
+    {"jnl", 0x7D},    {"jge", 0x7D},
+    {"jle", 0x7E},    {"jng", 0x7E},
+    {"jnle", 0x7F},   {"jg", 0x7F},
+    {"loopnz", 0xE0}, {"loopne", 0xE0},
+    {"loopz", 0xE1},  {"loope", 0xE1},
+    {"loop", 0xE2},
+    {"jcxz", 0xE3},
+};
+
+struct AsmOperand
+{
+    enum class Kind : u8 { Register, Memory, Immediate };
+    enum class Size : u8 { Unknown, Byte, Word };
+
+    Kind kind = Kind::Immediate;
+    Size size = Size::Unknown;      // from the register or a byte/word specifier
+    u8 reg = 0;                     // 3-bit register code
+    bool accumulator = false;       // al or ax
+    // Memory operands
+    u8 mod = 0;
+    u8 rm = 0;
+    bool direct = false;
+    int disp = 0;
+    // Immediates
+    int value = 0;
+};
+
+// Code and width of a register name as the decoder's registersMap has them
+bool FindRegister(std::string_view name, u8& code, bool& wide)
+{
+    for (u8 i = 0; i < 8; i++)
+    {
+        for (u8 w = 0; w < 2; w++)
+        {
+            if (name == registerNames[registersMap[i][w]])
+            {
+                code = i;
+                wide = w == 1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Decimal, 0x hex or NASM's trailing h hex
+std::optional<int> ParseAsmNumber(std::string_view text)
+{
+    if (text.empty())
+    {
+        return std::nullopt;
+    }
+    int base = 10;
+    std::string digits(text);
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
+    {
+        base = 16;
+        digits = digits.substr(2);
+    }
+    else if (digits.size() > 1 && (digits.back() == 'h' || digits.back() == 'H') && std::isdigit((unsigned char)digits[0]))
+    {
+        base = 16;
+        digits.pop_back();
+    }
+    int value = 0;
+    for (char c : digits)
+    {
+        const int digit = std::isdigit((unsigned char)c) ? c - '0'
+                        : base == 16 && std::isxdigit((unsigned char)c) ? std::tolower(c) - 'a' + 10
+                        : -1;
+        if (digit < 0 || value > 0x10000)
+        {
+            return std::nullopt;
+        }
+        value = value * base + digit;
+    }
+    return value;
+}
+
+std::string TrimAsm(std::string_view text)
+{
+    const size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos)
+    {
+        return "";
+    }
+    const size_t end = text.find_last_not_of(" \t\r");
+    return std::string(text.substr(begin, end - begin + 1));
+}
+
+std::string LowerAsm(std::string text)
+{
+    for (char& c : text)
+    {
+        c = char(std::tolower((unsigned char)c));
+    }
+    return text;
+}
+
+// Product of numbers, "64*4"
+std::optional<int> ParseAsmTerm(std::string_view text)
+{
+    int product = 1;
+    while (true)
+    {
+        const size_t star = text.find('*');
+        const auto number = ParseAsmNumber(TrimAsm(text.substr(0, star)));
+        if (!number)
+        {
+            return std::nullopt;
+        }
+        product *= *number;
+        if (star == std::string_view::npos)
+        {
+            return product;
+        }
+        text.remove_prefix(star + 1);
+    }
+}
+
+// Term with an optional sign in front, spaces allowed after the sign
+std::optional<int> ParseSignedAsmNumber(std::string_view text)
+{
+    const bool negative = !text.empty() && text.front() == '-';
+    if (!text.empty() && (text.front() == '-' || text.front() == '+'))
+    {
+        text.remove_prefix(1);
+    }
+    const auto number = ParseAsmTerm(text);
+    return number ? std::optional<int>(negative ? -*number : *number) : std::nullopt;
+}
+
+// "[bx + si - 4]", "[1000]", registers in either order
+bool ParseMemoryExpression(std::string_view text, AsmOperand& operand, std::string& error)
+{
+    bool bx = false, bp = false, si = false, di = false, anyRegister = false;
+    int disp = 0;
+    size_t begin = 0;
+    int sign = 1;
+    while (begin <= text.size())
+    {
+        const size_t end = std::min(text.find_first_of("+-", begin), text.size());
+        const std::string term = TrimAsm(text.substr(begin, end - begin));
+        if (term.empty())
+        {
+            // Leading sign or a sign following another one
+            if (end == text.size())
+            {
+                error = "missing term in memory operand";
+                return false;
+            }
+        }
+        else if (term == "bx" || term == "bp" || term == "si" || term == "di")
+        {
+            bool& present = term == "bx" ? bx : term == "bp" ? bp : term == "si" ? si : di;
+            if (present || sign < 0)
+            {
+                error = "bad register term " + term + " in memory operand";
+                return false;
+            }
+            present = anyRegister = true;
+            sign = 1;
+        }
+        else if (const auto number = ParseAsmTerm(term))
+        {
+            disp += sign * *number;
+            sign = 1;
+        }
+        else
+        {
+            error = "unknown term " + term + " in memory operand";
+            return false;
+        }
+        if (end < text.size() && text[end] == '-')
+        {
+            sign = -sign;
+        }
+        begin = end + 1;
+    }
+
+    operand.kind = AsmOperand::Kind::Memory;
+    if ((bx && bp) || (si && di))
+    {
+        error = "no addressing mode combines those registers";
+        return false;
+    }
+    if (!anyRegister)
+    {
+        operand.direct = true;
+        operand.mod = 0;
+        operand.rm = 0b110;
+        operand.disp = disp;
+        return true;
+    }
+    operand.rm = bx && si ? 0 : bx && di ? 1 : bp && si ? 2 : bp && di ? 3 : si ? 4 : di ? 5 : bp ? 6 : 7;
+    operand.disp = disp;
+    // [bp] has no encoding without displacement, mod 0 with rm 6 is the direct address
+    if (disp == 0 && operand.rm != 6)
+    {
+        operand.mod = 0;
+    }
+    else
+    {
+        operand.mod = disp >= -128 && disp <= 127 ? 1 : 2;
+    }
+    return true;
+}
+
+bool ParseAsmOperand(std::string text, AsmOperand& operand, std::string& error)
+{
+    text = LowerAsm(TrimAsm(text));
+    for (const auto& [keyword, size] : { std::pair{"byte", AsmOperand::Size::Byte}, std::pair{"word", AsmOperand::Size::Word} })
+    {
+        const size_t length = std::string_view(keyword).size();
+        if (text.compare(0, length, keyword) == 0 && text.size() > length && (text[length] == ' ' || text[length] == '\t' || text[length] == '['))
+        {
+            operand.size = size;
+            text = TrimAsm(std::string_view(text).substr(length));
+            break;
+        }
+    }
+
+    if (text.empty())
+    {
+        error = "missing operand";
+        return false;
+    }
+    if (text.front() == '[')
+    {
+        if (text.back() != ']')
+        {
+            error = "missing ] in " + text;
+            return false;
+        }
+        return ParseMemoryExpression(std::string_view(text).substr(1, text.size() - 2), operand, error);
+    }
+
+    bool wide = false;
+    if (FindRegister(text, operand.reg, wide))
+    {
+        if (operand.size != AsmOperand::Size::Unknown && (operand.size == AsmOperand::Size::Word) != wide)
+        {
+            error = "size specifier doesn't match register " + text;
+            return false;
+        }
+        operand.kind = AsmOperand::Kind::Register;
+        operand.size = wide ? AsmOperand::Size::Word : AsmOperand::Size::Byte;
+        operand.accumulator = operand.reg == 0;
+        return true;
+    }
+
+    const auto number = ParseSignedAsmNumber(text);
+    if (!number)
+    {
+        error = "unknown operand " + text;
+        return false;
+    }
+    operand.kind = AsmOperand::Kind::Immediate;
+    operand.value = *number;
+    return true;
+}
+
+void EmitWord(std::vector<u8>& image, int value)
+{
+    image.push_back(u8(value));
+    image.push_back(u8(value >> 8));
+}
+
+void EmitModRm(std::vector<u8>& image, u8 reg, const AsmOperand& rm)
+{
+    if (rm.kind == AsmOperand::Kind::Register)
+    {
+        image.push_back(u8(0b11'000'000 | (reg << 3) | rm.reg));
+        return;
+    }
+    image.push_back(u8((rm.mod << 6) | (reg << 3) | rm.rm));
+    if (rm.direct || rm.mod == 2)
+    {
+        EmitWord(image, rm.disp);
+    }
+    else if (rm.mod == 1)
+    {
+        image.push_back(u8(rm.disp));
+    }
+}
+
+bool FitsSignedByte(int value)
+{
+    return value >= -128 && value <= 127;
+}
+
+// mov, add, sub or cmp; opIndex doubles as the /digit of the immediate group
+bool EncodeArithmetic(OpIndex opIndex, const AsmOperand& destination, const AsmOperand& source,
+    std::vector<u8>& image, std::string& error)
+{
+    using Kind = AsmOperand::Kind;
+    using Size = AsmOperand::Size;
+    if (destination.kind == Kind::Immediate)
+    {
+        error = "destination can't be an immediate";
+        return false;
+    }
+    if (destination.kind == Kind::Memory && source.kind == Kind::Memory)
+    {
+        error = "no memory to memory form";
+        return false;
+    }
+
+    const Size size = destination.size != Size::Unknown ? destination.size : source.size;
+    if (size == Size::Unknown)
+    {
+        error = "operation size not specified";
+        return false;
+    }
+    if (source.kind != Kind::Immediate && destination.size != Size::Unknown && source.size != Size::Unknown
+        && destination.size != source.size)
+    {
+        error = "operand sizes don't match";
+        return false;
+    }
+    const u8 w = size == Size::Word ? 1 : 0;
+    const u8 base = opIndex == OpIndex::MOV ? 0x88 : u8(opIndex << 3);
+
+    if (source.kind != Kind::Immediate)
+    {
+        // mov al/ax to and from a direct address has its own short form
+        const AsmOperand& memory = destination.kind == Kind::Memory ? destination : source;
+        const AsmOperand& reg = destination.kind == Kind::Memory ? source : destination;
+        if (opIndex == OpIndex::MOV && memory.kind == Kind::Memory && memory.direct && reg.accumulator)
+        {
+            image.push_back(u8(0xA0 | (destination.kind == Kind::Memory ? 2 : 0) | w));
+            EmitWord(image, memory.disp);
+            return true;
+        }
+        if (source.kind == Kind::Register)
+        {
+            image.push_back(u8(base | w));
+            EmitModRm(image, source.reg, destination);
+        }
+        else
+        {
+            image.push_back(u8(base | 0b10 | w));
+            EmitModRm(image, destination.reg, source);
+        }
+        return true;
+    }
+
+    const int value = source.value;
+    if (w ? value < -32768 || value > 65535 : value < -128 || value > 255)
+    {
+        error = "immediate " + std::to_string(value) + " doesn't fit";
+        return false;
+    }
+    if (opIndex == OpIndex::MOV)
+    {
+        if (destination.kind == Kind::Register)
+        {
+            image.push_back(u8(0xB0 | (w << 3) | destination.reg));
+        }
+        else
+        {
+            image.push_back(u8(0xC6 | w));
+            EmitModRm(image, 0, destination);
+        }
+    }
+    else if (w && FitsSignedByte(value))
+    {
+        image.push_back(0x83);
+        EmitModRm(image, u8(opIndex), destination);
+        image.push_back(u8(value));
+        return true;
+    }
+    else if (destination.kind == Kind::Register && destination.accumulator)
+    {
+        image.push_back(u8(base | 0b100 | w));
+    }
+    else
+    {
+        image.push_back(u8(0x80 | w));
+        EmitModRm(image, u8(opIndex), destination);
+    }
+    if (w)
+    {
+        EmitWord(image, value);
+    }
+    else
+    {
+        image.push_back(u8(value));
+    }
+    return true;
+}
+
+// Splits at top level commas, there are none inside brackets in this subset anyway
+std::vector<std::string> SplitAsmOperands(std::string_view text)
+{
+    std::vector<std::string> operands;
+    size_t begin = 0;
+    while (begin <= text.size())
+    {
+        const size_t end = std::min(text.find(',', begin), text.size());
+        operands.push_back(TrimAsm(text.substr(begin, end - begin)));
+        begin = end + 1;
+    }
+    return operands;
+}
+
+AssembledProgram Assemble(std::string_view source)
+{
+    AssembledProgram program{};
+    std::unordered_map<std::string, int> labels;
+    struct JumpFixup { size_t displacementAt; std::string label; int line; };
+    std::vector<JumpFixup> fixups;
+
+    const auto fail = [&](int line, std::string message) {
+        program.image.clear();
+        program.error = std::move(message);
+        program.errorLine = line;
+        return program;
+    };
+
+    std::istringstream lines{ std::string(source) };
+    std::string rawLine;
+    int lineNumber = 0;
+    while (std::getline(lines, rawLine))
+    {
+        lineNumber++;
+        std::string line = TrimAsm(std::string_view(rawLine).substr(0, rawLine.find(';')));
+
+        // Labels, possibly followed by an instruction on the same line
+        const size_t colon = line.find(':');
+        if (colon != std::string::npos)
+        {
+            const std::string label = TrimAsm(std::string_view(line).substr(0, colon));
+            if (label.empty() || !(std::isalpha((unsigned char)label[0]) || label[0] == '_' || label[0] == '.'))
+            {
+                return fail(lineNumber, "bad label " + label);
+            }
+            if (!labels.emplace(label, int(program.image.size())).second)
+            {
+                return fail(lineNumber, "label " + label + " defined twice");
+            }
+            line = TrimAsm(std::string_view(line).substr(colon + 1));
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+
+        const size_t mnemonicEnd = std::min(line.find_first_of(" \t"), line.size());
+        const std::string mnemonic = LowerAsm(line.substr(0, mnemonicEnd));
+        const std::string rest = TrimAsm(std::string_view(line).substr(mnemonicEnd));
+
+        if (mnemonic == "bits")
+        {
+            if (rest != "16")
+            {
+                return fail(lineNumber, "only bits 16 is supported");
+            }
+            continue;
+        }
+
+        const OpIndex opIndex = mnemonic == "mov" ? OpIndex::MOV : mnemonic == "add" ? OpIndex::ADD
+                              : mnemonic == "sub" ? OpIndex::SUB : mnemonic == "cmp" ? OpIndex::CMP : OpIndex::UNDEFINED;
+        if (opIndex != OpIndex::UNDEFINED)
+        {
+            const std::vector<std::string> operandTexts = SplitAsmOperands(rest);
+            if (operandTexts.size() != 2)
+            {
+                return fail(lineNumber, mnemonic + " takes two operands");
+            }
+            AsmOperand destination{}, sourceOperand{};
+            std::string error;
+            if (!ParseAsmOperand(operandTexts[0], destination, error) || !ParseAsmOperand(operandTexts[1], sourceOperand, error)
+                || !EncodeArithmetic(opIndex, destination, sourceOperand, program.image, error))
+            {
+                return fail(lineNumber, error);
+            }
+            continue;
+        }
+
+        if (mnemonic == "push" || mnemonic == "pop")
+        {
+            AsmOperand operand{};
+            std::string error;
+            if (!ParseAsmOperand(rest, operand, error))
+            {
+                return fail(lineNumber, error);
+            }
+            if (operand.kind != AsmOperand::Kind::Register || operand.size != AsmOperand::Size::Word)
+            {
+                return fail(lineNumber, mnemonic + " takes a word register");
+            }
+            program.image.push_back(u8((mnemonic == "push" ? 0x50 : 0x58) | operand.reg));
+            continue;
+        }
+
+        if (mnemonic == "cli" || mnemonic == "sti" || mnemonic == "iret")
+        {
+            if (!rest.empty())
+            {
+                return fail(lineNumber, mnemonic + " takes no operands");
+            }
+            program.image.push_back(mnemonic == "cli" ? 0xFA : mnemonic == "sti" ? 0xFB : 0xCF);
+            continue;
+        }
+
+        // Port is an 8-bit immediate or dx, data goes through al or ax
+        if (mnemonic == "in" || mnemonic == "out")
+        {
+            const std::vector<std::string> operandTexts = SplitAsmOperands(rest);
+            if (operandTexts.size() != 2)
+            {
+                return fail(lineNumber, mnemonic + " takes two operands");
+            }
+            const bool input = mnemonic == "in";
+            AsmOperand data{}, port{};
+            std::string error;
+            if (!ParseAsmOperand(operandTexts[input ? 0 : 1], data, error) || !ParseAsmOperand(operandTexts[input ? 1 : 0], port, error))
+            {
+                return fail(lineNumber, error);
+            }
+            if (data.kind != AsmOperand::Kind::Register || !data.accumulator)
+            {
+                return fail(lineNumber, mnemonic + " transfers through al or ax");
+            }
+            const u8 opcode = u8(0xE4 | (input ? 0 : 0b10) | (data.size == AsmOperand::Size::Word ? 1 : 0));
+            if (port.kind == AsmOperand::Kind::Register && port.size == AsmOperand::Size::Word && port.reg == 2)
+            {
+                program.image.push_back(opcode | 0b1000);
+            }
+            else if (port.kind == AsmOperand::Kind::Immediate && port.value >= 0 && port.value <= 0xFF)
+            {
+                program.image.push_back(opcode);
+                program.image.push_back(u8(port.value));
+            }
+            else
+            {
+                return fail(lineNumber, "port has to be dx or a byte");
+            }
+            continue;
+        }
+
+        const JumpMnemonic* jump = nullptr;
+        for (const JumpMnemonic& candidate : jumpMnemonics)
+        {
+            if (mnemonic == candidate.name)
+            {
+                jump = &candidate;
+                break;
+            }
+        }
+        if (!jump)
+        {
+            return fail(lineNumber, "unsupported instruction " + mnemonic);
+        }
+
+        const size_t start = program.image.size();
+        program.image.push_back(jump->opcode);
+        program.image.push_back(0);
+        if (!rest.empty() && rest[0] == '$')
+        {
+            // $+n is relative to the start of the jump
+            const std::string offsetText = TrimAsm(std::string_view(rest).substr(1));
+            const auto offset = offsetText.empty() ? std::optional<int>(0) : ParseSignedAsmNumber(offsetText);
+            if (!offset || (!offsetText.empty() && offsetText[0] != '+' && offsetText[0] != '-'))
+            {
+                return fail(lineNumber, "bad jump target " + rest);
+            }
+            const int displacement = *offset - 2;
+            if (!FitsSignedByte(displacement))
+            {
+                return fail(lineNumber, "jump target out of short range");
+            }
+            program.image[start + 1] = u8(displacement);
+        }
+        else
+        {
+            fixups.push_back({ start + 1, rest, lineNumber });
+        }
+    }
+
+    for (const JumpFixup& fixup : fixups)
+    {
+        const auto labelIt = labels.find(fixup.label);
+        if (labelIt == labels.cend())
+        {
+            return fail(fixup.line, "unknown label " + fixup.label);
+        }
+        const int displacement = labelIt->second - int(fixup.displacementAt + 1);
+        if (!FitsSignedByte(displacement))
+        {
+            return fail(fixup.line, "jump to " + fixup.label + " out of short range");
+        }
+        program.image[fixup.displacementAt] = u8(displacement);
+    }
+    return program;
+}
+
+bool IsAssemblySource(const std::string& path)
+{
+    return path.size() > 4 && LowerAsm(path.substr(path.size() - 4)) == ".asm";
+}
+
+// Reads a program image, .asm sources are assembled in process
+bool LoadProgramImage(const std::string& path, std::vector<u8>& image)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "!!! Can't open file " << path << " !!!\n";
+        return false;
+    }
+    std::vector<u8> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!IsAssemblySource(path))
+    {
+        image = std::move(bytes);
+        return true;
+    }
+
+    AssembledProgram program = Assemble(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    if (!program.error.empty())
+    {
+        std::cerr << "!!! " << path << ":" << program.errorLine << ": " << program.error << " !!!\n";
+        return false;
+    }
+    image = std::move(program.image);
+    return true;
+}
+
+// Assembles every .asm in directory that has its prebuilt binary next to it and compares
+// them, returns how many differ
+int CheckAssemblerRoundTrip(const std::string& directory)
+{
+    std::vector<std::filesystem::path> sources;
+    for (const auto& entry : std::filesystem::directory_iterator(directory))
+    {
+        if (IsAssemblySource(entry.path().string()))
+        {
+            sources.push_back(entry.path());
+        }
+    }
+    std::sort(sources.begin(), sources.end());
+
+    int mismatches = 0;
+    for (const std::filesystem::path& source : sources)
+    {
+        std::filesystem::path binary = source;
+        binary.replace_extension();
+        if (!std::filesystem::exists(binary))
+        {
+            continue;
+        }
+
+        std::vector<u8> assembled, expected;
+        const bool ok = LoadProgramImage(source.string(), assembled) && LoadProgramImage(binary.string(), expected);
+        size_t offset = 0;
+        while (offset < assembled.size() && offset < expected.size() && assembled[offset] == expected[offset])
+        {
+            offset++;
+        }
+        std::cout << source.filename().string() << ": ";
+        if (ok && assembled == expected)
+        {
+            std::cout << "matches, " << assembled.size() << " bytes\n";
+            continue;
+        }
+        mismatches++;
+        if (!ok)
+        {
+            std::cout << "failed\n";
+        }
+        else
+        {
+            std::cout << "differs at " << HexString(u16(offset)) << " (" << assembled.size() << " bytes assembled, "
+                << expected.size() << " expected)\n";
+        }
+    }
+    return mismatches;
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "CpuSnapshot.h"
+#include "UndoLog.h"
+#include "Fusion.h"
+
+// Batch runs keep many machines on each worker thread and rotate between them cooperatively.
+// A worker restores job snapshot, runs it for one slice and snapshots it again. Pages are
+// shared copy-on-write, so a switch only copies pages the slices wrote. Unfinished jobs go
+// to the back of their worker's queue, so short jobs never wait behind long ones for more
+// than a slice each. Idle workers steal jobs from the back of other queues. A worker that finds
+// every queue empty exits, the jobs still running belong to workers that requeue them to
+// themselves, so nothing is left for it to steal.
+// Budgets count steps, or estimated clocks when countCycles is set (fusion is off then, as
+// fused groups aren't estimated one by one). Undo log, breakpoints, memory analyzer, framebuffer
+// and devices are per thread, so they stay off on workers whatever the main thread enabled.
+
+struct BatchProgram
+{
+    std::string path;
+    std::unordered_map<int, Operation> operations;
+};
+
+struct BatchConfig
+{
+    unsigned int workers = std::max(1u, std::thread::hardware_concurrency());
+    u64 sliceBudget = 10000;        // steps or clocks per slice
+    u64 jobBudget = 100'000'000;    // steps or clocks per job, 0 is unlimited
+    bool countCycles = false;
+};
+
+struct BatchJob
+{
+    enum class Status : u8 { Runnable, Finished, OverBudget };
+
+    std::shared_ptr<const BatchProgram> program;
+    MachineSnapshot state;
+    Status status = Status::Runnable;
+    u64 steps = 0;
+    u64 cycles = 0;
+    u32 slices = 0;
+};
+
+struct BatchQueue
+{
+    std::mutex mutex;
+    std::deque<BatchJob*> jobs;
+};
+
+struct BatchStats
+{
+    double seconds = 0.0;
+    u64 steals = 0;
+};
+
+// Runs restored job for one slice or until its program ends or job budget runs out
+void RunBatchSlice(BatchJob& job, const BatchConfig& config)
+{
+    const std::unordered_map<int, Operation>& operations = job.program->operations;
+    u64& used = config.countCycles ? job.cycles : job.steps;
+    const u64 sliceEnd = config.jobBudget != 0 ? std::min(used + config.sliceBudget, config.jobBudget) : used + config.sliceBudget;
+
+    executedSteps = job.steps;
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend() && used < sliceEnd)
+    {
+        const Operation& op = operationIt->second;
+        ExecuteStepFast(op);
+        if (config.countCycles)
+        {
+            job.cycles += CycleEstimation(op, lastStringRepetitions);
+        }
+        job.steps = executedSteps;
+        operationIt = operations.find(ipReg);
+    }
+
+    if (operationIt == operations.cend())
+    {
+        job.status = BatchJob::Status::Finished;
+    }
+    else if (config.jobBudget != 0 && used >= config.jobBudget)
+    {
+        job.status = BatchJob::Status::OverBudget;
+    }
+}
+
+// Front of own queue first, otherwise back of another worker's queue
+BatchJob* TakeBatchJob(std::vector<BatchQueue>& queues, unsigned int worker, std::atomic<u64>& steals)
+{
+    {
+        BatchQueue& own = queues[worker];
+        std::lock_guard lock(own.mutex);
+        if (!own.jobs.empty())
+        {
+            BatchJob* job = own.jobs.front();
+            own.jobs.pop_front();
+            return job;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        BatchQueue& victim = queues[(worker + i) % queues.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.jobs.empty())
+        {
+            BatchJob* job = victim.jobs.back();
+            victim.jobs.pop_back();
+            steals.fetch_add(1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void RunBatchWorker(std::vector<BatchQueue>& queues, unsigned int worker, const BatchConfig& config, std::atomic<u64>& steals)
+{
+    while (BatchJob* job = TakeBatchJob(queues, worker, steals))
+    {
+        RestoreSnapshot(job->state);
+        RunBatchSlice(*job, config);
+        job->state = TakeSnapshot();
+        job->slices++;
+
+        if (job->status == BatchJob::Status::Runnable)
+        {
+            BatchQueue& own = queues[worker];
+            std::lock_guard lock(own.mutex);
+            own.jobs.push_back(job);
+        }
+    }
+}
+
+BatchStats RunBatch(std::vector<BatchJob>& jobs, const BatchConfig& config)
+{
+    const unsigned int workerCount = std::max(1u, config.workers);
+    std::vector<BatchQueue> queues(workerCount);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        queues[i % workerCount].jobs.push_back(&jobs[i]);
+    }
+
+    std::atomic<u64> steals{ 0 };
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back(RunBatchWorker, std::ref(queues), i, std::cref(config), std::ref(steals));
+    }
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    BatchStats stats{};
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.steals = steals.load();
+    return stats;
+}
+
+void PrintBatchReport(const std::vector<BatchJob>& jobs, const BatchConfig& config, const BatchStats& stats)
+{
+    u64 finished = 0, totalSteps = 0, totalCycles = 0, totalSlices = 0;
+    std::cout << "Batch: " << jobs.size() << " jobs on " << std::max(1u, config.workers) << " workers, slice "
+        << config.sliceBudget << (config.countCycles ? " clocks" : " steps");
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const BatchJob& job = jobs[i];
+        finished += job.status == BatchJob::Status::Finished;
+        totalSteps += job.steps;
+        totalCycles += job.cycles;
+        totalSlices += job.slices;
+        if (job.status == BatchJob::Status::OverBudget)
+        {
+            std::cout << "\n\tjob " << i << " " << job.program->path << ": over budget after " << job.steps << " steps";
+            if (config.countCycles)
+            {
+                std::cout << ", " << job.cycles << " clocks";
+            }
+        }
+    }
+
+    std::cout << "\nFinished: " << finished << ", over budget: " << jobs.size() - finished
+        << "\nSteps: " << totalSteps;
+    if (config.countCycles)
+    {
+        std::cout << ", clocks: " << totalCycles;
+    }
+    std::cout << ", slices: " << totalSlices << ", steals: " << stats.steals
+        << "\nTime: " << stats.seconds << " s, " << u64(totalSteps / std::max(stats.seconds, 1e-9)) << " steps/s, "
+        << u64(jobs.size() / std::max(stats.seconds, 1e-9)) << " jobs/s\n";
+}
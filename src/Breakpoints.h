@@ -0,0 +1,219 @@
+#pragma once
+#include <bitset>
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuNames.h"
+#include "Helpers.h"
+
+// Breakpoints are kept in per-address bitmaps. Nothing is checked unless breakpointsArmed is set,
+// and even then a bitmap bit is tested first, so unarmed addresses stay cheap.
+// Bitmaps and conditions are filled on the main thread before the run and only read after.
+// breakpointsArmed and breakpointHit are per thread, so batch workers never look at them
+
+struct RegisterCondition
+{
+    RegisterIndex reg = RegisterIndex::None;
+    u16 value = 0;
+
+    bool Holds() const
+    {
+        if (reg == RegisterIndex::None)
+        {
+            return true;
+        }
+        return IsByteRegister(reg) ? *GetByteRegisterMem(reg) == value : *GetRegisterMem(reg) == value;
+    }
+};
+
+struct BreakpointHit
+{
+    enum class Kind { None, Code, Register, Read, Write };
+
+    Kind kind = Kind::None;
+    u16 address = 0;
+    s16 ip = 0;
+};
+
+std::bitset<mainMemoryLimit> codeBreakpoints;
+std::bitset<mainMemoryLimit> readWatchpoints;
+std::bitset<mainMemoryLimit> writeWatchpoints;
+std::unordered_map<u16, RegisterCondition> codeBreakpointConditions;
+std::vector<RegisterCondition> registerBreakpoints; // checked before every instruction
+thread_local bool breakpointsArmed = false;
+thread_local BreakpointHit breakpointHit{};
+
+void AddCodeBreakpoint(u16 ip, RegisterCondition condition = {})
+{
+    codeBreakpoints.set(ip);
+    if (condition.reg != RegisterIndex::None)
+    {
+        codeBreakpointConditions[ip] = condition;
+    }
+    breakpointsArmed = true;
+}
+
+void AddRegisterBreakpoint(RegisterCondition condition)
+{
+    registerBreakpoints.push_back(condition);
+    breakpointsArmed = true;
+}
+
+void AddWatchpoint(u16 address, u16 length, bool onRead, bool onWrite)
+{
+    for (u16 i = 0; i < length; i++)
+    {
+        if (onRead)     readWatchpoints.set(u16(address + i));
+        if (onWrite)    writeWatchpoints.set(u16(address + i));
+    }
+    breakpointsArmed = true;
+}
+
+// Called before instruction at ipReg is executed
+bool CheckCodeBreakpoints()
+{
+    if (codeBreakpoints[(u16)ipReg])
+    {
+        auto conditionIt = codeBreakpointConditions.find((u16)ipReg);
+        if (conditionIt == codeBreakpointConditions.cend() || conditionIt->second.Holds())
+        {
+            breakpointHit = {BreakpointHit::Kind::Code, (u16)ipReg, ipReg};
+            return true;
+        }
+    }
+    for (const auto& condition : registerBreakpoints)
+    {
+        if (condition.Holds())
+        {
+            breakpointHit = {BreakpointHit::Kind::Register, (u16)condition.reg, ipReg};
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called on memory access, instruction still finishes and execution stops after it
+void CheckWatchpoint(u16 address, bool wide, bool write)
+{
+    const auto& watchpoints = write ? writeWatchpoints : readWatchpoints;
+    if (watchpoints[address] || (wide && watchpoints[u16(address + 1)]))
+    {
+        breakpointHit = {write ? BreakpointHit::Kind::Write : BreakpointHit::Kind::Read, address, ipReg};
+    }
+}
+
+std::string BreakpointHitStr(const BreakpointHit& hit)
+{
+    switch (hit.kind)
+    {
+    case BreakpointHit::Kind::Code:     return "Breakpoint at ip:" + HexString(hit.address);
+    case BreakpointHit::Kind::Register: return std::string("Register breakpoint on ") + registerNames[hit.address] + " at ip:" + HexString(hit.ip);
+    case BreakpointHit::Kind::Read:     return "Read watchpoint " + HexString(hit.address) + " at ip:" + HexString(hit.ip);
+    case BreakpointHit::Kind::Write:    return "Write watchpoint " + HexString(hit.address) + " at ip:" + HexString(hit.ip);
+    default:
+        return "";
+    }
+}
+
+RegisterIndex ParseRegisterName(const std::string& name)
+{
+    for (int i = RegisterIndex::al; i <= RegisterIndex::di; i++)
+    {
+        if (name == registerNames[i])
+        {
+            return (RegisterIndex)i;
+        }
+    }
+    return RegisterIndex::None;
+}
+
+// Whole string as a number, decimal or 0x prefixed hex
+bool ParseInteger(const std::string& str, long& value)
+{
+    if (str.empty())
+    {
+        return false;
+    }
+    char* end = nullptr;
+    value = std::strtol(str.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+// "cx=5" or "ch=0xf4", false for unknown registers and values that don't fit them
+bool ParseRegisterCondition(const std::string& str, RegisterCondition& condition)
+{
+    const auto separator = str.find('=');
+    long value = 0;
+    if (separator == std::string::npos || !ParseInteger(str.substr(separator + 1), value))
+    {
+        return false;
+    }
+    condition.reg = ParseRegisterName(str.substr(0, separator));
+    const long limit = condition.reg != RegisterIndex::None && IsByteRegister(condition.reg) ? 0xFF : 0xFFFF;
+    if (condition.reg == RegisterIndex::None || value < -(limit + 1) / 2 || value > limit)
+    {
+        return false;
+    }
+    condition.value = u16(value & limit);
+    return true;
+}
+
+// "ip" or "ip:reg=value", false when either part is malformed
+bool ParseCodeBreakpoint(const std::string& str)
+{
+    const auto separator = str.find(':');
+    long ip = 0;
+    RegisterCondition condition{};
+    if (!ParseInteger(str.substr(0, separator), ip) || ip < 0 || ip > 0xFFFF
+        || (separator != std::string::npos && !ParseRegisterCondition(str.substr(separator + 1), condition)))
+    {
+        return false;
+    }
+    AddCodeBreakpoint(u16(ip), condition);
+    return true;
+}
+
+// "address[:length][:r|w|rw]", false for malformed numbers, zero length or unknown access
+bool ParseWatchpoint(const std::string& str)
+{
+    std::string parts[3];
+    int partCount = 0;
+    size_t begin = 0;
+    while (true)
+    {
+        if (partCount == 3)
+        {
+            return false;
+        }
+        const auto end = str.find(':', begin);
+        parts[partCount++] = str.substr(begin, end - begin);
+        if (end == std::string::npos) break;
+        begin = end + 1;
+    }
+
+    long address = 0;
+    if (!ParseInteger(parts[0], address) || address < 0 || address > 0xFFFF)
+    {
+        return false;
+    }
+    long length = 1;
+    std::string access = "w";
+    for (int i = 1; i < partCount; i++)
+    {
+        if (i == partCount - 1 && (parts[i] == "r" || parts[i] == "w" || parts[i] == "rw"))
+        {
+            access = parts[i];
+        }
+        else if (i != 1 || !ParseInteger(parts[i], length) || length < 1 || length > 0xFFFF)
+        {
+            return false;
+        }
+    }
+    AddWatchpoint(u16(address), u16(length), access.find('r') != std::string::npos, access.find('w') != std::string::npos);
+    return true;
+}
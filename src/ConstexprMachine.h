@@ -0,0 +1,147 @@
+#pragma once
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <span>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "DecoderOperands.h"
+#include "CycleEstimation.h"
+#include "Decoder.h"
+#include "MachineState.h"
+
+// Listings known at build time can be decoded and run by the compiler. DecodeConstexpr decodes
+// a byte array with DecodeOperation into operations indexed by their offset, and RunConstexpr
+// executes them on a machine held in a local object instead of the thread_local globals, so its
+// final registers, memory and clocks can be used as constants or checked with static_assert.
+// Only mov, add, sub and cmp, jumps and loops are run, anything else fails constant evaluation.
+// The machine is a state accessor of MachineState.h, so results follow ExecuteOp and clocks follow
+// CycleEstimation. Memory is MemorySize bytes and addresses wrap around it, so small kernels don't
+// pay for a full 64K array at compile time.
+
+template<size_t Size>
+struct ConstexprProgram
+{
+    std::array<Operation, Size> operations{};   // at the offset of their first byte
+    std::array<bool, Size> starts{};
+
+    constexpr bool Contains(int ip) const
+    {
+        return ip >= 0 && ip < int(Size) && starts[ip];
+    }
+};
+
+template<size_t Size>
+constexpr ConstexprProgram<Size> DecodeConstexpr(const std::array<u8, Size>& bytes)
+{
+    ConstexprProgram<Size> program{};
+    int byteIndex = 0;
+    while (byteIndex < int(Size))
+    {
+        const int opBeginByte = byteIndex;
+        program.operations[opBeginByte] = DecodeOperation(std::span<const u8>(bytes), byteIndex);
+        program.starts[opBeginByte] = true;
+        byteIndex++;
+    }
+    return program;
+}
+
+template<size_t MemorySize = mainMemoryLimit>
+struct ConstexprMachine
+{
+    u16 registers[8] = {};      // same slots as registersMem
+    bool zero = false;
+    bool sign = false;
+    s16 ip = 0;
+    std::array<u8, MemorySize> memory{};
+    u64 clocks = 0;
+    u64 steps = 0;
+
+    constexpr u16& Slot(int slot) { return registers[slot]; }
+
+    constexpr u16 ReadMemory(u16 address, bool wide) const
+    {
+        const u8 low = memory[address % MemorySize];
+        return wide ? u16(low | (memory[u16(address + 1) % MemorySize] << 8)) : low;
+    }
+
+    constexpr void WriteMemory(u16 address, bool wide, u16 value)
+    {
+        memory[address % MemorySize] = u8(value);
+        if (wide)
+        {
+            memory[u16(address + 1) % MemorySize] = u8(value >> 8);
+        }
+    }
+
+    constexpr void SetFlags(bool zeroFlag, bool signFlag)
+    {
+        zero = zeroFlag;
+        sign = signFlag;
+    }
+
+    // Executes operation at ip and moves ip to the next one
+    constexpr void Step(const Operation& op)
+    {
+        bool taken = false;
+        switch (op.type)
+        {
+        case Operation::Type::Operation:
+            ExecuteArithmetic(*this, op);
+            break;
+        case Operation::Type::Jump:
+            taken = IsJumpConditionMet(op.opJumpIndex, zero, sign);
+            break;
+        case Operation::Type::Loop:
+        {
+            u16& cx = registers[GetRegisterSlot(RegisterIndex::cx)];
+            if (op.opLoopIndex == OpLoop::jcxz)
+            {
+                taken = cx == 0;
+            }
+            else
+            {
+                cx -= 1;
+                taken = IsLoopConditionMet(op.opLoopIndex, cx, zero);
+            }
+            break;
+        }
+        default:
+            assert(false);
+            break;
+        }
+        ip += taken ? op.operands[0].jump.value : s16(op.size + 1);
+        clocks += CycleEstimation(op, staticStringRepetitions);
+        steps++;
+    }
+};
+
+// Runs from machine.ip until it leaves the program or maxSteps operations ran
+template<size_t Size, size_t MemorySize = mainMemoryLimit>
+constexpr ConstexprMachine<MemorySize> RunConstexpr(const ConstexprProgram<Size>& program,
+    ConstexprMachine<MemorySize> machine = {}, u64 maxSteps = 1'000'000)
+{
+    while (program.Contains(machine.ip) && machine.steps < maxSteps)
+    {
+        machine.Step(program.operations[machine.ip]);
+    }
+    return machine;
+}
+
+// Kernel decoded and run by the compiler, the build breaks when decoding, execution or clocks drift:
+//     mov cx, 5 / mov bx, 0x100 / l: add word [bx + 2], cx / add bx, 2 / sub cx, 1 / jne l
+namespace ConstexprSelfCheck
+{
+    constexpr std::array<u8, 17> kernel = {
+        0xB9, 0x05, 0x00, 0xBB, 0x00, 0x01, 0x01, 0x4F, 0x02,
+        0x83, 0xC3, 0x02, 0x83, 0xE9, 0x01, 0x75, 0xF5,
+    };
+    constexpr ConstexprMachine<1024> result = RunConstexpr(DecodeConstexpr(kernel), ConstexprMachine<1024>{});
+
+    static_assert(result.ip == 17 && result.steps == 22 && result.clocks == 173);
+    static_assert(result.registers[GetRegisterSlot(RegisterIndex::bx)] == 0x10A);
+    static_assert(result.registers[GetRegisterSlot(RegisterIndex::cx)] == 0 && result.zero);
+    static_assert(result.ReadMemory(0x102, true) == 5 && result.ReadMemory(0x10A, true) == 1);
+}
@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuOperations.h"
+
+// Splits decoded operations into basic blocks. A block starts at program entry,
+// at every jump target and right after every jump; it ends with a jump or before the next leader.
+// Successors that don't point at a decoded operation mean the program stops there.
+// Calls count as jumps that fall through to their return address, returns have no successors.
+
+struct BasicBlock
+{
+    u16 start = 0;
+    std::vector<u16> operationIps;
+    int taken = -1;         // jump target, -1 if block doesn't end with a jump
+    int fallthrough = -1;   // next ip when jump is not taken or block just ends
+    std::vector<u16> predecessors;
+};
+
+struct ControlFlowGraph
+{
+    u16 entry = 0;
+    std::map<u16, BasicBlock> blocks;
+
+    const BasicBlock* Find(int ip) const
+    {
+        auto blockIt = blocks.find((u16)ip);
+        return ip >= 0 && blockIt != blocks.cend() ? &blockIt->second : nullptr;
+    }
+
+    // Successors that are blocks, exits out of the program are left out
+    std::vector<u16> Successors(const BasicBlock& block) const
+    {
+        std::vector<u16> successors;
+        for (int next : {block.taken, block.fallthrough})
+        {
+            if (Find(next) && std::find(successors.begin(), successors.end(), (u16)next) == successors.end())
+            {
+                successors.push_back((u16)next);
+            }
+        }
+        return successors;
+    }
+};
+
+// Loop found from back edges, blocks of loops sharing a header are merged
+struct NaturalLoop
+{
+    u16 header = 0;
+    std::vector<u16> latches;   // blocks jumping back to header
+    std::set<u16> body;         // header included
+    int parent = -1;            // innermost enclosing loop, index into the loops vector
+};
+
+u16 JumpTarget(u16 ip, const Operation& op)
+{
+    return u16(ip + op.operands[0].jump.value);
+}
+
+ControlFlowGraph BuildControlFlowGraph(const std::unordered_map<int, Operation>& operations, u16 entry = 0)
+{
+    std::vector<u16> ips;
+    ips.reserve(operations.size());
+    for (const auto& [ip, op] : operations)
+    {
+        ips.push_back((u16)ip);
+    }
+    std::sort(ips.begin(), ips.end());
+
+    std::set<u16> leaders = {entry};
+    for (u16 ip : ips)
+    {
+        const Operation& op = operations.at(ip);
+        if (IsBranch(op))
+        {
+            if (!IsReturn(op))
+            {
+                leaders.insert(JumpTarget(ip, op));
+            }
+            leaders.insert(u16(ip + op.size + 1));
+        }
+    }
+
+    ControlFlowGraph cfg{};
+    cfg.entry = entry;
+    BasicBlock* current = nullptr;
+    for (u16 ip : ips)
+    {
+        if (!current || leaders.count(ip))
+        {
+            if (current && current->taken < 0 && current->fallthrough < 0)
+            {
+                current->fallthrough = ip;
+            }
+            current = &cfg.blocks[ip];
+            current->start = ip;
+        }
+
+        const Operation& op = operations.at(ip);
+        current->operationIps.push_back(ip);
+        const u16 nextIp = u16(ip + op.size + 1);
+        if (IsReturn(op))
+        {
+            current = nullptr;  // return address isn't known statically
+        }
+        else if (IsBranch(op))
+        {
+            current->taken = JumpTarget(ip, op);
+            current->fallthrough = nextIp;  // for calls, where the callee returns to
+            current = nullptr;
+        }
+        else if (!operations.count(nextIp))
+        {
+            current->fallthrough = nextIp;
+            current = nullptr;
+        }
+    }
+
+    for (auto& [start, block] : cfg.blocks)
+    {
+        for (u16 next : cfg.Successors(block))
+        {
+            cfg.blocks[next].predecessors.push_back(start);
+        }
+    }
+    return cfg;
+}
+
+// Blocks reachable from entry, in reverse post order
+std::vector<u16> ReversePostOrder(const ControlFlowGraph& cfg)
+{
+    std::vector<u16> order;
+    std::set<u16> visited;
+    std::vector<std::pair<u16, size_t>> stack;
+    if (cfg.Find(cfg.entry))
+    {
+        stack.push_back({cfg.entry, 0});
+        visited.insert(cfg.entry);
+    }
+    while (!stack.empty())
+    {
+        auto& [start, nextIndex] = stack.back();
+        const std::vector<u16> successors = cfg.Successors(*cfg.Find(start));
+        if (nextIndex < successors.size())
+        {
+            const u16 next = successors[nextIndex++];
+            if (visited.insert(next).second)
+            {
+                stack.push_back({next, 0});
+            }
+            continue;
+        }
+        order.push_back(start);
+        stack.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// Dominator sets of reachable blocks, by iterating to a fixed point
+std::map<u16, std::set<u16>> ComputeDominators(const ControlFlowGraph& cfg)
+{
+    const std::vector<u16> order = ReversePostOrder(cfg);
+    const std::set<u16> all(order.begin(), order.end());
+
+    std::map<u16, std::set<u16>> dominators;
+    for (u16 start : order)
+    {
+        dominators[start] = start == cfg.entry ? std::set<u16>{start} : all;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (u16 start : order)
+        {
+            if (start == cfg.entry)
+            {
+                continue;
+            }
+            std::set<u16> result = all;
+            for (u16 predecessor : cfg.Find(start)->predecessors)
+            {
+                auto dominatorsIt = dominators.find(predecessor);
+                if (dominatorsIt == dominators.end())
+                {
+                    continue; // unreachable predecessor
+                }
+                std::set<u16> intersection;
+                std::set_intersection(result.begin(), result.end(), dominatorsIt->second.begin(), dominatorsIt->second.end(),
+                    std::inserter(intersection, intersection.begin()));
+                result = std::move(intersection);
+            }
+            result.insert(start);
+            if (result != dominators[start])
+            {
+                dominators[start] = std::move(result);
+                changed = true;
+            }
+        }
+    }
+    return dominators;
+}
+
+// Loops from edges whose target dominates their source, sorted from outermost to innermost
+std::vector<NaturalLoop> FindNaturalLoops(const ControlFlowGraph& cfg)
+{
+    const auto dominators = ComputeDominators(cfg);
+
+    std::map<u16, NaturalLoop> loopsByHeader;
+    for (const auto& [start, blockDominators] : dominators)
+    {
+        for (u16 next : cfg.Successors(*cfg.Find(start)))
+        {
+            if (!blockDominators.count(next))
+            {
+                continue;
+            }
+            NaturalLoop& loop = loopsByHeader[next];
+            loop.header = next;
+            loop.latches.push_back(start);
+            loop.body.insert(next);
+
+            // Everything reaching the latch without passing the header
+            std::vector<u16> worklist = {start};
+            while (!worklist.empty())
+            {
+                const u16 current = worklist.back();
+                worklist.pop_back();
+                if (!loop.body.insert(current).second)
+                {
+                    continue;
+                }
+                for (u16 predecessor : cfg.Find(current)->predecessors)
+                {
+                    if (dominators.count(predecessor))
+                    {
+                        worklist.push_back(predecessor);
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<NaturalLoop> loops;
+    for (auto& [header, loop] : loopsByHeader)
+    {
+        loops.push_back(std::move(loop));
+    }
+    std::stable_sort(loops.begin(), loops.end(), [](const NaturalLoop& a, const NaturalLoop& b) {
+        return a.body.size() > b.body.size();
+    });
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        for (size_t outer = 0; outer < i; outer++)
+        {
+            if (loops[outer].body.count(loops[i].header))
+            {
+                loops[i].parent = int(outer); // later ones are smaller, so innermost wins
+            }
+        }
+    }
+    return loops;
+}
+
+// Smallest i with base + i * stride == 0 in 16 bits, -1 if there is none
+int SolveTripIndex(u16 base, u16 stride)
+{
+    if (base == 0)
+    {
+        return 0;
+    }
+    if (stride == 0)
+    {
+        return -1;
+    }
+    const int shift = std::countr_zero(stride);
+    if ((base & ((1u << shift) - 1)) != 0)
+    {
+        return -1;
+    }
+
+    // Inverse of odd stride part by Newton iterations, every one doubles correct bits
+    const u32 modMask = (1u << (16 - shift)) - 1;
+    const u32 odd = stride >> shift;
+    u32 inverse = odd;
+    for (int i = 0; i < 4; i++)
+    {
+        inverse *= 2 - odd * inverse;
+    }
+    const u32 target = u16(-base);
+    return int(((target >> shift) * inverse) & modMask);
+}
@@ -8,6 +8,15 @@
 #include "Helpers.h"
 #include "CpuOperations.h"
 #include "DecoderOperands.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+#include "Framebuffer.h"
+#include "MemoryAnalyzer.h"
+#include "StringOperations.h"
+#include "Stack.h"
+#include "Devices.h"
+#include "ExecutionPolicies.h"
+#include "MachineState.h"
 
 std::string OutputChangeInFlags(const bool* prevFlags)
 {
@@ -24,98 +33,218 @@ std::string OutputChangeInFlags(const bool* prevFlags)
     return "flags: " + prevFlagsStr + "->" + currFlagsStr;
 }
 
-std::string ExecuteOp(OpIndex opIndex, const Operand operands[2])
+// Trace string is only built when Trace is set
+template<bool Trace, typename Watch, typename Profiler, typename Undo = RuntimeUndo, typename Framebuffer = RuntimeFramebuffer>
+std::string ExecuteOpWith(OpIndex opIndex, const Operand operands[2])
 {
     bool prevFlags[Flag::FLAG_COUNT] = {};
-    for (int i : flags)
-        prevFlags[i] = flags[i];
+    if constexpr (Trace)
+    {
+        for (int i : flags)
+            prevFlags[i] = flags[i];
+    }
 
-    u16 prevDestData;
+    u16 prevDestData = 0;
+    u16 destAddress = 0;
     std::string regName;
     MemoryAccess destination = [&](){
         MemoryAccess dest{};
         switch (operands[0].type)
         {
         case Operand::Type::Register:
-            dest.type = MemoryAccess::Type::Full;
-            dest.full = GetRegisterMem(operands[0].reg);
-            prevDestData = *dest;
-            regName = std::string(" ; ") + registerNames[operands[0].reg] + ":";
+            if (IsByteRegister(operands[0].reg))
+            {
+                dest.type = MemoryAccess::Type::Byte;
+                dest.byte = GetByteRegisterMem(operands[0].reg);
+            }
+            else
+            {
+                dest.type = MemoryAccess::Type::Full;
+                dest.full = GetRegisterMem(operands[0].reg);
+            }
+            if constexpr (Trace)
+            {
+                prevDestData = *dest;
+                regName = std::string(" ; ") + registerNames[operands[0].reg] + ":";
+            }
             break;
         case Operand::Type::Memory:
             dest.type = operands[0].mem.pointsToWord ? MemoryAccess::Type::Word : MemoryAccess::Type::Byte;
-            dest.SetAddress(&mainMemory[operands[0].mem.Evaluate()]);
-            prevDestData = *dest;
-            regName = std::string(" ; ") + registerNames[operands[0].reg] + ":";
+            destAddress = operands[0].mem.Evaluate();
+            dest.SetAddress(destAddress);
+            if constexpr (Watch::enabled)
+            {
+                if (opIndex != OpIndex::MOV) Watch::Check(destAddress, operands[0].mem.pointsToWord, false);
+                if (opIndex != OpIndex::CMP) Watch::Check(destAddress, operands[0].mem.pointsToWord, true);
+            }
+            if constexpr (Profiler::enabled)
+            {
+                if (opIndex != OpIndex::MOV) Profiler::Access(destAddress, operands[0].mem.pointsToWord, false);
+                if (opIndex != OpIndex::CMP) Profiler::Access(destAddress, operands[0].mem.pointsToWord, true);
+            }
+            if constexpr (Trace)
+            {
+                prevDestData = *dest;
+                regName = std::string(" ; ") + registerNames[operands[0].reg] + ":";
+            }
             break;
             // TODO: add more destinations
+        default:
+            break;
         }
         assert(dest.type != MemoryAccess::Type::None);
         return dest;
     }();
 
-    u16 data;
+    u16 data = 0;
     switch (operands[1].type)
     {
     case Operand::Type::Register:
-        data = *GetRegisterMem(operands[1].reg);
+        data = IsByteRegister(operands[1].reg) ? *GetByteRegisterMem(operands[1].reg) : *GetRegisterMem(operands[1].reg);
         break;
     case Operand::Type::Immediate:
         data = operands[1].immVal.value;
         break;
     case Operand::Type::Memory:
         {
+            const u16 srcAddress = operands[1].mem.Evaluate();
             MemoryAccess memAccess{};
             memAccess.type = operands[1].mem.pointsToWord ? MemoryAccess::Type::Word : MemoryAccess::Type::Byte;
-            memAccess.SetAddress(&mainMemory[operands[1].mem.Evaluate()]);
+            memAccess.SetAddress(srcAddress);
             data = *memAccess;
+            Watch::Check(srcAddress, operands[1].mem.pointsToWord, false);
+            Profiler::Access(srcAddress, operands[1].mem.pointsToWord, false);
         }
         break;
         // TODO: add more data retrieval
+    default:
+        assert(false);
+        break;
+    }
+
+    if (opIndex != OpIndex::CMP)
+    {
+        if (operands[0].type == Operand::Type::Memory)
+        {
+            Undo::Memory(destAddress, operands[0].mem.pointsToWord);
+            MarkMemoryWritten(destAddress, operands[0].mem.pointsToWord);
+            Framebuffer::Written(destAddress, operands[0].mem.pointsToWord);
+        }
+        else
+        {
+            Undo::Register(GetRegisterMem(operands[0].reg));
+        }
+    }
+    if (opIndex != OpIndex::MOV)
+    {
+        Undo::Flags();
     }
 
     // Execute operation
-    u16 newValue = 0;
-    switch (opIndex)
+    const bool wide = destination.IsWide();
+    const u16 newValue = ArithmeticResult(opIndex, opIndex == OpIndex::MOV ? 0 : *destination, data, wide);
+    if (opIndex != OpIndex::CMP)
     {
-    case OpIndex::MOV:
-        newValue = data;
-        destination.SetData(data);
-        break;
-    case OpIndex::ADD:
-        newValue = destination + data;
-        destination.SetData(newValue);
-        break;
-    case OpIndex::SUB:
-        newValue = destination - data;
         destination.SetData(newValue);
-        break;
-    case OpIndex::CMP:
-        newValue = destination - data;
-        break;
     }
 
     // Check flags and format output
-    switch (opIndex)
+    if (opIndex != OpIndex::MOV)
     {
-    case OpIndex::MOV:
-        return regName + HexString(prevDestData) + " -> " + HexString(newValue);
-        break;
-    case OpIndex::ADD:
-    case OpIndex::SUB:
         flags[Flag::FLAG_ZERO] = newValue == 0;
-        flags[Flag::FLAG_SIGNED] = destination.IsWide()
-            ? (newValue) & 0x8000
-            : (newValue) & 0x80;
-        return regName + HexString(prevDestData) + " -> " + HexString(newValue) + "\t" + OutputChangeInFlags(prevFlags);
-    case OpIndex::CMP:
-        flags[Flag::FLAG_ZERO] = newValue == 0;
-        flags[Flag::FLAG_SIGNED] = destination.IsWide()
-            ? (newValue) & 0x8000
-            : (newValue) & 0x80;
-        return OutputChangeInFlags(prevFlags);
+        flags[Flag::FLAG_SIGNED] = ArithmeticSign(newValue, wide);
+    }
+    if constexpr (Trace)
+    {
+        switch (opIndex)
+        {
+        case OpIndex::MOV:
+            return regName + HexString(prevDestData) + " -> " + HexString(newValue);
+        case OpIndex::ADD:
+        case OpIndex::SUB:
+            return regName + HexString(prevDestData) + " -> " + HexString(newValue) + "\t" + OutputChangeInFlags(prevFlags);
+        case OpIndex::CMP:
+            return OutputChangeInFlags(prevFlags);
+        default:
+            break;
+        }
+        assert(false);
     }
-
-    assert(false);
     return "";
-}
\ No newline at end of file
+}
+
+std::string ExecuteOp(OpIndex opIndex, const Operand operands[2])
+{
+    return ExecuteOpWith<true, RuntimeWatchpoints, RuntimeProfiler>(opIndex, operands);
+}
+
+template<typename Undo = RuntimeUndo>
+bool IsJumpTaken(const Operation& op)
+{
+    if (op.type == Operation::Type::Loop)
+    {
+        u16* cx = GetRegisterMem(RegisterIndex::cx);
+        if (op.opLoopIndex == OpLoop::jcxz)
+        {
+            return *cx == 0;
+        }
+
+        Undo::Register(cx);
+        *cx -= 1;
+        return IsLoopConditionMet(op.opLoopIndex, *cx);
+    }
+    return IsJumpConditionMet(op.opJumpIndex);
+}
+
+// Executes operation located at ipReg and moves ipReg to the next one.
+// String, stack and system operations check undo log and framebuffer at runtime
+template<bool Trace, typename Watch, typename Profiler, typename Undo = RuntimeUndo, typename Framebuffer = RuntimeFramebuffer>
+std::string ExecuteStepWith(const Operation& op)
+{
+    Undo::Step();
+
+    std::string trace;
+    const s16 prevIp = ipReg;
+    switch (op.type)
+    {
+    case Operation::Type::Operation:
+        trace = ExecuteOpWith<Trace, Watch, Profiler, Undo, Framebuffer>(op.opIndex, op.operands);
+        ipReg += op.size + 1;
+        break;
+    case Operation::Type::Jump:
+    case Operation::Type::Loop:
+        if (IsJumpTaken<Undo>(op))
+        {
+            ipReg += op.operands[0].jump.value; // disp is negative (future me: or is it?) (futurer me: this is handled by default right?)
+        }
+        else
+        {
+            ipReg += op.size + 1;
+        }
+        break;
+    case Operation::Type::String:
+        if (ExecuteStringOp(op, Trace ? &trace : nullptr))
+        {
+            ipReg += op.size + 1;
+        }
+        break;
+    case Operation::Type::Stack:
+        ExecuteStackOp(op, Trace ? &trace : nullptr);
+        break;
+    case Operation::Type::System:
+        ExecuteSystemOp(op, Trace ? &trace : nullptr);
+        break;
+    default:
+        break;
+    }
+    if constexpr (Trace)
+    {
+        return trace + " ip:" + HexString(prevIp) + " -> " + HexString(ipReg);
+    }
+    return trace;
+}
+
+std::string ExecuteStep(const Operation& op)
+{
+    return ExecuteStepWith<true, RuntimeWatchpoints, RuntimeProfiler>(op);
+}
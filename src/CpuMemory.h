@@ -2,7 +2,7 @@
 
 #include <cassert>
 
-enum Flag { FLAG_ZERO, FLAG_SIGNED,   FLAG_COUNT };
+enum Flag { FLAG_ZERO, FLAG_SIGNED, FLAG_INTERRUPT,   FLAG_COUNT };
 
 enum RegisterIndex
 {
@@ -28,39 +28,82 @@ constexpr RegisterIndex registersMap[][2] = {
     {RegisterIndex::bh, RegisterIndex::di},
 };
 
-u16 registersMem[8] = {};
+// Machine state is per thread, each batch worker runs its own machine
+thread_local u16 registersMem[8] = {};
 
-u16* GetRegisterMem(RegisterIndex regIndex)
+// Index of the word in registersMem that holds the register
+constexpr int GetRegisterSlot(RegisterIndex regIndex)
 {
     switch (regIndex)
     {
     case None:  assert(false); return 0;    break;
     case al:
     case ah:
-    case ax:    return &registersMem[0];    break;
+    case ax:    return 0;   break;
     case cl:
     case ch:
-    case cx:    return &registersMem[1];    break;
+    case cx:    return 1;   break;
     case dl:
     case dh:
-    case dx:    return &registersMem[2];    break;
+    case dx:    return 2;   break;
     case bl:
     case bh:
-    case bx:    return &registersMem[3];    break;
-    case sp:    return &registersMem[4];    break;
-    case bp:    return &registersMem[5];    break;
-    case si:    return &registersMem[6];    break;
-    case di:    return &registersMem[7];    break;
+    case bx:    return 3;   break;
+    case sp:    return 4;   break;
+    case bp:    return 5;   break;
+    case si:    return 6;   break;
+    case di:    return 7;   break;
     }
 
     assert(false);
     return 0;
 }
 
-bool flags[Flag::FLAG_COUNT] = {};
+u16* GetRegisterMem(RegisterIndex regIndex)
+{
+    return &registersMem[GetRegisterSlot(regIndex)];
+}
+
+// al/ah style registers live in low/high byte of their word (host is little endian)
+constexpr bool IsByteRegister(RegisterIndex regIndex)
+{
+    return regIndex == al || regIndex == ah || regIndex == bl || regIndex == bh
+        || regIndex == cl || regIndex == ch || regIndex == dl || regIndex == dh;
+}
+
+constexpr bool IsHighByteRegister(RegisterIndex regIndex)
+{
+    return regIndex == ah || regIndex == bh || regIndex == ch || regIndex == dh;
+}
+
+u8* GetByteRegisterMem(RegisterIndex regIndex)
+{
+    return reinterpret_cast<u8*>(GetRegisterMem(regIndex)) + IsHighByteRegister(regIndex);
+}
+
+thread_local bool flags[Flag::FLAG_COUNT] = {};
+
+// ip is kept apart from registersMem, as it's a "hidden" register
+thread_local s16 ipReg = 0;
 
 constexpr unsigned int mainMemoryLimit = 256 * 256;
-u8 mainMemory[mainMemoryLimit] = {};
+thread_local u8 mainMemory[mainMemoryLimit] = {};
+
+// Memory is tracked in pages so snapshots can share unchanged parts of memory
+// and restores only have to copy back what was written since
+constexpr unsigned int memoryPageSize = 1024;
+constexpr unsigned int memoryPageCount = mainMemoryLimit / memoryPageSize;
+
+thread_local bool dirtyMemoryPages[memoryPageCount] = {};
+
+void MarkMemoryWritten(u16 address, bool wide)
+{
+    dirtyMemoryPages[address / memoryPageSize] = true;
+    if (wide)
+    {
+        dirtyMemoryPages[u16(address + 1) / memoryPageSize] = true;
+    }
+}
 
 struct MemoryAccess
 {
@@ -79,16 +122,17 @@ struct MemoryAccess
         u16* full;
     };
 
-    void SetAddress(u8* mainMemmoryAddr)
+    // High byte of a word at 0xFFFF wraps around to 0
+    void SetAddress(u16 address)
     {
         switch (type)
         {
         case Type::Byte:
-            byte = mainMemmoryAddr;
+            byte = &mainMemory[address];
             break;
         case Type::Word:
-            word.low = mainMemmoryAddr;
-            word.high = mainMemmoryAddr + 1;
+            word.low = &mainMemory[address];
+            word.high = &mainMemory[u16(address + 1)];
             break;
         }
     }
@@ -103,7 +147,7 @@ struct MemoryAccess
             break;
         case Type::Word:
             *(word.low)  = data & 0b1111'1111;
-            *(word.high) = data & 0b1111'1111'0000'0000;
+            *(word.high) = data >> 8;
             break;
         case Type::Full:
             *full = data;
@@ -121,11 +165,7 @@ struct MemoryAccess
         case Type::Byte:
             return *byte + data & 255;
         case Type::Word:
-        {
-            u8 tmpLow =  *(word.low) + data & 0b1111'1111;
-            u8 tmpHigh = *(word.high) + data & 0b1111'1111'0000'0000;
-            return (tmpHigh << 8) | tmpLow;
-        }
+            return (u16)(**this + data);
         case Type::Full:
             return *full + data;
         }
@@ -141,11 +181,7 @@ struct MemoryAccess
         case Type::Byte:
             return *byte - data & 255;
         case Type::Word:
-        {
-            u8 tmpLow =  *(word.low) - data & 0b1111'1111;
-            u8 tmpHigh = *(word.high) - data & 0b1111'1111'0000'0000;
-            return (tmpHigh << 8) | tmpLow;
-        }
+            return (u16)(**this - data);
         case Type::Full:
             return *full - data;
         }
@@ -153,7 +189,7 @@ struct MemoryAccess
         return 0;
     }
 
-    u16 const& operator*() const
+    u16 operator*() const
     {
         switch (type)
         {
@@ -59,3 +59,33 @@ constexpr const char* operationNames[] = {
     "___ ", // 6
     "cmp ", // 7
 };
+
+
+constexpr const char* stringNames[] = {
+    "___",  // 0
+    "___",  // 1
+    "movs", // 2
+    "cmps", // 3
+    "___",  // 4
+    "stos", // 5
+    "lods", // 6
+    "scas", // 7
+};
+
+constexpr const char* stackNames[] = {
+    "push ",
+    "pop ",
+    "call ",
+    "ret ",
+    "pushf ",
+    "popf ",
+};
+
+constexpr const char* systemNames[] = {
+    "int ",
+    "iret ",
+    "in ",
+    "out ",
+    "cli ",
+    "sti ",
+};
@@ -30,9 +30,58 @@ enum OpLoop {
     jcxz,
 };
 
+// Values are bits 1-3 of the opcode
+enum OpString {
+    movs = 2,
+    cmps = 3,
+    stos = 5,
+    lods = 6,
+    scas = 7,
+};
+
+enum OpStack {
+    push,
+    pop,
+    call,
+    ret,
+    pushf,
+    popf,
+};
+
+enum OpSystem {
+    intN,
+    iret,
+    in,
+    out,
+    cli,
+    sti,
+};
+
+enum class RepPrefix : u8 { None, Repne, Rep };   // rep is repe for cmps and scas
+
+// Register-only arithmetic that leads into a conditional jump, filled in by FuseOperations
+struct FusedArithmetic
+{
+    OpIndex opIndex = OpIndex::UNDEFINED;
+    u8 size = 0;                // instruction length in bytes
+    u8 dst = 0;                 // slot in registersMem
+    u8 src = 0;                 // slot in registersMem, unused for immediates
+    bool srcIsImmediate = false;
+    u16 immediate = 0;
+};
+
+struct FusedGroup
+{
+    u8 count = 0;               // arithmetic operations before the jump, 0 means not fused
+    FusedArithmetic arithmetic[2];
+    OpJump jump = OpJump::jne;
+    u8 jumpSize = 0;
+    s16 jumpDisp = 0;
+};
+
 struct Operation
 {
-    enum class Type {Operation, Jump, Loop};
+    enum class Type {Operation, Jump, Loop, String, Stack, System, Undecodable};
         
     Type type = Type::Operation;
     int size = 0;
@@ -40,21 +89,42 @@ struct Operation
         OpIndex opIndex;
         OpJump opJumpIndex;
         OpLoop opLoopIndex;
+        OpString opStringIndex;
+        OpStack opStackIndex;
+        OpSystem opSystemIndex;
     };
     Operand operands[2]{};
+    RepPrefix repPrefix = RepPrefix::None;  // string operations only
+    bool wide = false;                      // string operations only
+    FusedGroup fused{};         // set on the first operation of a fused sequence
+    int disassembly = -1;       // index into disassemblyTable, -1 if not formatted yet
 
-    void PrintOp() const
+    void FormatOp(std::string& out) const
     {
         switch (type)
         {
         case Operation::Type::Operation:
-            std::cout << operationNames[opIndex] << " ";
+            (out += operationNames[opIndex]) += ' ';
             break;
         case Operation::Type::Jump:
-            std::cout << jumpNames[opJumpIndex] << " ";
+            (out += jumpNames[opJumpIndex]) += ' ';
             break;
         case Operation::Type::Loop:
-            std::cout << loopNames[opLoopIndex] << " ";
+            (out += loopNames[opLoopIndex]) += ' ';
+            break;
+        case Operation::Type::String:
+            if (repPrefix != RepPrefix::None)
+            {
+                const bool compares = opStringIndex == OpString::cmps || opStringIndex == OpString::scas;
+                out += repPrefix == RepPrefix::Repne ? "repne " : compares ? "repe " : "rep ";
+            }
+            (out += stringNames[opStringIndex]) += wide ? "w " : "b ";
+            break;
+        case Operation::Type::Stack:
+            out += stackNames[opStackIndex];
+            break;
+        case Operation::Type::System:
+            out += systemNames[opSystemIndex];
             break;
         default:
             break;
@@ -62,7 +132,71 @@ struct Operation
     }
 };
 
-OpIndex IsReg_Mem_Reg(u8 byte)
+bool IsCompareString(const Operation& op)
+{
+    return op.type == Operation::Type::String && (op.opStringIndex == OpString::cmps || op.opStringIndex == OpString::scas);
+}
+
+bool IsReturn(const Operation& op)
+{
+    return (op.type == Operation::Type::Stack && op.opStackIndex == OpStack::ret)
+        || (op.type == Operation::Type::System && op.opSystemIndex == OpSystem::iret);
+}
+
+// Jumps, loops, calls and returns end basic blocks, everything else falls through.
+// int falls through too, as its handler comes from the vector table at run time
+bool IsBranch(const Operation& op)
+{
+    return op.type == Operation::Type::Jump || op.type == Operation::Type::Loop
+        || (op.type == Operation::Type::Stack && op.opStackIndex == OpStack::call) || IsReturn(op);
+}
+
+// Only zero and sign flags are simulated, jumps that depend on other flags
+// keep treating them as cleared
+constexpr bool IsJumpConditionMet(OpJump jump, bool zero, bool sign)
+{
+    switch (jump)
+    {
+    case OpJump::je:    return zero;
+    case OpJump::jne:   return !zero;
+    case OpJump::js:    return sign;
+    case OpJump::jns:   return !sign;
+    case OpJump::jl:    return sign;
+    case OpJump::jnl:   return !sign;
+    case OpJump::jle:   return zero || sign;
+    case OpJump::jnle:  return !zero && !sign;
+    case OpJump::jbe:   return zero;
+    case OpJump::ja:    return !zero;
+    case OpJump::jo:
+    case OpJump::jb:
+    case OpJump::jp:    return false;
+    default:            return true;
+    }
+}
+
+bool IsJumpConditionMet(OpJump jump)
+{
+    return IsJumpConditionMet(jump, flags[Flag::FLAG_ZERO], flags[Flag::FLAG_SIGNED]);
+}
+
+// cx is already decremented
+constexpr bool IsLoopConditionMet(OpLoop loop, u16 cx, bool zero)
+{
+    switch (loop)
+    {
+    case OpLoop::loopnz:    return cx != 0 && !zero;
+    case OpLoop::loopz:     return cx != 0 && zero;
+    case OpLoop::jcxz:      return cx == 0;
+    default:                return cx != 0;
+    }
+}
+
+bool IsLoopConditionMet(OpLoop loop, u16 cx)
+{
+    return IsLoopConditionMet(loop, cx, flags[Flag::FLAG_ZERO]);
+}
+
+constexpr OpIndex IsReg_Mem_Reg(u8 byte)
 {
     u8 mask = 0b1111'1100;
     return (byte & mask) == 0b1000'1000 ? OpIndex::MOV
@@ -72,7 +206,7 @@ OpIndex IsReg_Mem_Reg(u8 byte)
          : OpIndex::UNDEFINED;
 }
 
-bool IsImm_Reg_Mem(u8 byte)
+constexpr bool IsImm_Reg_Mem(u8 byte)
 {
     u8 movMask    = 0b1111'1110;
     u8 othersMask = 0b1111'1100;
@@ -80,7 +214,7 @@ bool IsImm_Reg_Mem(u8 byte)
         || (byte & othersMask) == 0b1000'0000;
 }
 
-OpIndex IsImm_Accumulator(u8 byte)
+constexpr OpIndex IsImm_Accumulator(u8 byte)
 {
     u8 mask = 0b1111'1110;
     return (byte & mask) == 0b0000'0100 ? OpIndex::ADD
@@ -89,14 +223,35 @@ OpIndex IsImm_Accumulator(u8 byte)
          : OpIndex::UNDEFINED;
 }
 
-bool IsJump(u8 byte)
+constexpr bool IsJump(u8 byte)
 {
     u8 mask = 0b1111'0000;
     return (byte & mask) == 0b0111'0000;
 }
 
-bool IsLoop(u8 byte)
+constexpr bool IsLoop(u8 byte)
 {
     u8 mask = 0b1111'0000;
     return (byte & mask) == 0b1110'0000;
-}
\ No newline at end of file
+}
+
+constexpr bool IsRepPrefix(u8 byte)
+{
+    return (byte & 0b1111'1110) == 0b1111'0010;
+}
+
+constexpr bool IsString(u8 byte)
+{
+    const u8 op = byte & 0b1111'1110;
+    return op == 0b1010'0100 || op == 0b1010'0110 || op == 0b1010'1010 || op == 0b1010'1100 || op == 0b1010'1110;
+}
+
+constexpr bool IsPushPopRegister(u8 byte)
+{
+    return (byte & 0b1111'0000) == 0b0101'0000;
+}
+
+constexpr bool IsPortIo(u8 byte)
+{
+    return (byte & 0b1111'0100) == 0b1110'0100;
+}
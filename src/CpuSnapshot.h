@@ -0,0 +1,117 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuNames.h"
+#include "Helpers.h"
+
+using MemoryPage = std::array<u8, memoryPageSize>;
+
+// Full machine state. Pages are immutable and shared between snapshots,
+// a page is only copied when it was written since the last snapshot/restore (copy-on-write)
+struct MachineSnapshot
+{
+    u16 registers[8] = {};
+    bool flags[Flag::FLAG_COUNT] = {};
+    s16 ip = 0;
+    std::shared_ptr<const MemoryPage> pages[memoryPageCount];
+};
+
+// Pages whose content currently sits in mainMemory (unless marked dirty).
+// Empty slot means page was never captured
+thread_local std::shared_ptr<const MemoryPage> residentPages[memoryPageCount];
+
+MachineSnapshot TakeSnapshot()
+{
+    MachineSnapshot snapshot{};
+    std::memcpy(snapshot.registers, registersMem, sizeof(registersMem));
+    std::memcpy(snapshot.flags, flags, sizeof(flags));
+    snapshot.ip = ipReg;
+
+    for (unsigned int i = 0; i < memoryPageCount; i++)
+    {
+        if (dirtyMemoryPages[i] || !residentPages[i])
+        {
+            auto page = std::make_shared<MemoryPage>();
+            std::memcpy(page->data(), &mainMemory[i * memoryPageSize], memoryPageSize);
+            residentPages[i] = std::move(page);
+            dirtyMemoryPages[i] = false;
+        }
+        snapshot.pages[i] = residentPages[i];
+    }
+    return snapshot;
+}
+
+// Only pages that differ from the snapshot are copied back,
+// so restoring right after a short run costs just the pages that run dirtied
+void RestoreSnapshot(const MachineSnapshot& snapshot)
+{
+    ipReg = snapshot.ip;
+    std::memcpy(registersMem, snapshot.registers, sizeof(registersMem));
+    std::memcpy(flags, snapshot.flags, sizeof(flags));
+
+    for (unsigned int i = 0; i < memoryPageCount; i++)
+    {
+        if (dirtyMemoryPages[i] || residentPages[i] != snapshot.pages[i])
+        {
+            std::memcpy(&mainMemory[i * memoryPageSize], snapshot.pages[i]->data(), memoryPageSize);
+            residentPages[i] = snapshot.pages[i];
+            dirtyMemoryPages[i] = false;
+        }
+    }
+}
+
+// Prints every difference of the current machine from expected as "<label> mismatch: ...", true when there is none
+bool MatchesSnapshot(const MachineSnapshot& expected, const std::string& label)
+{
+    bool matches = true;
+    const auto mismatch = [&](const std::string& what) {
+        std::cout << "\n" << label << " mismatch: " << what;
+        matches = false;
+    };
+    for (int i = 0; i < 8; i++)
+    {
+        if (registersMem[i] != expected.registers[i])
+            mismatch("register " + std::to_string(i) + " " + HexString(expected.registers[i]) + " != " + HexString(registersMem[i]));
+    }
+    for (int i = 0; i < Flag::FLAG_COUNT; i++)
+    {
+        if (flags[i] != expected.flags[i])
+            mismatch(std::string("flag ") + FlagStr((Flag)i));
+    }
+    if (ipReg != expected.ip)
+        mismatch("ip " + HexString(expected.ip) + " != " + HexString(ipReg));
+    for (unsigned int i = 0; i < memoryPageCount; i++)
+    {
+        if (std::memcmp(expected.pages[i]->data(), &mainMemory[i * memoryPageSize], memoryPageSize) != 0)
+            mismatch("memory page " + HexString(i * memoryPageSize));
+    }
+    return matches;
+}
+
+// Takes a snapshot, lets run change the machine and restores the snapshot, which has to bring
+// back the initial state exactly. The first restore only has dirty pages to go by, the second
+// one follows a snapshot of the finished run and the third run has to end where that one did.
+template<typename Run>
+bool VerifySnapshotRestore(Run run)
+{
+    const MachineSnapshot initial = TakeSnapshot();
+    run();
+    RestoreSnapshot(initial);
+    bool matches = MatchesSnapshot(initial, "Snapshot restore of dirty pages");
+
+    run();
+    const MachineSnapshot finished = TakeSnapshot();
+    RestoreSnapshot(initial);
+    matches = MatchesSnapshot(initial, "Snapshot restore of shared pages") && matches;
+
+    run();
+    matches = MatchesSnapshot(finished, "Snapshot rerun") && matches;
+    std::cout << (matches ? "\nSnapshot restore matches" : "");
+    return matches;
+}
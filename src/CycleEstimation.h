@@ -3,28 +3,37 @@
 #include "CpuMemory.h"
 #include "CpuOperations.h"
 
-int RegularOperationEstimate(const Operation& op);
-int JumpOperationEstimate(const Operation& op);
+constexpr int RegularOperationEstimate(const Operation& op);
+constexpr int JumpOperationEstimate(const Operation& op);
 
-int OperationMOVEstimate(const Operation& op);
-int OperationArithmeticEstimate(const Operation& op);
-int OperationCMPEstimate(const Operation& op);
+constexpr int OperationMOVEstimate(const Operation& op);
+constexpr int OperationArithmeticEstimate(const Operation& op);
+constexpr int OperationCMPEstimate(const Operation& op);
+constexpr int StringOperationEstimate(const Operation& op, u32 repetitions);
+constexpr int StackOperationEstimate(const Operation& op);
+constexpr int SystemOperationEstimate(const Operation& op);
 
+// Repetitions of a REP string operation when nothing executed it, it's estimated for one element
+constexpr u32 staticStringRepetitions = 1;
 
-int CycleEstimation(const Operation& op)
+// stringRepetitions is how many elements a string operation processed, other operations ignore it
+constexpr int CycleEstimation(const Operation& op, u32 stringRepetitions)
 {
     switch (op.type)
     {
     case Operation::Type::Operation:    return RegularOperationEstimate(op);
     case Operation::Type::Jump:
     case Operation::Type::Loop:         return JumpOperationEstimate(op);
+    case Operation::Type::String:       return StringOperationEstimate(op, stringRepetitions);
+    case Operation::Type::Stack:        return StackOperationEstimate(op);
+    case Operation::Type::System:       return SystemOperationEstimate(op);
     default:
         assert(false);
         break;
     }
 }
 
-int RegularOperationEstimate(const Operation& op)
+constexpr int RegularOperationEstimate(const Operation& op)
 {
     switch (op.opIndex)
     {
@@ -38,17 +47,17 @@ int RegularOperationEstimate(const Operation& op)
     }
 }
 
-int JumpOperationEstimate(const Operation& op)
+constexpr int JumpOperationEstimate(const Operation& op)
 {
     return 0; // TODO: too lazy to do this
 }
 
-bool OperandsMatch(const Operation& op, Operand::Type type0, Operand::Type type1)
+constexpr bool OperandsMatch(const Operation& op, Operand::Type type0, Operand::Type type1)
 {
     return op.operands[0].type == type0 && op.operands[1].type == type1;
 }
 
-int EffectiveAddressEstimate(const MemoryExpr& ea)
+constexpr int EffectiveAddressEstimate(const MemoryExpr& ea)
 {
     const auto regCmp = [&](RegisterIndex t0, RegisterIndex t1) -> bool {
         return ea.registers[0] == t0 && ea.registers[1] == t1;
@@ -103,7 +112,7 @@ int EffectiveAddressEstimate(const MemoryExpr& ea)
     assert(false);
 }
 
-int OperationMOVEstimate(const Operation& op)
+constexpr int OperationMOVEstimate(const Operation& op)
 {
     using enum Operand::Type;
     if (OperandsMatch(op, Memory, Register) && op.operands[1].reg == RegisterIndex::ax ||
@@ -135,7 +144,7 @@ int OperationMOVEstimate(const Operation& op)
     assert(false);
 }
 
-int OperationArithmeticEstimate(const Operation& op)
+constexpr int OperationArithmeticEstimate(const Operation& op)
 {
     using enum Operand::Type;
     if (OperandsMatch(op, Register, Register))
@@ -165,7 +174,7 @@ int OperationArithmeticEstimate(const Operation& op)
     assert(false);
 }
 
-int OperationCMPEstimate(const Operation& op)
+constexpr int OperationCMPEstimate(const Operation& op)
 {
     using enum Operand::Type;
     if (OperandsMatch(op, Register, Register))
@@ -193,4 +202,57 @@ int OperationCMPEstimate(const Operation& op)
         return 4;
     }
     assert(false);
-}
\ No newline at end of file
+}
+
+// Single instruction clocks, or 9 + clocks per repetition with a REP prefix
+constexpr int StringOperationEstimate(const Operation& op, u32 repetitions)
+{
+    int single = 0, perRepetition = 0;
+    switch (op.opStringIndex)
+    {
+    case OpString::movs: single = 18; perRepetition = 17; break;
+    case OpString::cmps: single = 22; perRepetition = 22; break;
+    case OpString::stos: single = 11; perRepetition = 10; break;
+    case OpString::lods: single = 12; perRepetition = 13; break;
+    case OpString::scas: single = 15; perRepetition = 15; break;
+    default:
+        assert(false);
+        break;
+    }
+    return op.repPrefix == RepPrefix::None ? single : 9 + perRepetition * int(repetitions);
+}
+
+constexpr int StackOperationEstimate(const Operation& op)
+{
+    const bool memory = op.operands[0].type == Operand::Type::Memory;
+    switch (op.opStackIndex)
+    {
+    case OpStack::push:     return memory ? 16 + EffectiveAddressEstimate(op.operands[0].mem) : 11;
+    case OpStack::pop:      return memory ? 17 + EffectiveAddressEstimate(op.operands[0].mem) : 8;
+    case OpStack::call:     return 19;
+    case OpStack::ret:      return op.operands[0].type == Operand::Type::Immediate ? 12 : 8;
+    case OpStack::pushf:    return 10;
+    case OpStack::popf:     return 8;
+    }
+    assert(false);
+    return 0;
+}
+
+// Port operand is the immediate or dx, the other one is al or ax. Word transfers take 4 more clocks
+constexpr int SystemOperationEstimate(const Operation& op)
+{
+    const bool input = op.opSystemIndex == OpSystem::in;
+    switch (op.opSystemIndex)
+    {
+    case OpSystem::intN:    return op.operands[0].immVal.value == 3 ? 52 : 51;
+    case OpSystem::iret:    return 24;
+    case OpSystem::in:
+    case OpSystem::out:
+        return (op.operands[input ? 1 : 0].type == Operand::Type::Immediate ? 10 : 8)
+            + (IsByteRegister(op.operands[input ? 0 : 1].reg) ? 0 : 4);
+    case OpSystem::cli:
+    case OpSystem::sti:     return 2;
+    }
+    assert(false);
+    return 0;
+}
@@ -0,0 +1,422 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuOperations.h"
+#include "ControlFlowGraph.h"
+#include "Disassembly.h"
+
+// Decoded listings are kept in a cache directory across runs, one file per program named by
+// the hash of its bytes and of the simulator build. A file holds the fused operations, their
+// disassembly, the basic blocks and clocks of string-free blocks, so a later run maps it,
+// checks the header against the image and copies the records out, without decoding anything.
+// Operations are stored as they are in memory, any change to decoding or to the layout of
+// Operation has to bump decodeCacheVersion (the build stamp catches rebuilds anyway).
+// Files are written to a temporary name and renamed, so concurrent runs never read half of one.
+// Everything after the header is hashed and every operation is range checked before use, so a
+// damaged file is decoded again instead of being trusted.
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define DECODE_CACHE_MMAP 1
+#else
+#define DECODE_CACHE_MMAP 0
+#endif
+
+constexpr u32 decodeCacheMagic = 0x43443858;    // "X8DC"
+constexpr u32 decodeCacheVersion = 2;
+constexpr const char* simulatorBuildStamp = __DATE__ " " __TIME__;
+
+static_assert(std::is_trivially_copyable_v<Operation>, "operations are stored byte for byte");
+
+struct DecodedProgram
+{
+    std::unordered_map<int, Operation> operations;
+    ControlFlowGraph cfg;
+    std::map<u16, u64> blockCycles;     // string-free blocks only, see StringFreeBlockCycles
+};
+
+struct DecodeCacheHeader
+{
+    u32 magic = decodeCacheMagic;
+    u32 version = decodeCacheVersion;
+    u32 operationSize = sizeof(Operation);
+    u32 imageSize = 0;
+    u64 imageHash = 0;
+    u64 buildHash = 0;
+    u32 operationCount = 0;
+    u32 blockCount = 0;
+    u32 blockIpCount = 0;
+    u32 textSize = 0;
+    u64 payloadHash = 0;                // of everything after the header
+};
+
+struct CachedOperation
+{
+    u32 ip = 0;
+    u32 textOffset = 0;
+    u32 textSize = 0;
+    Operation op{};
+};
+
+struct CachedBlock
+{
+    u32 start = 0;
+    int taken = -1;
+    int fallthrough = -1;
+    u32 ipCount = 0;
+    u64 cycles = 0;
+    u32 hasCycles = 0;
+};
+
+// FNV-1a
+u64 HashBytes(const void* data, size_t size, u64 hash = 0xcbf29ce484222325ull)
+{
+    const u8* bytes = static_cast<const u8*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+u64 SimulatorBuildHash()
+{
+    const u32 layout[] = { decodeCacheVersion, u32(sizeof(Operation)) };
+    return HashBytes(simulatorBuildStamp, std::strlen(simulatorBuildStamp), HashBytes(layout, sizeof(layout)));
+}
+
+std::filesystem::path DecodeCachePath(const std::string& directory, u64 imageHash)
+{
+    char name[40];
+    std::snprintf(name, sizeof(name), "%016llx.x8dc", (unsigned long long)(imageHash ^ SimulatorBuildHash()));
+    return std::filesystem::path(directory) / name;
+}
+
+// Read-only view of a whole file, mapped where possible
+struct CacheFileView
+{
+    const u8* data = nullptr;
+    size_t size = 0;
+#if DECODE_CACHE_MMAP
+    void* mapping = nullptr;
+#else
+    std::vector<u8> contents;
+#endif
+
+    bool Open(const std::filesystem::path& path)
+    {
+#if DECODE_CACHE_MMAP
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat fileStat{};
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            void* mapped = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                mapping = mapped;
+                data = static_cast<const u8*>(mapped);
+                size = size_t(fileStat.st_size);
+            }
+        }
+        close(fd);
+        return data != nullptr;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = contents.data();
+        size = contents.size();
+        return size != 0;
+#endif
+    }
+
+    ~CacheFileView()
+    {
+#if DECODE_CACHE_MMAP
+        if (mapping)
+        {
+            munmap(mapping, size);
+        }
+#endif
+    }
+};
+
+// Copies records out of the view one by one, fails once it would read past the end
+struct CacheReader
+{
+    const CacheFileView& view;
+    size_t offset = 0;
+
+    template<typename T>
+    bool Read(T& value)
+    {
+        if (offset + sizeof(T) > view.size)
+        {
+            return false;
+        }
+        std::memcpy(&value, view.data + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
+};
+
+template<typename T>
+void AppendRecord(std::string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+bool IsValidRegister(RegisterIndex reg)
+{
+    return reg >= RegisterIndex::None && reg <= RegisterIndex::di;
+}
+
+bool IsValidOperand(const Operand& operand)
+{
+    switch (operand.type)
+    {
+    case Operand::Type::None:
+    case Operand::Type::Immediate:
+    case Operand::Type::JumpDisplacement:
+        return true;
+    case Operand::Type::Register:
+        return IsValidRegister(operand.reg) && operand.reg != RegisterIndex::None;
+    case Operand::Type::Memory:
+        return IsValidRegister(operand.mem.registers[0]) && IsValidRegister(operand.mem.registers[1]);
+    default:
+        return false;
+    }
+}
+
+bool IsArithmetic(OpIndex opIndex)
+{
+    return opIndex == OpIndex::ADD || opIndex == OpIndex::MOV || opIndex == OpIndex::SUB || opIndex == OpIndex::CMP;
+}
+
+// Everything the executors index or switch on without checking, the hash guards the rest
+bool IsValidCachedOperation(const Operation& op)
+{
+    if (op.size < 0 || op.size > 5 || !IsValidOperand(op.operands[0]) || !IsValidOperand(op.operands[1])
+        || u8(op.repPrefix) > u8(RepPrefix::Rep) || op.fused.count > 2 || op.fused.jump < OpJump::jo || op.fused.jump > OpJump::jnle)
+    {
+        return false;
+    }
+    for (int i = 0; i < op.fused.count; i++)
+    {
+        const FusedArithmetic& arithmetic = op.fused.arithmetic[i];
+        if (!IsArithmetic(arithmetic.opIndex) || arithmetic.dst >= 8 || arithmetic.src >= 8)
+        {
+            return false;
+        }
+    }
+    switch (op.type)
+    {
+    case Operation::Type::Operation:    return IsArithmetic(op.opIndex);
+    case Operation::Type::Jump:         return op.opJumpIndex >= OpJump::jo && op.opJumpIndex <= OpJump::jnle;
+    case Operation::Type::Loop:         return op.opLoopIndex >= OpLoop::loopnz && op.opLoopIndex <= OpLoop::jcxz;
+    case Operation::Type::String:
+        return op.opStringIndex == OpString::movs || op.opStringIndex == OpString::cmps || op.opStringIndex == OpString::stos
+            || op.opStringIndex == OpString::lods || op.opStringIndex == OpString::scas;
+    case Operation::Type::Stack:        return op.opStackIndex >= OpStack::push && op.opStackIndex <= OpStack::popf;
+    case Operation::Type::System:       return op.opSystemIndex >= OpSystem::intN && op.opSystemIndex <= OpSystem::sti;
+    default:
+        return false;
+    }
+}
+
+bool LoadDecodeCache(const std::string& directory, const std::vector<u8>& image, DecodedProgram& program)
+{
+    const u64 imageHash = HashBytes(image.data(), image.size());
+    CacheFileView view;
+    if (!view.Open(DecodeCachePath(directory, imageHash)))
+    {
+        return false;
+    }
+
+    CacheReader reader{ view };
+    DecodeCacheHeader header{};
+    if (!reader.Read(header) || header.magic != decodeCacheMagic || header.version != decodeCacheVersion
+        || header.operationSize != sizeof(Operation) || header.buildHash != SimulatorBuildHash()
+        || header.imageSize != image.size() || header.imageHash != imageHash)
+    {
+        return false;
+    }
+    const size_t expectedSize = sizeof(DecodeCacheHeader) + header.operationCount * sizeof(CachedOperation)
+        + header.blockCount * sizeof(CachedBlock) + header.blockIpCount * sizeof(u16) + header.textSize;
+    if (view.size != expectedSize
+        || HashBytes(view.data + sizeof(DecodeCacheHeader), view.size - sizeof(DecodeCacheHeader)) != header.payloadHash)
+    {
+        return false;
+    }
+
+    std::vector<CachedOperation> cachedOperations(header.operationCount);
+    for (CachedOperation& cached : cachedOperations)
+    {
+        reader.Read(cached);
+    }
+    std::vector<CachedBlock> cachedBlocks(header.blockCount);
+    for (CachedBlock& cached : cachedBlocks)
+    {
+        reader.Read(cached);
+    }
+    for (const CachedOperation& cached : cachedOperations)
+    {
+        if (cached.ip >= mainMemoryLimit || u64(cached.textOffset) + cached.textSize > header.textSize
+            || !IsValidCachedOperation(cached.op))
+        {
+            return false;
+        }
+    }
+    for (const CachedBlock& cached : cachedBlocks)
+    {
+        if (cached.start >= mainMemoryLimit || cached.taken < -1 || cached.taken >= int(mainMemoryLimit)
+            || cached.fallthrough < -1 || cached.fallthrough >= int(mainMemoryLimit))
+        {
+            return false;
+        }
+    }
+    const size_t blockIpsOffset = reader.offset;
+    const char* text = reinterpret_cast<const char*>(view.data + blockIpsOffset + header.blockIpCount * sizeof(u16));
+
+    program = {};
+    program.operations.reserve(header.operationCount);
+    for (CachedOperation& cached : cachedOperations)
+    {
+        cached.op.disassembly = InternDisassembly(std::string(text + cached.textOffset, cached.textSize));
+        program.operations.emplace(int(cached.ip), cached.op);
+    }
+
+    program.cfg.entry = 0;
+    u32 nextIp = 0;
+    for (const CachedBlock& cached : cachedBlocks)
+    {
+        if (u64(nextIp) + cached.ipCount > header.blockIpCount)
+        {
+            return false;
+        }
+        BasicBlock& block = program.cfg.blocks[u16(cached.start)];
+        block.start = u16(cached.start);
+        block.taken = cached.taken;
+        block.fallthrough = cached.fallthrough;
+        block.operationIps.resize(cached.ipCount);
+        std::memcpy(block.operationIps.data(), view.data + blockIpsOffset + nextIp * sizeof(u16), cached.ipCount * sizeof(u16));
+        nextIp += cached.ipCount;
+        if (cached.hasCycles)
+        {
+            program.blockCycles[block.start] = cached.cycles;
+        }
+    }
+    for (auto& [start, block] : program.cfg.blocks)
+    {
+        for (u16 next : program.cfg.Successors(block))
+        {
+            program.cfg.blocks[next].predecessors.push_back(start);
+        }
+    }
+    return true;
+}
+
+void StoreDecodeCache(const std::string& directory, const std::vector<u8>& image, const DecodedProgram& program)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    DecodeCacheHeader header{};
+    header.imageSize = u32(image.size());
+    header.imageHash = HashBytes(image.data(), image.size());
+    header.buildHash = SimulatorBuildHash();
+
+    std::vector<CachedOperation> cachedOperations;
+    cachedOperations.reserve(program.operations.size());
+    std::string text;
+    for (const auto& [ip, op] : program.operations)
+    {
+        const std::string opText = op.disassembly >= 0 ? disassemblyTable[op.disassembly] : FormatOperation(op);
+        CachedOperation& cached = cachedOperations.emplace_back();
+        cached.ip = u32(ip);
+        cached.textOffset = u32(text.size());
+        cached.textSize = u32(opText.size());
+        cached.op = op;
+        cached.op.disassembly = -1;
+        text += opText;
+    }
+
+    std::vector<CachedBlock> cachedBlocks;
+    std::vector<u16> blockIps;
+    for (const auto& [start, block] : program.cfg.blocks)
+    {
+        CachedBlock& cached = cachedBlocks.emplace_back();
+        cached.start = start;
+        cached.taken = block.taken;
+        cached.fallthrough = block.fallthrough;
+        cached.ipCount = u32(block.operationIps.size());
+        if (const auto cyclesIt = program.blockCycles.find(start); cyclesIt != program.blockCycles.cend())
+        {
+            cached.cycles = cyclesIt->second;
+            cached.hasCycles = 1;
+        }
+        blockIps.insert(blockIps.end(), block.operationIps.begin(), block.operationIps.end());
+    }
+
+    header.operationCount = u32(cachedOperations.size());
+    header.blockCount = u32(cachedBlocks.size());
+    header.blockIpCount = u32(blockIps.size());
+    header.textSize = u32(text.size());
+
+    std::string payload;
+    for (const CachedOperation& cached : cachedOperations)
+    {
+        AppendRecord(payload, cached);
+    }
+    for (const CachedBlock& cached : cachedBlocks)
+    {
+        AppendRecord(payload, cached);
+    }
+    payload.append(reinterpret_cast<const char*>(blockIps.data()), blockIps.size() * sizeof(u16));
+    payload += text;
+    header.payloadHash = HashBytes(payload.data(), payload.size());
+
+    const std::filesystem::path path = DecodeCachePath(directory, header.imageHash);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out.is_open())
+        {
+            return;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(payload.data(), payload.size());
+        if (!out)
+        {
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+        std::filesystem::remove(temporary, error);
+    }
+}
@@ -0,0 +1,351 @@
+#pragma once
+#include <cassert>
+#include <iostream>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "DecoderOperands.h"
+#include "Disassembly.h"
+#include "Helpers.h"
+
+// Decoding of single operations is constexpr, so listings known at build time can be
+// decoded by the compiler (see ConstexprMachine.h). Unknown encodings end up in assert,
+// which also makes constant evaluation fail. Encodings of a known opcode that aren't
+// supported decode to Operation::Type::Undecodable instead.
+
+constexpr u16 CombineLoAndHiToWord(std::span<const u8> bytesArr, int* byteIndex)
+{
+    const u16 byteLow  = bytesArr[++(*byteIndex)];
+    const u16 byteHigh = bytesArr[++(*byteIndex)];
+    return (byteHigh << 8) | byteLow;
+}
+
+// Word register or memory operand of a mod-reg-r/m byte, reads displacement that follows
+constexpr Operand DecodeWordRmOperand(std::span<const u8> bytes, int* byteIndex, u8 adjByte)
+{
+    const u8 mod = (adjByte >> 6);
+    const u8 rm  = (adjByte & 0b111);
+    Operand operand{};
+    if (mod == 3) // register mode
+    {
+        operand.type = Operand::Type::Register;
+        operand.reg = registersMap[rm][1];
+        return operand;
+    }
+
+    operand.type = Operand::Type::Memory;
+    operand.mem = MemoryExpr{};
+    operand.mem.SetRegistersOfExpression(rm, mod);
+    operand.mem.pointsToWord = true;
+    operand.mem.explicitWide = MemoryExpr::ExplicitWide::Word;
+    if (mod == 0 && rm == 0b0110) // direct address
+    {
+        operand.mem.disp = CombineLoAndHiToWord(bytes, byteIndex);
+    }
+    else if (mod == 1)
+    {
+        operand.mem.disp = (s8)bytes[++(*byteIndex)];
+    }
+    else if (mod == 2)
+    {
+        operand.mem.disp = CombineLoAndHiToWord(bytes, byteIndex);
+    }
+    return operand;
+}
+
+// Decodes operation starting at byteIndex, leaves byteIndex on its last byte
+constexpr Operation DecodeOperation(std::span<const u8> bytes, int& byteIndex)
+{
+    const int opBeginByte = byteIndex;
+    Operation operation{};
+    Operand left{}, right{};
+
+    u8 instructionByte = bytes[byteIndex];
+    u8 bitD = (instructionByte & 2) >> 1;
+    u8 bitW = (instructionByte & 1);
+
+    if (operation.opIndex = IsReg_Mem_Reg(instructionByte); operation.opIndex != OpIndex::UNDEFINED)
+    {
+        u8 adjByte = bytes[++byteIndex];
+
+        u8 mod = (adjByte >> 6);
+        u8 reg = (adjByte & 0b00'111'000) >> 3;
+        u8 rm =  (adjByte & 0b00'000'111);
+        if (mod == 3) // register mode
+        {
+            left.type = Operand::Type::Register;
+            left.reg = registersMap[rm][bitW];
+            right.type = Operand::Type::Register;
+            right.reg = registersMap[reg][bitW];
+        }
+        else
+        {
+            left.type = Operand::Type::Register;
+            left.reg = registersMap[reg][bitW];
+            right.type = Operand::Type::Memory;
+            right.mem = MemoryExpr{};
+            right.mem.pointsToWord = bitW == 1;
+            right.mem.explicitWide = bitW == 1 ? MemoryExpr::ExplicitWide::Word : MemoryExpr::ExplicitWide::Byte;
+            right.mem.SetRegistersOfExpression(rm, mod);
+
+            if (mod == 0)
+            {
+                if (rm == 0b0110)
+                {
+                    right.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
+                }
+            }
+            else if (mod == 1) // memory mode, 8-bit displacement follows
+            {
+                right.mem.disp = (s8)bytes[++byteIndex];
+            }
+            else if (mod == 2) // memory mode, 16-bit displacement follows
+            {
+                right.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
+            }
+
+            if (bitD == 0)
+            {
+                std::swap(left, right);
+            }
+        }
+    }
+    else if (IsImm_Reg_Mem(instructionByte))
+    {
+        u8 bitS = bitD;
+
+        u8 adjByte = bytes[++byteIndex];
+        u8 mod     = (adjByte >> 6);
+        u8 rm      = (adjByte & 0b111);
+        operation.opIndex = OpIndex((adjByte & 0b111'000) >> 3);
+
+        if ((instructionByte & 0b1111'1110) == 0b1100'0110) // specific MOV instruction
+        {
+            operation.opIndex = OpIndex::MOV;
+        }
+
+        bool dataIsWord = operation.opIndex == OpIndex::MOV  ?  bitW == 1  :  bitS == 0 && bitW == 1;
+
+        if (mod == 3) // register mode
+        {
+            left.type = Operand::Type::Register;
+            left.reg = registersMap[rm][bitW];
+        }
+        else
+        {
+            left.type = Operand::Type::Memory;
+            left.mem = MemoryExpr{};
+            left.mem.SetRegistersOfExpression(rm, mod);
+            left.mem.pointsToWord = bitW == 1;
+            left.mem.explicitWide = bitW == 1 ? MemoryExpr::ExplicitWide::Word : MemoryExpr::ExplicitWide::Byte;
+
+            if (mod == 0) // memory mode, no displacement follows
+            {
+                // SPECIAL CASE
+                if (rm == 0b0110)
+                {
+                    left.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
+                }
+            }
+            else if (mod == 1) // memory mode, 8-bit displacement follows
+            {
+                left.mem.disp = (s8)bytes[++byteIndex];
+            }
+            else if (mod == 2) // memory mode, 16-bit displacement follows
+            {
+                left.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
+            }
+        }
+
+        right.type = Operand::Type::Immediate;
+        right.immVal.value = dataIsWord ? CombineLoAndHiToWord(bytes, &byteIndex)
+                           : bitW == 1  ? (s8)bytes[++byteIndex] // sign extended byte
+                           : bytes[++byteIndex];
+    }
+    else if ((instructionByte & 0b1111'0000) == 0b1011'0000) // MOV immediate to register
+    {
+        operation.opIndex = OpIndex::MOV;
+        u8 bitW = (instructionByte & 0b1000) >> 3;
+        u8 reg  = (instructionByte & 0b0111);
+
+        left.type = Operand::Type::Register;
+        left.reg = registersMap[reg][bitW];
+        right.type = Operand::Type::Immediate;
+        right.immVal.value = bitW == 1 ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
+    }
+    else if ((instructionByte & 0b1111'1100) == 0b1010'0000) // MOV accumulator
+    {
+        assert(false);
+        //instructionStr = operationNames[OpIndex::MOV];
+        //const auto data = CombineLoAndHiToString(bytes, &byteIndex);
+        //if (bitD == 0)
+        //{
+        //    leftOperand = "ax";
+        //    rightOperand = '[' + data + ']';
+        //}
+        //else
+        //{
+        //    leftOperand = '[' + data + ']';
+        //    rightOperand = "ax";
+        //}
+    }
+    else if (operation.opIndex = IsImm_Accumulator(instructionByte); operation.opIndex != OpIndex::UNDEFINED)
+    {
+        left.type = Operand::Type::Register;
+        left.reg = bitW == 1 ? RegisterIndex::ax : RegisterIndex::al;
+
+        right.type = Operand::Type::Immediate;
+        right.immVal.value = bitW == 1 ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
+    }
+    else if (IsRepPrefix(instructionByte) || IsString(instructionByte))
+    {
+        operation.type = Operation::Type::String;
+        if (IsRepPrefix(instructionByte))
+        {
+            operation.repPrefix = (instructionByte & 1) ? RepPrefix::Rep : RepPrefix::Repne;
+            instructionByte = bytes[++byteIndex];
+            assert(IsString(instructionByte));
+        }
+        operation.opStringIndex = OpString((instructionByte & 0b1110) >> 1);
+        operation.wide = (instructionByte & 1) == 1;
+    }
+    else if (IsPushPopRegister(instructionByte))
+    {
+        operation.type = Operation::Type::Stack;
+        operation.opStackIndex = (instructionByte & 0b1000) ? OpStack::pop : OpStack::push;
+        left.type = Operand::Type::Register;
+        left.reg = registersMap[instructionByte & 0b0111][1];
+    }
+    else if (instructionByte == 0xFF || instructionByte == 0x8F) // push/pop r/m16
+    {
+        const u8 adjByte = bytes[++byteIndex];
+        const Operand operand = DecodeWordRmOperand(bytes, &byteIndex, adjByte);
+        if (((adjByte >> 3) & 0b111) == (instructionByte == 0xFF ? 6 : 0))
+        {
+            operation.type = Operation::Type::Stack;
+            operation.opStackIndex = instructionByte == 0xFF ? OpStack::push : OpStack::pop;
+            left = operand;
+        }
+        else
+        {
+            // inc, dec, call and jmp of the same group aren't supported
+            operation.type = Operation::Type::Undecodable;
+        }
+    }
+    else if (instructionByte == 0xE8) // call near, 16-bit displacement
+    {
+        operation.type = Operation::Type::Stack;
+        operation.opStackIndex = OpStack::call;
+        left.type = Operand::Type::JumpDisplacement;
+        left.jump.value = (s16)CombineLoAndHiToWord(bytes, &byteIndex) + 3;
+    }
+    else if ((instructionByte & 0b1111'1110) == 0b1100'0010) // ret, ret imm16
+    {
+        operation.type = Operation::Type::Stack;
+        operation.opStackIndex = OpStack::ret;
+        if (instructionByte == 0xC2)
+        {
+            left.type = Operand::Type::Immediate;
+            left.immVal.value = CombineLoAndHiToWord(bytes, &byteIndex);
+        }
+    }
+    else if ((instructionByte & 0b1111'1110) == 0b1001'1100) // pushf, popf
+    {
+        operation.type = Operation::Type::Stack;
+        operation.opStackIndex = instructionByte & 1 ? OpStack::popf : OpStack::pushf;
+    }
+    else if ((instructionByte & 0b1111'1110) == 0b1100'1100) // int 3, int imm8
+    {
+        operation.type = Operation::Type::System;
+        operation.opSystemIndex = OpSystem::intN;
+        left.type = Operand::Type::Immediate;
+        left.immVal.value = instructionByte == 0xCD ? bytes[++byteIndex] : 3;
+    }
+    else if (instructionByte == 0xCF)
+    {
+        operation.type = Operation::Type::System;
+        operation.opSystemIndex = OpSystem::iret;
+    }
+    else if (IsPortIo(instructionByte)) // in/out with imm8 port, or with dx when bit 3 is set
+    {
+        operation.type = Operation::Type::System;
+        operation.opSystemIndex = (instructionByte & 0b10) ? OpSystem::out : OpSystem::in;
+        left.type = Operand::Type::Register;
+        left.reg = bitW == 1 ? RegisterIndex::ax : RegisterIndex::al;
+        if (instructionByte & 0b1000)
+        {
+            right.type = Operand::Type::Register;
+            right.reg = RegisterIndex::dx;
+        }
+        else
+        {
+            right.type = Operand::Type::Immediate;
+            right.immVal.value = bytes[++byteIndex];
+        }
+        if (operation.opSystemIndex == OpSystem::out)
+        {
+            std::swap(left, right);
+        }
+    }
+    else if ((instructionByte & 0b1111'1110) == 0b1111'1010) // cli, sti
+    {
+        operation.type = Operation::Type::System;
+        operation.opSystemIndex = instructionByte & 1 ? OpSystem::sti : OpSystem::cli;
+    }
+    else if (IsJump(instructionByte) || IsLoop(instructionByte))
+    {
+        if (IsJump(instructionByte))
+        {
+            operation.type = Operation::Type::Jump;
+            operation.opJumpIndex = OpJump(instructionByte & 0b1111);
+        }
+        else
+        {
+            operation.type = Operation::Type::Loop;
+            operation.opLoopIndex = OpLoop(instructionByte & 0b0011);
+        }
+
+        left.type = Operand::Type::JumpDisplacement;
+        left.jump.value = (s8)bytes[++byteIndex] + 2;
+    }
+    else
+    {
+        // Opcodes not listed above, e.g. inc/dec register
+        operation.type = Operation::Type::Undecodable;
+    }
+
+    operation.operands[0] = std::move(left);
+    operation.operands[1] = std::move(right);
+    operation.size = byteIndex - opBeginByte;
+    return operation;
+}
+
+// Decodes whole listing, operations are keyed by their offset. Undecodable operations are left
+// out, so disassembly and execution stop where they are
+std::unordered_map<int, Operation> DecodeOperations(const std::vector<u8>& bytes)
+{
+    std::unordered_map<int, Operation> operations;
+
+    int byteIndex = 0;
+    while (byteIndex < int(bytes.size()))
+    {
+        const int opBeginByte = byteIndex;
+        const Operation op = DecodeOperation(bytes, byteIndex);
+        if (op.type == Operation::Type::Undecodable)
+        {
+            std::cerr << "!!! Undecodable operation at " << HexString(u16(opBeginByte)) << ", program ends there !!!\n";
+        }
+        else
+        {
+            operations[opBeginByte] = op;
+        }
+        byteIndex++;
+    }
+    FormatDisassembly(operations);
+    return operations;
+}
@@ -25,7 +25,7 @@ struct MemoryExpr
     RegisterIndex registers[2]{}; // second register might not be present
     s16 disp = 0; // might be optional, or required for direct access mode
 
-    const char* GetExplicitWide() const
+    constexpr const char* GetExplicitWide() const
     {
         using enum MemoryExpr::ExplicitWide;
         switch (explicitWide)
@@ -39,7 +39,7 @@ struct MemoryExpr
         }
     }
 
-    void SetRegistersOfExpression(u8 rm, u8 mod)
+    constexpr void SetRegistersOfExpression(u8 rm, u8 mod)
     {
         using enum RegisterIndex;
         switch (rm)
@@ -89,33 +89,34 @@ struct Operand
         JumpDisplacement jump;
     };
 
-    void Print() const
+    // Appends operand in NASM syntax
+    void Format(std::string& out) const
     {
         switch (type)
         {
         case Type::None:
             break;
         case Type::Register:
-            std::cout << registerNames[reg];
+            out += registerNames[reg];
             break;
         case Type::Immediate:
-            std::cout << std::to_string(immVal.value);
+            out += std::to_string(immVal.value);
             break;
         case Type::Memory:
-            std::cout << mem.GetExplicitWide();
-            std::cout << '[';
-            if (mem.registers[0] != RegisterIndex::None) std::cout << registerNames[mem.registers[0]];
-            if (mem.registers[1] != RegisterIndex::None) std::cout << " + " << registerNames[mem.registers[1]];
-            if (mem.disp != 0)                           std::cout << " + " << std::to_string(mem.disp);
-            std::cout << ']';
+            out += mem.GetExplicitWide();
+            out += '[';
+            if (mem.registers[0] != RegisterIndex::None) out += registerNames[mem.registers[0]];
+            if (mem.registers[1] != RegisterIndex::None) (out += " + ") += registerNames[mem.registers[1]];
+            if (mem.disp != 0)                           (out += " + ") += std::to_string(mem.disp);
+            out += ']';
             break;
         case Type::JumpDisplacement:
-            std::cout << '$';
+            out += '$';
             if (jump.value > 0)
-                std::cout << '+' << std::to_string(jump.value);
+                (out += '+') += std::to_string(jump.value);
             else if (jump.value < 0)
-                std::cout << std::to_string(jump.value);
-            std::cout << "+0";
+                out += std::to_string(jump.value);
+            out += "+0";
             break;
         default:
             break;
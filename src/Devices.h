@@ -0,0 +1,369 @@
+#pragma once
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Helpers.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "UndoLog.h"
+#include "DirectMemory.h"
+#include "Stack.h"
+#include "StringOperations.h"
+
+// Devices run on a clock of estimated 8086 clocks. Each device schedules its next event in a
+// min-heap keyed by that clock, and the run loop only compares the clock with nextEventCycle,
+// so nothing is polled between events. Interrupt requests go through a PIC stand-in: IRQ n
+// raises vector 8 + n, lower IRQs win and handlers acknowledge with EOI (0x20 to port 0x20).
+// There are no segments, int pushes flags, 0 for cs and ip, and takes ip from the vector table
+// at address vector * 4.
+// Device state isn't part of snapshots or the undo log, stepping back only rewinds the CPU.
+// JIT and fast-forwarded loops don't advance the device clock, so they are off while devices run.
+
+constexpr u16 picCommandPort = 0x20;
+constexpr u8 picEndOfInterrupt = 0x20;
+constexpr u8 picVectorBase = 8;
+constexpr u16 timerDataPort = 0x40;
+constexpr u16 timerControlPort = 0x43;
+constexpr u16 keyboardDataPort = 0x60;
+constexpr u16 keyboardStatusPort = 0x64;
+constexpr u16 debugConsolePort = 0xE9;
+constexpr u8 unconnectedPortData = 0xFF;
+
+constexpr int timerIrq = 0;
+constexpr int keyboardIrq = 1;
+constexpr int irqCount = 8;
+constexpr u64 timerClocksPerTick = 4;       // PIT input is 1.19 MHz against 4.77 MHz CPU
+constexpr int interruptEntryClocks = 61;    // hardware interrupt acknowledge and entry
+constexpr u64 noEventCycle = std::numeric_limits<u64>::max();
+
+enum class Device : u8 { Timer, Keyboard };
+
+struct DeviceEvent
+{
+    u64 cycle = 0;
+    Device device = Device::Timer;
+    u32 generation = 0;     // events of a reprogrammed device are dropped
+
+    bool operator>(const DeviceEvent& other) const
+    {
+        return cycle > other.cycle;
+    }
+};
+
+struct TimerDevice
+{
+    u64 period = 0;         // CPU clocks between interrupts, 0 is stopped
+    u64 nextFire = 0;
+    u32 generation = 0;
+    bool highByteNext = false;
+    u8 reloadLow = 0;
+};
+
+struct KeyboardDevice
+{
+    std::string keys;
+    size_t nextKey = 0;
+    u64 interval = 0;
+    u8 data = 0;
+    bool outputFull = false;
+};
+
+struct DeviceConfig
+{
+    bool enabled = false;
+    u64 timerPeriod = 0;
+    std::string keys;
+    u64 keyInterval = 20000;
+};
+
+thread_local bool devicesEnabled = false;
+thread_local u64 deviceClock = 0;
+thread_local u64 nextEventCycle = noEventCycle;
+thread_local std::priority_queue<DeviceEvent, std::vector<DeviceEvent>, std::greater<DeviceEvent>> deviceEvents;
+thread_local u8 pendingIrqs = 0;
+thread_local u8 inServiceIrqs = 0;
+thread_local u64 hardwareInterrupts = 0;
+thread_local TimerDevice timerDevice{};
+thread_local KeyboardDevice keyboardDevice{};
+thread_local std::string debugConsoleOutput;
+
+// Lowest pending IRQ that isn't blocked by IF or by a handler of the same or higher priority
+int DeliverableIrq()
+{
+    if (!flags[Flag::FLAG_INTERRUPT])
+    {
+        return -1;
+    }
+    for (int irq = 0; irq < irqCount; irq++)
+    {
+        if (inServiceIrqs & (1 << irq))
+        {
+            return -1;
+        }
+        if (pendingIrqs & (1 << irq))
+        {
+            return irq;
+        }
+    }
+    return -1;
+}
+
+void UpdateNextEventCycle()
+{
+    nextEventCycle = DeliverableIrq() >= 0 ? deviceClock
+                   : deviceEvents.empty() ? noEventCycle
+                   : deviceEvents.top().cycle;
+}
+
+void InterruptFlagChanged()
+{
+    UpdateNextEventCycle();
+}
+
+void ScheduleDeviceEvent(u64 cycle, Device device, u32 generation)
+{
+    deviceEvents.push({ cycle, device, generation });
+    UpdateNextEventCycle();
+}
+
+void StartTimer(u64 period)
+{
+    timerDevice.generation++;
+    timerDevice.period = period;
+    if (period != 0)
+    {
+        timerDevice.nextFire = deviceClock + period;
+        ScheduleDeviceEvent(timerDevice.nextFire, Device::Timer, timerDevice.generation);
+    }
+}
+
+// Pushes flags, cs and ip, then continues at handler from the vector table with IF cleared
+void EnterInterrupt(u8 vector, u16 returnIp)
+{
+    StackPush(PackFlags());
+    StackPush(0);
+    StackPush(returnIp);
+    RecordFlagsWrite();
+    flags[Flag::FLAG_INTERRUPT] = false;
+    ipReg = (s16)DirectRead(u16(vector * 4), true);
+    UpdateNextEventCycle();
+}
+
+void EnableDevices(const DeviceConfig& config)
+{
+    devicesEnabled = true;
+    keyboardDevice.keys = config.keys;
+    keyboardDevice.interval = config.keyInterval;
+    if (!config.keys.empty())
+    {
+        ScheduleDeviceEvent(deviceClock + config.keyInterval, Device::Keyboard, 0);
+    }
+    StartTimer(config.timerPeriod);
+}
+
+// Fires device events that are due and enters interrupt handler when one can be delivered,
+// returns its vector or -1
+int ServiceDevices()
+{
+    while (!deviceEvents.empty() && deviceEvents.top().cycle <= deviceClock)
+    {
+        const DeviceEvent event = deviceEvents.top();
+        deviceEvents.pop();
+        switch (event.device)
+        {
+        case Device::Timer:
+            if (event.generation != timerDevice.generation)
+            {
+                break;
+            }
+            pendingIrqs |= 1 << timerIrq;
+            timerDevice.nextFire = event.cycle + timerDevice.period;
+            deviceEvents.push({ timerDevice.nextFire, Device::Timer, event.generation });
+            break;
+        case Device::Keyboard:
+            // Unread key gets overwritten, there is no buffer
+            keyboardDevice.data = u8(keyboardDevice.keys[keyboardDevice.nextKey++]);
+            keyboardDevice.outputFull = true;
+            pendingIrqs |= 1 << keyboardIrq;
+            if (keyboardDevice.nextKey < keyboardDevice.keys.size())
+            {
+                deviceEvents.push({ event.cycle + keyboardDevice.interval, Device::Keyboard, 0 });
+            }
+            break;
+        }
+    }
+
+    int vector = -1;
+    if (const int irq = DeliverableIrq(); irq >= 0)
+    {
+        pendingIrqs &= ~(1 << irq);
+        inServiceIrqs |= 1 << irq;
+        vector = picVectorBase + irq;
+        hardwareInterrupts++;
+        EnterInterrupt(u8(vector), (u16)ipReg);
+        deviceClock += interruptEntryClocks;
+    }
+    UpdateNextEventCycle();
+    return vector;
+}
+
+// Moves device clock past executed operation, returns vector of delivered interrupt or -1
+int AdvanceDevices(const Operation& op)
+{
+    deviceClock += CycleEstimation(op, lastStringRepetitions);
+    return deviceClock >= nextEventCycle ? ServiceDevices() : -1;
+}
+
+u8 PortReadByte(u16 port)
+{
+    switch (port)
+    {
+    case timerDataPort:
+    {
+        // Counter runs down once per tick, low byte is read first
+        const u64 remaining = timerDevice.period != 0 && timerDevice.nextFire > deviceClock
+            ? (timerDevice.nextFire - deviceClock) / timerClocksPerTick : 0;
+        timerDevice.highByteNext = !timerDevice.highByteNext;
+        return timerDevice.highByteNext ? u8(remaining) : u8(remaining >> 8);
+    }
+    case keyboardDataPort:
+        keyboardDevice.outputFull = false;
+        return keyboardDevice.data;
+    case keyboardStatusPort:
+        return keyboardDevice.outputFull ? 1 : 0;
+    default:
+        return unconnectedPortData;
+    }
+}
+
+void PortWriteByte(u16 port, u8 data)
+{
+    switch (port)
+    {
+    case picCommandPort:
+        if (data == picEndOfInterrupt && inServiceIrqs != 0)
+        {
+            inServiceIrqs &= inServiceIrqs - 1; // highest priority handler is the lowest bit
+            UpdateNextEventCycle();
+        }
+        break;
+    case timerControlPort:
+        // Only channel 0 with lo/hi access exists, control word stops it until reload is written
+        if ((data >> 6) == 0)
+        {
+            StartTimer(0);
+            timerDevice.highByteNext = false;
+        }
+        break;
+    case timerDataPort:
+        if (!timerDevice.highByteNext)
+        {
+            timerDevice.reloadLow = data;
+        }
+        else
+        {
+            const u32 reload = timerDevice.reloadLow | (data << 8);
+            StartTimer((reload == 0 ? 0x10000 : reload) * timerClocksPerTick);
+        }
+        timerDevice.highByteNext = !timerDevice.highByteNext;
+        break;
+    case debugConsolePort:
+        debugConsoleOutput += char(data);
+        break;
+    default:
+        break;
+    }
+}
+
+// Word transfers go to port and port + 1
+u16 PortRead(u16 port, bool wide)
+{
+    const u16 low = PortReadByte(port);
+    return wide ? u16(low | (PortReadByte(u16(port + 1)) << 8)) : low;
+}
+
+void PortWrite(u16 port, bool wide, u16 data)
+{
+    PortWriteByte(port, u8(data));
+    if (wide)
+    {
+        PortWriteByte(u16(port + 1), u8(data >> 8));
+    }
+}
+
+// Executes int, iret, in, out, cli or sti and moves ipReg, trace is only built when asked for
+void ExecuteSystemOp(const Operation& op, std::string* trace)
+{
+    const u16 nextIp = u16(ipReg + op.size + 1);
+    switch (op.opSystemIndex)
+    {
+    case OpSystem::intN:
+        EnterInterrupt(u8(op.operands[0].immVal.value), nextIp);
+        return;
+    case OpSystem::iret:
+        ipReg = (s16)StackPop();
+        StackPop();
+        UnpackFlags(StackPop());
+        return;
+    case OpSystem::in:
+    {
+        const Operand& port = op.operands[1];
+        const bool wide = !IsByteRegister(op.operands[0].reg);
+        const u16 data = PortRead(port.type == Operand::Type::Immediate ? u16(port.immVal.value) : registersMem[GetRegisterSlot(RegisterIndex::dx)], wide);
+        u16* ax = GetRegisterMem(RegisterIndex::ax);
+        const u16 prevAx = *ax;
+        RecordRegisterWrite(ax);
+        if (wide)
+        {
+            *ax = data;
+        }
+        else
+        {
+            *GetByteRegisterMem(RegisterIndex::al) = u8(data);
+        }
+        if (trace)
+        {
+            *trace += " ; ax:" + HexString(prevAx) + " -> " + HexString(*ax);
+        }
+        break;
+    }
+    case OpSystem::out:
+    {
+        const Operand& port = op.operands[0];
+        const bool wide = !IsByteRegister(op.operands[1].reg);
+        const u16 portNumber = port.type == Operand::Type::Immediate ? u16(port.immVal.value) : registersMem[GetRegisterSlot(RegisterIndex::dx)];
+        const u16 data = wide ? registersMem[0] : u8(registersMem[0]);
+        PortWrite(portNumber, wide, data);
+        if (trace)
+        {
+            *trace += " ; port " + HexString(portNumber) + " <- " + HexString(data);
+        }
+        break;
+    }
+    case OpSystem::cli:
+    case OpSystem::sti:
+        RecordFlagsWrite();
+        flags[Flag::FLAG_INTERRUPT] = op.opSystemIndex == OpSystem::sti;
+        InterruptFlagChanged();
+        break;
+    }
+    ipReg = (s16)nextIp;
+}
+
+void PrintDeviceState()
+{
+    if (devicesEnabled)
+    {
+        std::cout << "\nDevice clock: " << deviceClock << ", hardware interrupts: " << hardwareInterrupts;
+    }
+    if (!debugConsoleOutput.empty())
+    {
+        std::cout << "\nDebug console: " << debugConsoleOutput;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+#include "Framebuffer.h"
+#include "MemoryAnalyzer.h"
+
+// Reads and writes of instructions with implicit addresses (string and stack operations),
+// done straight on mainMemory without MemoryAccess. Watchpoints, memory analyzer,
+// undo log, dirty pages and framebuffer still see every access
+
+u16 DirectRead(u16 address, bool wide)
+{
+    if (breakpointsArmed)
+    {
+        CheckWatchpoint(address, wide, false);
+    }
+    if (memoryAnalyzerEnabled)
+    {
+        RecordMemoryAccess(address, wide, false);
+    }
+    return wide ? u16(mainMemory[address] | (mainMemory[u16(address + 1)] << 8)) : mainMemory[address];
+}
+
+void DirectWrite(u16 address, bool wide, u16 data)
+{
+    if (breakpointsArmed)
+    {
+        CheckWatchpoint(address, wide, true);
+    }
+    if (memoryAnalyzerEnabled)
+    {
+        RecordMemoryAccess(address, wide, true);
+    }
+    RecordMemoryWrite(address, wide);
+    MarkMemoryWritten(address, wide);
+    if (framebufferEnabled)
+    {
+        MarkFramebufferWritten(address, wide);
+    }
+    mainMemory[address] = data & 0xFF;
+    if (wide)
+    {
+        mainMemory[u16(address + 1)] = data >> 8;
+    }
+}
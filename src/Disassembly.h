@@ -0,0 +1,59 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuOperations.h"
+
+// Disassembly of each decoded operation is formatted once, when the listing is decoded, into an
+// interned table that operations reference by index. Traces then write the prebuilt text and
+// only format the register, ip and flag changes of each step.
+// Table is filled by the main thread before any run, workers only read it.
+
+std::vector<std::string> disassemblyTable;
+std::unordered_map<std::string, int> disassemblyIndex;
+
+std::string FormatOperation(const Operation& op)
+{
+    std::string text;
+    op.FormatOp(text);
+    op.operands[0].Format(text);
+    if (op.operands[1].type != Operand::Type::None)
+    {
+        text += ", ";
+        op.operands[1].Format(text);
+    }
+    return text;
+}
+
+// Same instruction at different offsets shares one entry
+int InternDisassembly(std::string text)
+{
+    const auto [it, inserted] = disassemblyIndex.try_emplace(std::move(text), int(disassemblyTable.size()));
+    if (inserted)
+    {
+        disassemblyTable.push_back(it->first);
+    }
+    return it->second;
+}
+
+void FormatDisassembly(std::unordered_map<int, Operation>& operations)
+{
+    for (auto& [offset, op] : operations)
+    {
+        op.disassembly = InternDisassembly(FormatOperation(op));
+    }
+}
+
+void PrintOperation(const Operation& op)
+{
+    if (op.disassembly < 0)
+    {
+        std::cout << FormatOperation(op);
+        return;
+    }
+    const std::string& text = disassemblyTable[op.disassembly];
+    std::cout.write(text.data(), text.size());
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Defines.h"
+#include "Breakpoints.h"
+#include "MemoryAnalyzer.h"
+#include "UndoLog.h"
+#include "Framebuffer.h"
+
+// Instrumentation of memory operands is picked at compile time through policy types, so an
+// instantiation without watchpoints, profiling, undo log or framebuffer has no checks for them at all.
+// Runtime policies test the global switches instead, they are for callers that don't pick
+// a configuration up front (undo replay, interpreter fallback of the JIT, batch runs).
+
+struct NoWatchpoints
+{
+    static constexpr bool enabled = false;
+    static void Check(u16, bool, bool) {}
+};
+
+struct ArmedWatchpoints
+{
+    static constexpr bool enabled = true;
+    static void Check(u16 address, bool wide, bool write) { CheckWatchpoint(address, wide, write); }
+};
+
+struct RuntimeWatchpoints
+{
+    static constexpr bool enabled = true;
+    static void Check(u16 address, bool wide, bool write)
+    {
+        if (breakpointsArmed)
+        {
+            CheckWatchpoint(address, wide, write);
+        }
+    }
+};
+
+struct NoProfiler
+{
+    static constexpr bool enabled = false;
+    static void Access(u16, bool, bool) {}
+};
+
+struct MemoryProfiler
+{
+    static constexpr bool enabled = true;
+    static void Access(u16 address, bool wide, bool write) { RecordMemoryAccess(address, wide, write); }
+};
+
+struct RuntimeProfiler
+{
+    static constexpr bool enabled = true;
+    static void Access(u16 address, bool wide, bool write)
+    {
+        if (memoryAnalyzerEnabled)
+        {
+            RecordMemoryAccess(address, wide, write);
+        }
+    }
+};
+
+struct NoUndo
+{
+    static constexpr bool enabled = false;
+    static void Step() { executedSteps++; }
+    static void Register(const u16*) {}
+    static void Memory(u16, bool) {}
+    static void Flags() {}
+};
+
+// Undo ring is known to be enabled
+struct RecordUndo
+{
+    static constexpr bool enabled = true;
+    static void Step() { PushUndoStep(); executedSteps++; }
+    static void Register(const u16* reg) { PushRegisterUndo(reg); }
+    static void Memory(u16 address, bool wide) { PushMemoryUndo(address, wide); }
+    static void Flags() { PushFlagsUndo(); }
+};
+
+struct RuntimeUndo
+{
+    static constexpr bool enabled = true;
+    static void Step() { RecordUndoStep(); }
+    static void Register(const u16* reg) { RecordRegisterWrite(reg); }
+    static void Memory(u16 address, bool wide) { RecordMemoryWrite(address, wide); }
+    static void Flags() { RecordFlagsWrite(); }
+};
+
+struct NoFramebuffer
+{
+    static constexpr bool enabled = false;
+    static void Written(u16, bool) {}
+};
+
+struct RuntimeFramebuffer
+{
+    static constexpr bool enabled = true;
+    static void Written(u16 address, bool wide)
+    {
+        if (framebufferEnabled)
+        {
+            MarkFramebufferWritten(address, wide);
+        }
+    }
+};
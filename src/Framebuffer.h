@@ -0,0 +1,275 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Breakpoints.h"
+
+// Exports a region of mainMemory as an image. Writes into the region grow a dirty rectangle,
+// only that rectangle gets converted again when the next frame is written
+
+enum class PixelFormat { RGBA8, RGB8, Gray8 };
+
+struct FramebufferConfig
+{
+    u16 base = 0;
+    u16 width = 64;
+    u16 height = 64;
+    PixelFormat format = PixelFormat::RGBA8;
+    std::string outPath = "framebuffer.ppm";
+    u64 frameEvery = 0; // 0 means only final frame is written
+};
+
+struct DirtyRect
+{
+    int x0 = 0, y0 = 0, x1 = -1, y1 = -1; // inclusive, empty while x1 < x0
+
+    bool IsEmpty() const { return x1 < x0; }
+
+    void Add(int x, int y)
+    {
+        if (IsEmpty())
+        {
+            x0 = x1 = x;
+            y0 = y1 = y;
+            return;
+        }
+        x0 = std::min(x0, x);   x1 = std::max(x1, x);
+        y0 = std::min(y0, y);   y1 = std::max(y1, y);
+    }
+};
+
+// Per thread like the memory it shows, batch workers never enable it
+thread_local FramebufferConfig framebuffer{};
+thread_local bool framebufferEnabled = false;
+thread_local DirtyRect framebufferDirty{};
+thread_local std::vector<u8> framebufferRgb;    // converted pixels, kept between frames
+thread_local int framebufferFrameIndex = 0;
+
+int BytesPerPixel(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::RGBA8:    return 4;
+    case PixelFormat::RGB8:     return 3;
+    case PixelFormat::Gray8:    return 1;
+    }
+    return 1;
+}
+
+void EnableFramebuffer(const FramebufferConfig& config)
+{
+    framebuffer = config;
+    framebufferEnabled = true;
+    framebufferRgb.assign(framebuffer.width * framebuffer.height * 3, 0);
+    framebufferDirty = {};
+    framebufferDirty.Add(0, 0);
+    framebufferDirty.Add(framebuffer.width - 1, framebuffer.height - 1);
+}
+
+void MarkFramebufferWritten(u16 address, bool wide)
+{
+    const int bpp = BytesPerPixel(framebuffer.format);
+    const int size = framebuffer.width * framebuffer.height * bpp;
+    for (int byte = address; byte <= address + wide; byte++)
+    {
+        const int offset = byte - framebuffer.base;
+        if (offset >= 0 && offset < size)
+        {
+            const int pixel = offset / bpp;
+            framebufferDirty.Add(pixel % framebuffer.width, pixel / framebuffer.width);
+        }
+    }
+}
+
+void UpdateFramebufferRgb()
+{
+    if (framebufferDirty.IsEmpty())
+    {
+        return;
+    }
+
+    const int bpp = BytesPerPixel(framebuffer.format);
+    for (int y = framebufferDirty.y0; y <= framebufferDirty.y1; y++)
+    {
+        for (int x = framebufferDirty.x0; x <= framebufferDirty.x1; x++)
+        {
+            const int pixel = y * framebuffer.width + x;
+            const u8* src = &mainMemory[u16(framebuffer.base + pixel * bpp)];
+            u8* dst = &framebufferRgb[pixel * 3];
+            if (framebuffer.format == PixelFormat::Gray8)
+            {
+                dst[0] = dst[1] = dst[2] = src[0];
+            }
+            else
+            {
+                dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+            }
+        }
+    }
+    framebufferDirty = {};
+}
+
+/* START OF PNG HELPERS */
+u32 Crc32(const u8* data, size_t size, u32 crc = 0)
+{
+    static u32 table[256] = {};
+    if (table[1] == 0)
+    {
+        for (u32 i = 0; i < 256; i++)
+        {
+            u32 c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void PushBigEndian(std::vector<u8>& out, u32 value)
+{
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+void PushPngChunk(std::vector<u8>& out, const char* type, const std::vector<u8>& data)
+{
+    PushBigEndian(out, (u32)data.size());
+    const size_t typeBegin = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    PushBigEndian(out, Crc32(&out[typeBegin], out.size() - typeBegin));
+}
+
+// Pixels are stored uncompressed (deflate "stored" blocks), so no zlib is needed
+std::vector<u8> EncodePng(const std::vector<u8>& rgb, int width, int height)
+{
+    std::vector<u8> scanlines;
+    scanlines.reserve((width * 3 + 1) * height);
+    for (int y = 0; y < height; y++)
+    {
+        scanlines.push_back(0); // filter: none
+        scanlines.insert(scanlines.end(), &rgb[y * width * 3], &rgb[y * width * 3] + width * 3);
+    }
+
+    std::vector<u8> zlib = {0x78, 0x01};
+    u32 adlerA = 1, adlerB = 0;
+    for (size_t i = 0; i < scanlines.size(); i++)
+    {
+        adlerA = (adlerA + scanlines[i]) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+    }
+    for (size_t begin = 0; begin < scanlines.size() || begin == 0; begin += 65535)
+    {
+        const u16 blockSize = (u16)std::min<size_t>(65535, scanlines.size() - begin);
+        const bool lastBlock = begin + blockSize >= scanlines.size();
+        zlib.push_back(lastBlock ? 1 : 0);
+        zlib.push_back(blockSize & 0xFF);   zlib.push_back(blockSize >> 8);
+        zlib.push_back(~blockSize & 0xFF);  zlib.push_back((u16)~blockSize >> 8);
+        zlib.insert(zlib.end(), scanlines.begin() + begin, scanlines.begin() + begin + blockSize);
+    }
+    PushBigEndian(zlib, (adlerB << 16) | adlerA);
+
+    std::vector<u8> header;
+    PushBigEndian(header, width);
+    PushBigEndian(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit depth, truecolor, no interlace
+
+    std::vector<u8> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    PushPngChunk(png, "IHDR", header);
+    PushPngChunk(png, "IDAT", zlib);
+    PushPngChunk(png, "IEND", {});
+    return png;
+}
+/* END OF PNG HELPERS */
+
+void WriteFramebufferImage(const std::string& path)
+{
+    UpdateFramebufferRgb();
+
+    std::ofstream file{ path, std::ios::binary };
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0)
+    {
+        const auto png = EncodePng(framebufferRgb, framebuffer.width, framebuffer.height);
+        file.write(reinterpret_cast<const char*>(png.data()), png.size());
+    }
+    else
+    {
+        file << "P6\n" << framebuffer.width << ' ' << framebuffer.height << "\n255\n";
+        file.write(reinterpret_cast<const char*>(framebufferRgb.data()), framebufferRgb.size());
+    }
+}
+
+// Incremental frame, skipped if nothing was drawn since the previous one
+void WriteFramebufferFrame()
+{
+    if (framebufferDirty.IsEmpty())
+    {
+        return;
+    }
+
+    const auto extensionPos = framebuffer.outPath.rfind('.');
+    const std::string stem = framebuffer.outPath.substr(0, extensionPos);
+    const std::string extension = extensionPos != std::string::npos ? framebuffer.outPath.substr(extensionPos) : ".ppm";
+    char frameNumber[16];
+    std::snprintf(frameNumber, sizeof(frameNumber), "_%05d", framebufferFrameIndex++);
+    WriteFramebufferImage(stem + frameNumber + extension);
+}
+
+// "base,width,height[,rgba8|rgb8|gray8]", false for malformed fields, unknown formats and
+// regions that are empty or run past the end of memory. Leaves config untouched on failure
+bool ParseFramebufferConfig(const std::string& str, FramebufferConfig& config)
+{
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (true)
+    {
+        const auto end = str.find(',', begin);
+        parts.push_back(str.substr(begin, end - begin));
+        if (end == std::string::npos) break;
+        begin = end + 1;
+    }
+    if (parts.size() > 4)
+    {
+        return false;
+    }
+
+    long fields[3] = { config.base, config.width, config.height };
+    for (size_t i = 0; i < std::min<size_t>(parts.size(), 3); i++)
+    {
+        if (!ParseInteger(parts[i], fields[i]) || fields[i] < 0 || fields[i] > 0xFFFF)
+        {
+            return false;
+        }
+    }
+    PixelFormat format = config.format;
+    if (parts.size() > 3)
+    {
+        if (parts[3] == "rgba8")        format = PixelFormat::RGBA8;
+        else if (parts[3] == "rgb8")    format = PixelFormat::RGB8;
+        else if (parts[3] == "gray8")   format = PixelFormat::Gray8;
+        else                            return false;
+    }
+    const u64 regionSize = u64(fields[1]) * u64(fields[2]) * BytesPerPixel(format);
+    if (regionSize == 0 || u64(fields[0]) + regionSize > mainMemoryLimit)
+    {
+        return false;
+    }
+
+    config.base = u16(fields[0]);
+    config.width = u16(fields[1]);
+    config.height = u16(fields[2]);
+    config.format = format;
+    return true;
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <unordered_map>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "CpuExecution.h"
+#include "MachineState.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+
+// Superinstructions: "add/sub/cmp reg, reg|imm" followed by je/jne/js/jns
+// (optionally two of them, like "add cx, 1; cmp cx, 64; jne") run as one step.
+// Registers are accessed by slot, no MemoryAccess or trace string is built, the jump
+// is decided straight from the last result and flags of earlier operations are skipped,
+// as the last one overwrites them anyway. Traced runs keep executing one instruction at a time.
+
+bool FusionSupportsArithmetic(const Operation& op)
+{
+    return op.type == Operation::Type::Operation
+        && (op.opIndex == OpIndex::ADD || op.opIndex == OpIndex::SUB || op.opIndex == OpIndex::CMP)
+        && op.operands[0].type == Operand::Type::Register && !IsByteRegister(op.operands[0].reg)
+        && ((op.operands[1].type == Operand::Type::Register && !IsByteRegister(op.operands[1].reg))
+            || op.operands[1].type == Operand::Type::Immediate);
+}
+
+bool FusionSupportsJump(const Operation& op)
+{
+    return op.type == Operation::Type::Jump
+        && (op.opJumpIndex == OpJump::je || op.opJumpIndex == OpJump::jne
+            || op.opJumpIndex == OpJump::js || op.opJumpIndex == OpJump::jns);
+}
+
+FusedArithmetic MakeFusedArithmetic(const Operation& op)
+{
+    FusedArithmetic arithmetic{};
+    arithmetic.opIndex = op.opIndex;
+    arithmetic.size = u8(op.size + 1);
+    arithmetic.dst = u8(GetRegisterMem(op.operands[0].reg) - registersMem);
+    arithmetic.srcIsImmediate = op.operands[1].type == Operand::Type::Immediate;
+    if (arithmetic.srcIsImmediate)
+        arithmetic.immediate = (u16)op.operands[1].immVal.value;
+    else
+        arithmetic.src = u8(GetRegisterMem(op.operands[1].reg) - registersMem);
+    return arithmetic;
+}
+
+void FuseOperations(std::unordered_map<int, Operation>& operations)
+{
+    const auto next = [&](int ip) -> Operation* {
+        auto operationIt = operations.find(ip + operations.at(ip).size + 1);
+        return operationIt != operations.end() ? &operationIt->second : nullptr;
+    };
+
+    for (auto& [ip, op] : operations)
+    {
+        if (!FusionSupportsArithmetic(op))
+        {
+            continue;
+        }
+
+        Operation* second = next(ip);
+        if (!second)
+        {
+            continue;
+        }
+        const Operation* jump = second;
+        int count = 1;
+        if (FusionSupportsArithmetic(*second))
+        {
+            jump = next(ip + op.size + 1);
+            count = 2;
+        }
+        if (!jump || !FusionSupportsJump(*jump))
+        {
+            continue;
+        }
+
+        op.fused.count = u8(count);
+        op.fused.arithmetic[0] = MakeFusedArithmetic(op);
+        if (count == 2)
+        {
+            op.fused.arithmetic[1] = MakeFusedArithmetic(*second);
+        }
+        op.fused.jump = jump->opJumpIndex;
+        op.fused.jumpSize = u8(jump->size + 1);
+        op.fused.jumpDisp = jump->operands[0].jump.value;
+    }
+}
+
+void ExecuteFusedGroup(const FusedGroup& group)
+{
+    // Undo log needs flags of every step, otherwise only the last result sets them
+    const bool keepAllFlags = !undoRing.empty();
+    u16 result = 0;
+    for (int i = 0; i < group.count; i++)
+    {
+        const FusedArithmetic& arithmetic = group.arithmetic[i];
+        RecordUndoStep();
+
+        u16& dst = registersMem[arithmetic.dst];
+        const u16 data = arithmetic.srcIsImmediate ? arithmetic.immediate : registersMem[arithmetic.src];
+        result = ArithmeticResult(arithmetic.opIndex, dst, data, true);
+        if (arithmetic.opIndex != OpIndex::CMP)
+        {
+            RecordRegisterWrite(&dst);
+            dst = result;
+        }
+        if (keepAllFlags || i == group.count - 1)
+        {
+            RecordFlagsWrite();
+            flags[Flag::FLAG_ZERO] = result == 0;
+            flags[Flag::FLAG_SIGNED] = ArithmeticSign(result, true);
+        }
+        ipReg += arithmetic.size;
+    }
+
+    RecordUndoStep();
+    bool taken;
+    switch (group.jump)
+    {
+    case OpJump::je:    taken = result == 0;            break;
+    case OpJump::jne:   taken = result != 0;            break;
+    case OpJump::js:    taken = (result & 0x8000) != 0; break;
+    default:            taken = (result & 0x8000) == 0; break;
+    }
+    ipReg += taken ? group.jumpDisp : group.jumpSize;
+}
+
+// Untraced step, runs whole fused sequence when one starts here, unless devices
+// have to see the clock after every operation
+void ExecuteStepFast(const Operation& op)
+{
+    if (op.fused.count != 0 && !breakpointsArmed && !devicesEnabled)
+    {
+        ExecuteFusedGroup(op.fused);
+        return;
+    }
+    ExecuteStepWith<false, RuntimeWatchpoints, RuntimeProfiler>(op);
+}
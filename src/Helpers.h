@@ -4,6 +4,7 @@
 #include <cassert>
 
 #include "CpuMemory.h"
+#include "CpuNames.h"
 
 /* START OF STRING HELPERS */
 std::string HexString(u16 byte)
@@ -19,6 +20,7 @@ const char* FlagStr(Flag flag)
     {
     case FLAG_ZERO:     return "Z";
     case FLAG_SIGNED:   return "S";
+    case FLAG_INTERRUPT:return "I";
     case FLAG_COUNT:    assert(false);
     }
     return "";
@@ -64,3 +66,38 @@ std::string ByteInStr2(u16 byte)
     return result;
 }
 /* END OF DEBUG FUNCTIONS */
+
+/* START OF STATE PRINTING */
+void PrintFinalState()
+{
+    const auto printRegisterValue = [&](RegisterIndex regIndex) {
+        auto regValue = *GetRegisterMem(regIndex);
+        if (regValue == 0)
+        {
+            return;
+        }
+        auto regName = registerNames[regIndex]; // TODO: only considering full 16 bit registers
+        std::cout << "\n\t" << regName
+            << ": " << HexString(regValue) 
+            << " (" << regValue << ")";
+    };
+
+    // Order of registers in memory is mixed up just like in 8086
+    // so we manualy reorder values for better order
+    std::cout << "\nFinal registers:";
+    for (auto i : {RegisterIndex::ax, RegisterIndex::bx, RegisterIndex::cx, RegisterIndex::dx, RegisterIndex::sp, RegisterIndex::bp, RegisterIndex::si, RegisterIndex::di, })
+    {
+        printRegisterValue(i);
+    }
+    // ip register can be in the registersMem, but it it's considered as a separate "hidden" regitser
+    // so we print it out separately
+    std::cout << "\n\tip: " << HexString(ipReg) << " (" << ipReg << ")";
+
+    std::cout << "\nFinal flags:\n\t";
+    for (int i = 0; i < Flag::FLAG_COUNT; i++)
+    {
+        if (flags[i])
+            std::cout << FlagStr((Flag)i);
+    }
+}
+/* END OF STATE PRINTING */
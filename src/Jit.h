@@ -0,0 +1,772 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "DecoderOperands.h"
+#include "CpuExecution.h"
+#include "CpuSnapshot.h"
+#include "Fusion.h"
+
+// Translates hot basic blocks into x86-64 code. Block entries are counted by the dispatcher,
+// once a block gets hot enough its mov/add/sub/cmp instructions and the closing jump are compiled.
+// Anything else ends the block and goes back to the interpreter.
+// push/pop of registers are compiled too, calls and returns close a block like jumps.
+//
+// Blocks chain into each other through calls and returns without going back to the dispatcher:
+// a call jumps straight into the compiled body of its target, and a return does so when the
+// popped address matches the one its call pushed on a small ring of predicted return addresses.
+//
+// Inside a block simulated registers are pinned to host registers: registersMem[i] lives in r(8+i).
+// Flags are lazy: only the last flag-setting result is kept in bx (bl for byte operations)
+// and zero/sign flags are derived from it when the block exits.
+// A word access at 0xFFFF wraps its high byte around to 0, compiled code leaves the block
+// before such an operation and the dispatcher runs it on the interpreter.
+//
+//   rsi - JitContext         rdi - mainMemory
+//   rbp - dirtyMemoryPages   rbx - last flags result
+//   rax, rcx, rdx - scratch
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#define JIT_AVAILABLE 1
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+constexpr int jitReturnStackSize = 8;
+static_assert((jitReturnStackSize & (jitReturnStackSize - 1)) == 0, "return ring index wraps with a mask");
+
+struct JitContext
+{
+    u16* registers;
+    u8* memory;
+    bool* dirtyPages;
+    u64 steps;          // instructions executed inside compiled code
+    u16 nextIp;
+    u16 flagsResult;
+    u8 flagsWide;
+    u8 returnTop;       // next slot of returnIps, wraps around
+    u8 wrapExit;        // left before a word access at 0xFFFF, the operation at nextIp didn't run
+    u16 returnIps[jitReturnStackSize];
+    u8** bodies;        // jitBodies
+};
+
+using JitBlockFn = void (*)(JitContext*);
+
+constexpr int jitMaxBlockOperations = 64;
+constexpr size_t jitCodeArenaSize = 1 << 20;
+static_assert(memoryPageSize == 1 << 10, "dirty page marking in compiled code shifts by 10");
+
+int jitHotThreshold = 2;
+std::vector<JitBlockFn> jitBlocks(mainMemoryLimit, nullptr);
+std::vector<u16> jitHotness(mainMemoryLimit, 0);   // u16_max marks blocks that can't be compiled
+std::vector<u8*> jitBodies(mainMemoryLimit, nullptr);   // code right after the prologue, where chained blocks enter
+JitContext jitContext{};                            // kept between blocks, so return predictions outlive them
+u8* jitArena = nullptr;
+size_t jitArenaUsed = 0;
+
+struct JitEmitter
+{
+    std::vector<u8> code;
+    std::vector<size_t> wrapExits;  // jumps to the side exit of the operation being emitted
+
+    void Byte(u8 value)     { code.push_back(value); }
+    void Word(u16 value)    { Byte(value & 0xFF); Byte(value >> 8); }
+    void Dword(u32 value)   { Word(value & 0xFFFF); Word(value >> 16); }
+    void Bytes(std::initializer_list<u8> values) { code.insert(code.end(), values); }
+
+    // Returns position of rel32 that is patched later with PatchHere
+    size_t Jcc32(u8 condition)
+    {
+        Bytes({0x0F, u8(0x80 | condition)});
+        Dword(0);
+        return code.size() - 4;
+    }
+
+    void PatchHere(size_t position)
+    {
+        const u32 rel = u32(code.size() - (position + 4));
+        std::memcpy(&code[position], &rel, 4);
+    }
+
+    void Jmp32(size_t target)
+    {
+        Byte(0xE9);
+        Dword(u32(target - (code.size() + 4)));
+    }
+};
+
+// x86 condition codes used by Jcc32
+enum JitCondition : u8 { JIT_Z = 0x4, JIT_NZ = 0x5, JIT_S = 0x8, JIT_NS = 0x9 };
+
+int JitRegister(RegisterIndex reg)
+{
+    return 8 + int(GetRegisterMem(reg) - registersMem);
+}
+
+bool JitSupportsOperand(const Operand& operand)
+{
+    switch (operand.type)
+    {
+    case Operand::Type::Register:   return !IsByteRegister(operand.reg);
+    case Operand::Type::Immediate:
+    case Operand::Type::Memory:     return true;
+    default:                        return false;
+    }
+}
+
+bool JitSupportsOperation(const Operation& op)
+{
+    if (op.type == Operation::Type::Loop)
+    {
+        return true;
+    }
+    if (op.type == Operation::Type::Stack)
+    {
+        return op.opStackIndex == OpStack::call || op.opStackIndex == OpStack::ret
+            || ((op.opStackIndex == OpStack::push || op.opStackIndex == OpStack::pop) && op.operands[0].type == Operand::Type::Register);
+    }
+    if (op.type == Operation::Type::String || op.type == Operation::Type::System)
+    {
+        return false;
+    }
+    if (op.type == Operation::Type::Jump)
+    {
+        return op.opJumpIndex == OpJump::je || op.opJumpIndex == OpJump::jne
+            || op.opJumpIndex == OpJump::js || op.opJumpIndex == OpJump::jns;
+    }
+
+    if (op.opIndex != OpIndex::MOV && op.opIndex != OpIndex::ADD && op.opIndex != OpIndex::SUB && op.opIndex != OpIndex::CMP)
+    {
+        return false;
+    }
+    const Operand& dst = op.operands[0];
+    const Operand& src = op.operands[1];
+    if (!JitSupportsOperand(dst) || !JitSupportsOperand(src) || dst.type == Operand::Type::Immediate)
+    {
+        return false;
+    }
+    if (dst.type == Operand::Type::Memory && src.type == Operand::Type::Memory)
+    {
+        return false;
+    }
+    // Byte memory is only paired with immediates, as byte registers are not pinned
+    const Operand& memory = dst.type == Operand::Type::Memory ? dst : src;
+    if (memory.type == Operand::Type::Memory && !memory.mem.pointsToWord)
+    {
+        return dst.type == Operand::Type::Memory && src.type == Operand::Type::Immediate;
+    }
+    return true;
+}
+
+// eax = effective address, upper half stays zero as everything after movzx is 16 bit
+void JitEmitAddress(JitEmitter& e, const MemoryExpr& mem)
+{
+    if (mem.registers[0] == RegisterIndex::None)
+    {
+        e.Byte(0xB8);                                                   // mov eax, imm32
+        e.Dword((u16)mem.disp);
+        return;
+    }
+
+    e.Bytes({0x41, 0x0F, 0xB7, u8(0xC0 | (JitRegister(mem.registers[0]) & 7))}); // movzx eax, r16
+    if (mem.registers[1] != RegisterIndex::None)
+    {
+        e.Bytes({0x66, 0x44, 0x01, u8(0xC0 | ((JitRegister(mem.registers[1]) & 7) << 3))}); // add ax, r16
+    }
+    if (mem.disp != 0)
+    {
+        e.Bytes({0x66, 0x05});                                          // add ax, imm16
+        e.Word((u16)mem.disp);
+    }
+}
+
+// eax holds the address, marks its page (and the next one for words) in dirtyMemoryPages
+void JitEmitMarkDirty(JitEmitter& e, bool wide)
+{
+    e.Bytes({0x89, 0xC2});                      // mov edx, eax
+    e.Bytes({0xC1, 0xEA, 0x0A});                // shr edx, 10
+    e.Bytes({0xC6, 0x44, 0x15, 0x00, 0x01});    // mov byte [rbp + rdx], 1
+    if (wide)
+    {
+        e.Bytes({0x8D, 0x50, 0x01});            // lea edx, [rax + 1]
+        e.Bytes({0x0F, 0xB7, 0xD2});            // movzx edx, dx
+        e.Bytes({0xC1, 0xEA, 0x0A});            // shr edx, 10
+        e.Bytes({0xC6, 0x44, 0x15, 0x00, 0x01});// mov byte [rbp + rdx], 1
+    }
+}
+
+// ax holds the address of a word access, one at 0xFFFF leaves through the operation's side exit
+void JitEmitWrapGuard(JitEmitter& e)
+{
+    e.Bytes({0x66, 0x83, 0xF8, 0xFF});          // cmp ax, -1
+    e.wrapExits.push_back(e.Jcc32(JIT_Z));
+}
+
+// ModRM/SIB pair for [rdi + rax] with given reg field
+void JitEmitMemoryOperand(JitEmitter& e, int regField)
+{
+    e.Bytes({u8(((regField & 7) << 3) | 0x04), 0x07});
+}
+
+// Returns width of produced flags result: 0 - flags untouched, 1 - byte, 2 - word
+int JitEmitOperation(JitEmitter& e, const Operation& op)
+{
+    const Operand& dst = op.operands[0];
+    const Operand& src = op.operands[1];
+    // Opcode extensions for 81/80 group and opcodes of "r/m, reg" / "reg, r/m" forms
+    const u8 groupExt = op.opIndex == OpIndex::ADD ? 0 : op.opIndex == OpIndex::SUB ? 5 : 7;
+    const u8 rmRegOpcode = op.opIndex == OpIndex::MOV ? 0x89 : op.opIndex == OpIndex::ADD ? 0x01 : op.opIndex == OpIndex::SUB ? 0x29 : 0x39;
+    const u8 regRmOpcode = rmRegOpcode + 2;
+
+    if (dst.type == Operand::Type::Register)
+    {
+        const int d = JitRegister(dst.reg);
+        switch (src.type)
+        {
+        case Operand::Type::Register:
+            e.Bytes({0x66, 0x45, rmRegOpcode, u8(0xC0 | ((JitRegister(src.reg) & 7) << 3) | (d & 7))});
+            break;
+        case Operand::Type::Immediate:
+            if (op.opIndex == OpIndex::MOV)
+            {
+                e.Bytes({0x66, 0x41, u8(0xB8 | (d & 7))});
+            }
+            else
+            {
+                e.Bytes({0x66, 0x41, 0x81, u8(0xC0 | (groupExt << 3) | (d & 7))});
+            }
+            e.Word((u16)src.immVal.value);
+            break;
+        default:
+            JitEmitAddress(e, src.mem);
+            JitEmitWrapGuard(e);
+            if (op.opIndex == OpIndex::CMP)
+            {
+                e.Bytes({0x66, 0x44, 0x89, u8(0xC3 | ((d & 7) << 3))});    // mov bx, r16
+                e.Bytes({0x66, 0x2B, 0x1C, 0x07});                          // sub bx, [rdi + rax]
+                return 2;
+            }
+            e.Bytes({0x66, 0x44, regRmOpcode});
+            JitEmitMemoryOperand(e, d);
+            break;
+        }
+
+        if (op.opIndex == OpIndex::MOV)
+        {
+            return 0;
+        }
+        if (op.opIndex == OpIndex::CMP)
+        {
+            e.Bytes({0x66, 0x44, 0x89, u8(0xC3 | ((d & 7) << 3))});        // mov bx, r16
+            if (src.type == Operand::Type::Register)
+            {
+                e.Bytes({0x66, 0x44, 0x29, u8(0xC3 | ((JitRegister(src.reg) & 7) << 3))}); // sub bx, r16
+            }
+            else
+            {
+                e.Bytes({0x66, 0x81, 0xEB});                                // sub bx, imm16
+                e.Word((u16)src.immVal.value);
+            }
+            return 2;
+        }
+        e.Bytes({0x66, 0x44, 0x89, u8(0xC3 | ((d & 7) << 3))});            // mov bx, r16
+        return 2;
+    }
+
+    // Memory destination
+    const bool wide = dst.mem.pointsToWord;
+    JitEmitAddress(e, dst.mem);
+    if (wide)
+    {
+        JitEmitWrapGuard(e);
+    }
+    if (op.opIndex != OpIndex::CMP)
+    {
+        JitEmitMarkDirty(e, wide);
+    }
+
+    if (src.type == Operand::Type::Register)
+    {
+        const int s = JitRegister(src.reg);
+        if (op.opIndex == OpIndex::CMP)
+        {
+            e.Bytes({0x0F, 0xB7, 0x1C, 0x07});                              // movzx ebx, word [rdi + rax]
+            e.Bytes({0x66, 0x44, 0x29, u8(0xC3 | ((s & 7) << 3))});        // sub bx, r16
+            return 2;
+        }
+        e.Bytes({0x66, 0x44, rmRegOpcode});
+        JitEmitMemoryOperand(e, s);
+    }
+    else if (op.opIndex == OpIndex::CMP)
+    {
+        if (wide)
+        {
+            e.Bytes({0x0F, 0xB7, 0x1C, 0x07});                              // movzx ebx, word [rdi + rax]
+            e.Bytes({0x66, 0x81, 0xEB});                                    // sub bx, imm16
+            e.Word((u16)src.immVal.value);
+            return 2;
+        }
+        e.Bytes({0x0F, 0xB6, 0x1C, 0x07});                                  // movzx ebx, byte [rdi + rax]
+        e.Bytes({0x80, 0xEB, u8(src.immVal.value)});                        // sub bl, imm8
+        return 1;
+    }
+    else if (op.opIndex == OpIndex::MOV)
+    {
+        if (wide)
+        {
+            e.Bytes({0x66, 0xC7, 0x04, 0x07});
+            e.Word((u16)src.immVal.value);
+        }
+        else
+        {
+            e.Bytes({0xC6, 0x04, 0x07, u8(src.immVal.value)});
+        }
+    }
+    else if (wide)
+    {
+        e.Bytes({0x66, 0x81});
+        JitEmitMemoryOperand(e, groupExt);
+        e.Word((u16)src.immVal.value);
+    }
+    else
+    {
+        e.Byte(0x80);
+        JitEmitMemoryOperand(e, groupExt);
+        e.Byte(u8(src.immVal.value));
+    }
+
+    if (op.opIndex == OpIndex::MOV)
+    {
+        return 0;
+    }
+    if (wide)
+    {
+        e.Bytes({0x0F, 0xB7, 0x1C, 0x07});                                  // movzx ebx, word [rdi + rax]
+        return 2;
+    }
+    e.Bytes({0x0F, 0xB6, 0x1C, 0x07});                                      // movzx ebx, byte [rdi + rax]
+    return 1;
+}
+
+// sp is pinned to r12, pop writes the register last so "pop sp" ends with the popped value
+void JitEmitPushPop(JitEmitter& e, const Operation& op)
+{
+    const int r = JitRegister(op.operands[0].reg);
+    if (op.opStackIndex == OpStack::push)
+    {
+        e.Bytes({0x41, 0x0F, 0xB7, 0xC4});                                  // movzx eax, r12w
+        e.Bytes({0x66, 0x83, 0xE8, 0x02});                                  // sub ax, 2
+        JitEmitWrapGuard(e);
+        e.Bytes({0x66, 0x41, 0x83, 0xEC, 0x02});                            // sub r12w, 2
+        JitEmitMarkDirty(e, true);
+        e.Bytes({0x66, 0x44, 0x89});                                        // mov [rdi + rax], r16
+        JitEmitMemoryOperand(e, r);
+    }
+    else
+    {
+        e.Bytes({0x41, 0x0F, 0xB7, 0xC4});                                  // movzx eax, r12w
+        JitEmitWrapGuard(e);
+        e.Bytes({0x66, 0x41, 0x83, 0xC4, 0x02});                            // add r12w, 2
+        e.Bytes({0x66, 0x44, 0x8B});                                        // mov r16, [rdi + rax]
+        JitEmitMemoryOperand(e, r);
+    }
+}
+
+void JitEmitAddSteps(JitEmitter& e, u32 steps)
+{
+    e.Bytes({0x48, 0x81, 0x46, offsetof(JitContext, steps)});               // add qword [rsi + steps], imm32
+    e.Dword(steps);
+}
+
+// Leaves compiled code, nextIp has to be stored already
+void JitEmitExitTail(JitEmitter& e, u32 steps, int flagsWide)
+{
+    JitEmitAddSteps(e, steps);
+    e.Bytes({0x66, 0x89, 0x5E, offsetof(JitContext, flagsResult)});         // mov word [rsi + flagsResult], bx
+    e.Bytes({0xC6, 0x46, offsetof(JitContext, flagsWide), u8(flagsWide)});  // mov byte [rsi + flagsWide], imm8
+
+    e.Bytes({0x48, 0x8B, 0x06});                                            // mov rax, [rsi + registers]
+    for (int i = 0; i < 8; i++)
+    {
+        e.Bytes({0x66, 0x44, 0x89, u8(0x40 | (i << 3)), u8(i * 2)});        // mov [rax + 2i], r(8+i)w
+    }
+    e.Bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B}); // pop r15..r12, rbp, rbx
+    e.Byte(0xC3);                                                           // ret
+}
+
+void JitEmitExit(JitEmitter& e, u16 nextIp, u32 steps, int flagsWide)
+{
+    e.Bytes({0x66, 0xC7, 0x46, offsetof(JitContext, nextIp)});              // mov word [rsi + nextIp], imm16
+    e.Word(nextIp);
+    JitEmitExitTail(e, steps, flagsWide);
+}
+
+// Jumps into compiled body of the block at ip in ecx, falls through when it isn't compiled
+void JitEmitChain(JitEmitter& e, u32 steps, int flagsWide)
+{
+    e.Bytes({0x48, 0x8B, 0x46, offsetof(JitContext, bodies)});              // mov rax, [rsi + bodies]
+    e.Bytes({0x48, 0x8B, 0x04, 0xC8});                                      // mov rax, [rax + rcx*8]
+    e.Bytes({0x48, 0x85, 0xC0});                                            // test rax, rax
+    const size_t notCompiled = e.Jcc32(JIT_Z);
+    JitEmitAddSteps(e, steps);
+    if (flagsWide == 1)
+    {
+        e.Bytes({0x66, 0x0F, 0xBE, 0xDB});                                  // movsx bx, bl, bodies expect word encoded flags
+    }
+    e.Bytes({0xFF, 0xE0});                                                  // jmp rax
+    e.PatchHere(notCompiled);
+}
+
+void JitEmitCall(JitEmitter& e, u16 targetIp, u16 returnIp, u32 steps, int flagsWide)
+{
+    e.Bytes({0x41, 0x0F, 0xB7, 0xC4});                                      // movzx eax, r12w
+    e.Bytes({0x66, 0x83, 0xE8, 0x02});                                      // sub ax, 2
+    JitEmitWrapGuard(e);
+    e.Bytes({0x66, 0x41, 0x83, 0xEC, 0x02});                                // sub r12w, 2
+    JitEmitMarkDirty(e, true);
+    e.Bytes({0x66, 0xC7, 0x04, 0x07});                                      // mov word [rdi + rax], imm16
+    e.Word(returnIp);
+
+    e.Bytes({0x0F, 0xB6, 0x4E, offsetof(JitContext, returnTop)});           // movzx ecx, byte [rsi + returnTop]
+    e.Bytes({0x66, 0xC7, 0x44, 0x4E, offsetof(JitContext, returnIps)});     // mov word [rsi + rcx*2 + returnIps], imm16
+    e.Word(returnIp);
+    e.Bytes({0xFE, 0xC1});                                                  // inc cl
+    e.Bytes({0x80, 0xE1, jitReturnStackSize - 1});                          // and cl, size - 1
+    e.Bytes({0x88, 0x4E, offsetof(JitContext, returnTop)});                 // mov [rsi + returnTop], cl
+
+    e.Byte(0xB9);                                                           // mov ecx, imm32
+    e.Dword(targetIp);
+    JitEmitChain(e, steps, flagsWide);
+    JitEmitExit(e, targetIp, steps, flagsWide);
+}
+
+void JitEmitRet(JitEmitter& e, const Operation& op, u32 steps, int flagsWide)
+{
+    const u16 release = op.operands[0].type == Operand::Type::Immediate ? u16(2 + op.operands[0].immVal.value) : 2;
+    e.Bytes({0x41, 0x0F, 0xB7, 0xC4});                                      // movzx eax, r12w
+    JitEmitWrapGuard(e);
+    e.Bytes({0x0F, 0xB7, 0x0C, 0x07});                                      // movzx ecx, word [rdi + rax]
+    e.Bytes({0x66, 0x41, 0x81, 0xC4});                                      // add r12w, imm16
+    e.Word(release);
+
+    // Prediction is used up either way, chaining only happens when it was right
+    e.Bytes({0x0F, 0xB6, 0x56, offsetof(JitContext, returnTop)});           // movzx edx, byte [rsi + returnTop]
+    e.Bytes({0xFE, 0xCA});                                                  // dec dl
+    e.Bytes({0x80, 0xE2, jitReturnStackSize - 1});                          // and dl, size - 1
+    e.Bytes({0x88, 0x56, offsetof(JitContext, returnTop)});                 // mov [rsi + returnTop], dl
+    e.Bytes({0x66, 0x3B, 0x4C, 0x56, offsetof(JitContext, returnIps)});     // cmp cx, [rsi + rdx*2 + returnIps]
+    const size_t mispredicted = e.Jcc32(JIT_NZ);
+    JitEmitChain(e, steps, flagsWide);
+    e.PatchHere(mispredicted);
+
+    e.Bytes({0x66, 0x89, 0x4E, offsetof(JitContext, nextIp)});              // mov word [rsi + nextIp], cx
+    JitEmitExitTail(e, steps, flagsWide);
+}
+
+// Tests lazy flags result for zero/sign
+void JitEmitTestFlags(JitEmitter& e, int flagsWide)
+{
+    if (flagsWide == 1)
+        e.Bytes({0x84, 0xDB});          // test bl, bl
+    else
+        e.Bytes({0x66, 0x85, 0xDB});    // test bx, bx
+}
+
+void* JitAllocate(const std::vector<u8>& code)
+{
+#if JIT_AVAILABLE
+    if (!jitArena)
+    {
+        void* arena = mmap(nullptr, jitCodeArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        jitArena = static_cast<u8*>(arena);
+    }
+    if (jitArenaUsed + code.size() > jitCodeArenaSize)
+    {
+        return nullptr;
+    }
+
+    mprotect(jitArena, jitCodeArenaSize, PROT_READ | PROT_WRITE);
+    u8* block = jitArena + jitArenaUsed;
+    std::memcpy(block, code.data(), code.size());
+    jitArenaUsed += (code.size() + 15) & ~size_t(15);
+    mprotect(jitArena, jitCodeArenaSize, PROT_READ | PROT_EXEC);
+    return block;
+#else
+    (void)code;
+    return nullptr;
+#endif
+}
+
+JitBlockFn JitCompileBlock(u16 startIp, const std::unordered_map<int, Operation>& operations)
+{
+    // Collect supported operations up to and including the closing jump
+    std::vector<std::pair<u16, const Operation*>> block;
+    u16 ip = startIp;
+    bool endsWithJump = false;
+    while (block.size() < jitMaxBlockOperations)
+    {
+        auto operationIt = operations.find(ip);
+        if (operationIt == operations.cend() || !JitSupportsOperation(operationIt->second))
+        {
+            break;
+        }
+        const Operation& op = operationIt->second;
+        block.push_back({ip, &op});
+        ip += op.size + 1;
+        if (IsBranch(op))
+        {
+            endsWithJump = true;
+            break;
+        }
+    }
+    if (block.empty())
+    {
+        return nullptr;
+    }
+
+    JitEmitter e;
+    e.Bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, rbp, r12..r15
+    e.Bytes({0x48, 0x89, 0xFE});                                            // mov rsi, rdi
+    e.Bytes({0x48, 0x8B, 0x7E, offsetof(JitContext, memory)});              // mov rdi, [rsi + memory]
+    e.Bytes({0x48, 0x8B, 0x6E, offsetof(JitContext, dirtyPages)});          // mov rbp, [rsi + dirtyPages]
+    e.Bytes({0x48, 0x8B, 0x06});                                            // mov rax, [rsi + registers]
+    for (int i = 0; i < 8; i++)
+    {
+        e.Bytes({0x44, 0x0F, 0xB7, u8(0x40 | (i << 3)), u8(i * 2)});        // movzx r(8+i)d, word [rax + 2i]
+    }
+    e.Bytes({0x0F, 0xB7, 0x5E, offsetof(JitContext, flagsResult)});         // movzx ebx, word [rsi + flagsResult]
+    const size_t bodyStart = e.code.size();
+
+    // Side exits of operations that touch a word at 0xFFFF, state as before the operation
+    struct WrapExit
+    {
+        std::vector<size_t> jumps;
+        u16 ip;
+        u32 steps;
+        int flagsWide;
+    };
+    std::vector<WrapExit> wrapExits;
+    auto collectWrapExits = [&](u16 opIp, u32 stepsBefore, int flagsWideBefore)
+    {
+        if (!e.wrapExits.empty())
+        {
+            wrapExits.push_back({std::move(e.wrapExits), opIp, stepsBefore, flagsWideBefore});
+            e.wrapExits.clear();
+        }
+    };
+
+    // Without any flag-setting operation, bx keeps what dispatcher put there (word encoded)
+    int flagsWide = 2;
+    for (u32 i = 0; i < block.size(); i++)
+    {
+        const auto& [opIp, op] = block[i];
+        const int flagsWideBefore = flagsWide;
+        if (op->type == Operation::Type::Operation)
+        {
+            if (int wide = JitEmitOperation(e, *op); wide != 0)
+            {
+                flagsWide = wide;
+            }
+        }
+        else if (op->type == Operation::Type::Stack && !IsBranch(*op))
+        {
+            JitEmitPushPop(e, *op);
+        }
+        collectWrapExits(opIp, i, flagsWideBefore);
+    }
+
+    const u32 steps = (u32)block.size();
+    if (!endsWithJump)
+    {
+        JitEmitExit(e, ip, steps, flagsWide);
+    }
+    else if (block.back().second->type == Operation::Type::Stack)
+    {
+        const auto& [callIp, op] = block.back();
+        if (op->opStackIndex == OpStack::call)
+        {
+            JitEmitCall(e, u16(callIp + op->operands[0].jump.value), ip, steps, flagsWide);
+        }
+        else
+        {
+            JitEmitRet(e, *op, steps, flagsWide);
+        }
+        collectWrapExits(callIp, steps - 1, flagsWide);
+    }
+    else
+    {
+        const Operation& jump = *block.back().second;
+        const u16 takenIp = u16(block.back().first + jump.operands[0].jump.value);
+        std::vector<size_t> notTaken;
+        if (jump.type == Operation::Type::Loop)
+        {
+            if (jump.opLoopIndex == OpLoop::jcxz)
+            {
+                e.Bytes({0x66, 0x45, 0x85, 0xC9});                          // test r9w, r9w
+                notTaken.push_back(e.Jcc32(JIT_NZ));
+            }
+            else
+            {
+                e.Bytes({0x66, 0x41, 0xFF, 0xC9});                          // dec r9w
+                notTaken.push_back(e.Jcc32(JIT_Z));
+                if (jump.opLoopIndex != OpLoop::loop)
+                {
+                    JitEmitTestFlags(e, flagsWide);
+                    notTaken.push_back(e.Jcc32(jump.opLoopIndex == OpLoop::loopz ? JIT_NZ : JIT_Z));
+                }
+            }
+        }
+        else
+        {
+            JitEmitTestFlags(e, flagsWide);
+            switch (jump.opJumpIndex)
+            {
+            case OpJump::je:    notTaken.push_back(e.Jcc32(JIT_NZ)); break;
+            case OpJump::jne:   notTaken.push_back(e.Jcc32(JIT_Z));  break;
+            case OpJump::js:    notTaken.push_back(e.Jcc32(JIT_NS)); break;
+            default:            notTaken.push_back(e.Jcc32(JIT_S));  break;
+            }
+        }
+
+        if (takenIp == startIp)
+        {
+            // Tight loop stays in compiled code
+            JitEmitAddSteps(e, steps);
+            e.Jmp32(bodyStart);
+        }
+        else
+        {
+            JitEmitExit(e, takenIp, steps, flagsWide);
+        }
+        for (size_t position : notTaken)
+        {
+            e.PatchHere(position);
+        }
+        JitEmitExit(e, ip, steps, flagsWide);
+    }
+
+    for (const WrapExit& wrapExit : wrapExits)
+    {
+        for (size_t position : wrapExit.jumps)
+        {
+            e.PatchHere(position);
+        }
+        e.Bytes({0xC6, 0x46, offsetof(JitContext, wrapExit), 0x01});        // mov byte [rsi + wrapExit], 1
+        JitEmitExit(e, wrapExit.ip, wrapExit.steps, wrapExit.flagsWide);
+    }
+
+    u8* code = static_cast<u8*>(JitAllocate(e.code));
+    if (code)
+    {
+        jitBodies[startIp] = code + bodyStart;
+    }
+    return reinterpret_cast<JitBlockFn>(code);
+}
+
+// Runs compiled block at ipReg, syncing lazy flags with flags[] around it
+void JitRunBlock(JitBlockFn block)
+{
+    JitContext& context = jitContext;
+    context.steps = 0;
+    context.wrapExit = 0;
+    context.bodies = jitBodies.data();
+    context.registers = registersMem;
+    context.memory = mainMemory;
+    context.dirtyPages = dirtyMemoryPages;
+    context.flagsResult = flags[Flag::FLAG_ZERO] ? 0 : flags[Flag::FLAG_SIGNED] ? 0x8000 : 1;
+
+    block(&context);
+
+    ipReg = (s16)context.nextIp;
+    executedSteps += context.steps;
+    const u16 result = context.flagsWide == 1 ? u8(context.flagsResult) : context.flagsResult;
+    flags[Flag::FLAG_ZERO] = result == 0;
+    flags[Flag::FLAG_SIGNED] = context.flagsWide == 1 ? (result & 0x80) : (result & 0x8000);
+}
+
+void RunInterpreter(const std::unordered_map<int, Operation>& operations)
+{
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend())
+    {
+        ExecuteStepFast(operationIt->second);
+        if (devicesEnabled)
+        {
+            AdvanceDevices(operationIt->second);
+        }
+        operationIt = operations.find(ipReg);
+    }
+}
+
+void RunWithJit(const std::unordered_map<int, Operation>& operations)
+{
+    while (true)
+    {
+        const u16 ip = (u16)ipReg;
+        if (JitBlockFn block = jitBlocks[ip])
+        {
+            JitRunBlock(block);
+            if (jitContext.wrapExit)
+            {
+                auto operationIt = operations.find(ipReg);
+                if (operationIt == operations.cend())
+                {
+                    break;
+                }
+                ExecuteStepFast(operationIt->second);
+            }
+            continue;
+        }
+        if (JIT_AVAILABLE && jitHotness[ip] != u16_max && ++jitHotness[ip] >= jitHotThreshold)
+        {
+            jitBlocks[ip] = JitCompileBlock(ip, operations);
+            if (!jitBlocks[ip])
+            {
+                jitHotness[ip] = u16_max;
+            }
+            continue;
+        }
+
+        auto operationIt = operations.find(ipReg);
+        if (operationIt == operations.cend())
+        {
+            break;
+        }
+        ExecuteStepFast(operationIt->second);
+    }
+}
+
+// Runs program with interpreter and with JIT from the same initial state and compares the results.
+// Leaves machine in the state produced by the JIT run
+bool VerifyJit(const std::unordered_map<int, Operation>& operations)
+{
+    const MachineSnapshot initial = TakeSnapshot();
+    const u64 initialSteps = executedSteps;
+
+    RunInterpreter(operations);
+    const MachineSnapshot interpreted = TakeSnapshot();
+    const u64 interpretedSteps = executedSteps;
+
+    RestoreSnapshot(initial);
+    executedSteps = initialSteps;
+    RunWithJit(operations);
+
+    bool matches = MatchesSnapshot(interpreted, "JIT");
+    if (executedSteps != interpretedSteps)
+    {
+        std::cout << "\nJIT mismatch: steps " << interpretedSteps << " != " << executedSteps;
+        matches = false;
+    }
+    std::cout << (matches ? "\nJIT matches interpreter" : "") << " (" << executedSteps - initialSteps << " steps)";
+    return matches;
+}
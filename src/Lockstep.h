@@ -0,0 +1,607 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Helpers.h"
+#include "CpuOperations.h"
+#include "CpuSnapshot.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+#include "Jit.h"
+#include "MachineState.h"
+
+// Lockstep sweeps run one program on many machines (lanes) that differ only in initial
+// registers and memory. Lane state is kept as structure of arrays: one array per register,
+// per flag and for ip, so a single decoded instruction is applied to a whole vector of lanes.
+// Lanes that aren't at the instruction are masked out. Every step runs the lowest ip any lane
+// waits at, so lanes that took different branches meet again where their paths join.
+//
+// Word register mov/add/sub/cmp, jumps and loops are vectorized. Byte registers and memory
+// operands go lane by lane, each lane has its own copy-on-write pages over the initial memory.
+// Programs with other operations run every lane on the interpreter one after another.
+// Vectors are 16 lanes when built with -mavx2. The default build has no such flag and uses
+// 8 SSE2 lanes.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+using LaneVector = __m256i;
+constexpr int laneVectorWidth = 16;
+LaneVector LaneLoad(const u16* p)                       { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+void LaneStore(u16* p, LaneVector v)                    { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+LaneVector LaneSet(u16 value)                           { return _mm256_set1_epi16(s16(value)); }
+LaneVector LaneAdd(LaneVector a, LaneVector b)          { return _mm256_add_epi16(a, b); }
+LaneVector LaneSub(LaneVector a, LaneVector b)          { return _mm256_sub_epi16(a, b); }
+LaneVector LaneAnd(LaneVector a, LaneVector b)          { return _mm256_and_si256(a, b); }
+LaneVector LaneOr(LaneVector a, LaneVector b)           { return _mm256_or_si256(a, b); }
+LaneVector LaneAndNot(LaneVector mask, LaneVector a)    { return _mm256_andnot_si256(mask, a); }
+LaneVector LaneEqual(LaneVector a, LaneVector b)        { return _mm256_cmpeq_epi16(a, b); }
+LaneVector LaneSignMask(LaneVector a)                   { return _mm256_srai_epi16(a, 15); }
+LaneVector LaneMin(LaneVector a, LaneVector b)          { return _mm256_min_epu16(a, b); }
+int LaneCount(LaneVector mask)                          { return __builtin_popcount(_mm256_movemask_epi8(mask)) / 2; }
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+using LaneVector = __m128i;
+constexpr int laneVectorWidth = 8;
+LaneVector LaneLoad(const u16* p)                       { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+void LaneStore(u16* p, LaneVector v)                    { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+LaneVector LaneSet(u16 value)                           { return _mm_set1_epi16(s16(value)); }
+LaneVector LaneAdd(LaneVector a, LaneVector b)          { return _mm_add_epi16(a, b); }
+LaneVector LaneSub(LaneVector a, LaneVector b)          { return _mm_sub_epi16(a, b); }
+LaneVector LaneAnd(LaneVector a, LaneVector b)          { return _mm_and_si128(a, b); }
+LaneVector LaneOr(LaneVector a, LaneVector b)           { return _mm_or_si128(a, b); }
+LaneVector LaneAndNot(LaneVector mask, LaneVector a)    { return _mm_andnot_si128(mask, a); }
+LaneVector LaneEqual(LaneVector a, LaneVector b)        { return _mm_cmpeq_epi16(a, b); }
+LaneVector LaneSignMask(LaneVector a)                   { return _mm_srai_epi16(a, 15); }
+// SSE2 only has signed 16-bit min, flipping the top bit turns it into unsigned
+LaneVector LaneMin(LaneVector a, LaneVector b)
+{
+    const LaneVector flip = _mm_set1_epi16(s16(0x8000));
+    return _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, flip), _mm_xor_si128(b, flip)), flip);
+}
+int LaneCount(LaneVector mask)                          { return __builtin_popcount(_mm_movemask_epi8(mask)) / 2; }
+#else
+// Plain arrays, the compiler is left to vectorize the loops
+struct LaneVector { u16 v[8]; };
+constexpr int laneVectorWidth = 8;
+template<typename Fn>
+LaneVector LaneMap(LaneVector a, LaneVector b, Fn fn)
+{
+    LaneVector r;
+    for (int i = 0; i < laneVectorWidth; i++) r.v[i] = fn(a.v[i], b.v[i]);
+    return r;
+}
+LaneVector LaneLoad(const u16* p)                       { LaneVector r; std::copy(p, p + laneVectorWidth, r.v); return r; }
+void LaneStore(u16* p, LaneVector v)                    { std::copy(v.v, v.v + laneVectorWidth, p); }
+LaneVector LaneSet(u16 value)                           { LaneVector r; std::fill(r.v, r.v + laneVectorWidth, value); return r; }
+LaneVector LaneAdd(LaneVector a, LaneVector b)          { return LaneMap(a, b, [](u16 x, u16 y) { return u16(x + y); }); }
+LaneVector LaneSub(LaneVector a, LaneVector b)          { return LaneMap(a, b, [](u16 x, u16 y) { return u16(x - y); }); }
+LaneVector LaneAnd(LaneVector a, LaneVector b)          { return LaneMap(a, b, [](u16 x, u16 y) { return u16(x & y); }); }
+LaneVector LaneOr(LaneVector a, LaneVector b)           { return LaneMap(a, b, [](u16 x, u16 y) { return u16(x | y); }); }
+LaneVector LaneAndNot(LaneVector mask, LaneVector a)    { return LaneMap(mask, a, [](u16 x, u16 y) { return u16(~x & y); }); }
+LaneVector LaneEqual(LaneVector a, LaneVector b)        { return LaneMap(a, b, [](u16 x, u16 y) { return u16(x == y ? 0xFFFF : 0); }); }
+LaneVector LaneSignMask(LaneVector a)                   { return LaneMap(a, a, [](u16 x, u16) { return u16(x & 0x8000 ? 0xFFFF : 0); }); }
+LaneVector LaneMin(LaneVector a, LaneVector b)          { return LaneMap(a, b, [](u16 x, u16 y) { return std::min(x, y); }); }
+int LaneCount(LaneVector mask)                          { return int(std::count(mask.v, mask.v + laneVectorWidth, u16(0xFFFF))); }
+#endif
+
+// Takes b where mask is set
+LaneVector LaneBlend(LaneVector a, LaneVector b, LaneVector mask)
+{
+    return LaneOr(LaneAndNot(mask, a), LaneAnd(mask, b));
+}
+
+LaneVector LaneNot(LaneVector a)
+{
+    return LaneAndNot(a, LaneSet(0xFFFF));
+}
+
+constexpr u16 finishedLaneIp = 0xFFFF;
+
+// Initial values of one lane, registers are reused from register breakpoint conditions
+struct SweepLane
+{
+    std::vector<RegisterCondition> registers;
+    std::vector<std::pair<u16, u16>> words;     // address, value
+};
+
+struct LockstepMachine
+{
+    size_t lanes = 0;
+    size_t capacity = 0;                        // lanes rounded up to whole vectors
+    std::vector<u16> registers;                 // slot * capacity + lane
+    std::vector<u16> zero;                      // 0xFFFF when set
+    std::vector<u16> sign;
+    std::vector<u16> ips;                       // finishedLaneIp once the lane left the program
+    std::vector<u16> finalIps;
+    std::shared_ptr<const MemoryPage> basePages[memoryPageCount];
+    std::vector<std::unique_ptr<MemoryPage>> lanePages;    // lane * memoryPageCount + page, empty until written
+    std::vector<const Operation*> operationAt;  // by ip
+    size_t running = 0;
+    u64 issuedSteps = 0;
+    u64 laneSteps = 0;
+
+    u16* Register(int slot) { return &registers[slot * capacity]; }
+};
+
+struct LaneStepResult
+{
+    int active = 0;
+    int taken = 0;
+};
+
+u8 LaneReadByte(const LockstepMachine& machine, size_t lane, u16 address)
+{
+    const MemoryPage* page = machine.lanePages[lane * memoryPageCount + address / memoryPageSize].get();
+    return page ? (*page)[address % memoryPageSize] : (*machine.basePages[address / memoryPageSize])[address % memoryPageSize];
+}
+
+void LaneWriteByte(LockstepMachine& machine, size_t lane, u16 address, u8 data)
+{
+    std::unique_ptr<MemoryPage>& page = machine.lanePages[lane * memoryPageCount + address / memoryPageSize];
+    if (!page)
+    {
+        page = std::make_unique<MemoryPage>(*machine.basePages[address / memoryPageSize]);
+    }
+    (*page)[address % memoryPageSize] = data;
+}
+
+// One lane of the machine as a state accessor of MachineState.h
+struct LaneState
+{
+    LockstepMachine& machine;
+    size_t lane;
+
+    u16& Slot(int slot) { return machine.Register(slot)[lane]; }
+
+    u16 ReadMemory(u16 address, bool wide) const
+    {
+        const u16 low = LaneReadByte(machine, lane, address);
+        return wide ? u16(low | (LaneReadByte(machine, lane, u16(address + 1)) << 8)) : low;
+    }
+
+    void WriteMemory(u16 address, bool wide, u16 value)
+    {
+        LaneWriteByte(machine, lane, address, u8(value));
+        if (wide)
+        {
+            LaneWriteByte(machine, lane, u16(address + 1), u8(value >> 8));
+        }
+    }
+
+    void SetFlags(bool zero, bool sign)
+    {
+        machine.zero[lane] = zero ? 0xFFFF : 0;
+        machine.sign[lane] = sign ? 0xFFFF : 0;
+    }
+};
+
+// mov/add/sub/cmp with any operands, one lane at a time
+LaneStepResult LaneStepScalar(LockstepMachine& machine, const Operation& op, u16 ip)
+{
+    LaneStepResult result{};
+    for (size_t lane = 0; lane < machine.lanes; lane++)
+    {
+        if (machine.ips[lane] != ip)
+        {
+            continue;
+        }
+        result.active++;
+        LaneState state{machine, lane};
+        ExecuteArithmetic(state, op);
+        machine.ips[lane] = u16(ip + op.size + 1);
+    }
+    return result;
+}
+
+bool IsLaneVectorOperation(const Operation& op)
+{
+    return op.type == Operation::Type::Operation
+        && op.operands[0].type == Operand::Type::Register && !IsByteRegister(op.operands[0].reg)
+        && (op.operands[1].type == Operand::Type::Immediate
+            || (op.operands[1].type == Operand::Type::Register && !IsByteRegister(op.operands[1].reg)));
+}
+
+// Word register mov/add/sub/cmp over whole vectors of lanes
+LaneStepResult LaneStepVector(LockstepMachine& machine, const Operation& op, u16 ip)
+{
+    u16* dst = machine.Register(GetRegisterSlot(op.operands[0].reg));
+    const bool immediate = op.operands[1].type == Operand::Type::Immediate;
+    const u16* src = immediate ? nullptr : machine.Register(GetRegisterSlot(op.operands[1].reg));
+    const LaneVector current = LaneSet(ip);
+    const LaneVector next = LaneSet(u16(ip + op.size + 1));
+    const LaneVector immediateValue = LaneSet(u16(op.operands[1].immVal.value));
+    const LaneVector zeroValue = LaneSet(0);
+
+    LaneStepResult result{};
+    for (size_t i = 0; i < machine.capacity; i += laneVectorWidth)
+    {
+        const LaneVector ips = LaneLoad(&machine.ips[i]);
+        const LaneVector mask = LaneEqual(ips, current);
+        const int active = LaneCount(mask);
+        if (active == 0)
+        {
+            continue;
+        }
+        result.active += active;
+
+        const LaneVector a = LaneLoad(dst + i);
+        const LaneVector b = immediate ? immediateValue : LaneLoad(src + i);
+        const LaneVector value = op.opIndex == OpIndex::MOV ? b
+                               : op.opIndex == OpIndex::ADD ? LaneAdd(a, b)
+                               : LaneSub(a, b);
+        if (op.opIndex != OpIndex::CMP)
+        {
+            LaneStore(dst + i, LaneBlend(a, value, mask));
+        }
+        if (op.opIndex != OpIndex::MOV)
+        {
+            LaneStore(&machine.zero[i], LaneBlend(LaneLoad(&machine.zero[i]), LaneEqual(value, zeroValue), mask));
+            LaneStore(&machine.sign[i], LaneBlend(LaneLoad(&machine.sign[i]), LaneSignMask(value), mask));
+        }
+        LaneStore(&machine.ips[i], LaneBlend(ips, next, mask));
+    }
+    return result;
+}
+
+// Same conditions as IsJumpConditionMet and IsLoopConditionMet, cx is already decremented
+LaneVector LaneCondition(const Operation& op, LaneVector zero, LaneVector sign, LaneVector cx)
+{
+    const LaneVector all = LaneSet(0xFFFF);
+    const LaneVector none = LaneSet(0);
+    if (op.type == Operation::Type::Loop)
+    {
+        const LaneVector cxZero = LaneEqual(cx, none);
+        switch (op.opLoopIndex)
+        {
+        case OpLoop::loopnz:    return LaneAndNot(cxZero, LaneNot(zero));
+        case OpLoop::loopz:     return LaneAndNot(cxZero, zero);
+        case OpLoop::jcxz:      return cxZero;
+        default:                return LaneNot(cxZero);
+        }
+    }
+    switch (op.opJumpIndex)
+    {
+    case OpJump::je:    return zero;
+    case OpJump::jne:   return LaneNot(zero);
+    case OpJump::js:    return sign;
+    case OpJump::jns:   return LaneNot(sign);
+    case OpJump::jl:    return sign;
+    case OpJump::jnl:   return LaneNot(sign);
+    case OpJump::jle:   return LaneOr(zero, sign);
+    case OpJump::jnle:  return LaneNot(LaneOr(zero, sign));
+    case OpJump::jbe:   return zero;
+    case OpJump::ja:    return LaneNot(zero);
+    case OpJump::jo:
+    case OpJump::jb:
+    case OpJump::jp:    return none;
+    default:            return all;
+    }
+}
+
+LaneStepResult LaneStepBranch(LockstepMachine& machine, const Operation& op, u16 ip)
+{
+    u16* cx = machine.Register(GetRegisterSlot(RegisterIndex::cx));
+    const bool decrementsCx = op.type == Operation::Type::Loop && op.opLoopIndex != OpLoop::jcxz;
+    const LaneVector current = LaneSet(ip);
+    const LaneVector fallthrough = LaneSet(u16(ip + op.size + 1));
+    const LaneVector target = LaneSet(u16(ip + op.operands[0].jump.value));
+    const LaneVector one = LaneSet(1);
+
+    LaneStepResult result{};
+    for (size_t i = 0; i < machine.capacity; i += laneVectorWidth)
+    {
+        const LaneVector ips = LaneLoad(&machine.ips[i]);
+        const LaneVector mask = LaneEqual(ips, current);
+        const int active = LaneCount(mask);
+        if (active == 0)
+        {
+            continue;
+        }
+        result.active += active;
+
+        LaneVector counter = LaneLoad(cx + i);
+        if (decrementsCx)
+        {
+            counter = LaneBlend(counter, LaneSub(counter, one), mask);
+            LaneStore(cx + i, counter);
+        }
+        const LaneVector taken = LaneAnd(mask, LaneCondition(op, LaneLoad(&machine.zero[i]), LaneLoad(&machine.sign[i]), counter));
+        result.taken += LaneCount(taken);
+        LaneStore(&machine.ips[i], LaneBlend(LaneBlend(ips, fallthrough, mask), target, taken));
+    }
+    return result;
+}
+
+u16 LowestLaneIp(const LockstepMachine& machine)
+{
+    LaneVector lowest = LaneSet(finishedLaneIp);
+    for (size_t i = 0; i < machine.capacity; i += laneVectorWidth)
+    {
+        lowest = LaneMin(lowest, LaneLoad(&machine.ips[i]));
+    }
+    u16 lanes[laneVectorWidth];
+    LaneStore(lanes, lowest);
+    return *std::min_element(lanes, lanes + laneVectorWidth);
+}
+
+// Lanes that moved to ip without an operation are done
+void FinishLanesAt(LockstepMachine& machine, u16 ip)
+{
+    if (machine.operationAt[ip])
+    {
+        return;
+    }
+    for (size_t lane = 0; lane < machine.lanes; lane++)
+    {
+        if (machine.ips[lane] == ip)
+        {
+            machine.finalIps[lane] = ip;
+            machine.ips[lane] = finishedLaneIp;
+            machine.running--;
+        }
+    }
+}
+
+bool LockstepSupports(const std::unordered_map<int, Operation>& operations)
+{
+    return std::all_of(operations.begin(), operations.end(), [](const auto& entry) {
+        const Operation::Type type = entry.second.type;
+        return type == Operation::Type::Operation || type == Operation::Type::Jump || type == Operation::Type::Loop;
+    });
+}
+
+void SetupLockstepMachine(LockstepMachine& machine, const std::vector<SweepLane>& lanes,
+    const std::unordered_map<int, Operation>& operations, const MachineSnapshot& initial)
+{
+    machine.lanes = lanes.size();
+    machine.capacity = (lanes.size() + laneVectorWidth - 1) / laneVectorWidth * laneVectorWidth;
+    machine.registers.assign(8 * machine.capacity, 0);
+    machine.zero.assign(machine.capacity, 0);
+    machine.sign.assign(machine.capacity, 0);
+    machine.ips.assign(machine.capacity, finishedLaneIp);
+    machine.finalIps.assign(machine.capacity, 0);
+    machine.lanePages.clear();
+    machine.lanePages.resize(machine.lanes * memoryPageCount);
+    std::copy(std::begin(initial.pages), std::end(initial.pages), machine.basePages);
+    machine.operationAt.assign(mainMemoryLimit, nullptr);
+    for (const auto& [ip, op] : operations)
+    {
+        machine.operationAt[ip] = &op;
+    }
+
+    for (size_t lane = 0; lane < lanes.size(); lane++)
+    {
+        for (int slot = 0; slot < 8; slot++)
+        {
+            machine.Register(slot)[lane] = initial.registers[slot];
+        }
+        machine.zero[lane] = initial.flags[Flag::FLAG_ZERO] ? 0xFFFF : 0;
+        machine.sign[lane] = initial.flags[Flag::FLAG_SIGNED] ? 0xFFFF : 0;
+        LaneState state{machine, lane};
+        for (const RegisterCondition& reg : lanes[lane].registers)
+        {
+            WriteRegister(state, reg.reg, reg.value);
+        }
+        for (const auto& [address, value] : lanes[lane].words)
+        {
+            state.WriteMemory(address, true, value);
+        }
+        machine.ips[lane] = u16(initial.ip);
+        machine.finalIps[lane] = u16(initial.ip);
+    }
+    machine.running = machine.lanes;
+    machine.issuedSteps = 0;
+    machine.laneSteps = 0;
+    FinishLanesAt(machine, u16(initial.ip));
+}
+
+// While all running lanes sit at one ip the next one is known without scanning lanes
+void RunLockstep(LockstepMachine& machine)
+{
+    bool converged = true;
+    u16 ip = machine.running != 0 ? machine.ips[0] : 0;
+    while (machine.running != 0)
+    {
+        if (!converged)
+        {
+            ip = LowestLaneIp(machine);
+        }
+        const Operation& op = *machine.operationAt[ip];
+        const bool branch = op.type != Operation::Type::Operation;
+        const LaneStepResult result = branch ? LaneStepBranch(machine, op, ip)
+                                    : IsLaneVectorOperation(op) ? LaneStepVector(machine, op, ip)
+                                    : LaneStepScalar(machine, op, ip);
+        machine.issuedSteps++;
+        machine.laneSteps += result.active;
+
+        const u16 fallthrough = u16(ip + op.size + 1);
+        const u16 target = branch ? u16(ip + op.operands[0].jump.value) : fallthrough;
+        const bool allLanesHere = size_t(result.active) == machine.running;
+        FinishLanesAt(machine, fallthrough);
+        if (target != fallthrough)
+        {
+            FinishLanesAt(machine, target);
+        }
+
+        converged = allLanesHere && (result.taken == 0 || result.taken == result.active);
+        ip = result.taken == 0 ? fallthrough : target;
+    }
+}
+
+// Loads lane into the interpreter machine
+void RestoreLane(const MachineSnapshot& initial, const SweepLane& lane)
+{
+    RestoreSnapshot(initial);
+    for (const RegisterCondition& reg : lane.registers)
+    {
+        if (IsByteRegister(reg.reg))
+        {
+            *GetByteRegisterMem(reg.reg) = u8(reg.value);
+        }
+        else
+        {
+            *GetRegisterMem(reg.reg) = reg.value;
+        }
+    }
+    for (const auto& [address, value] : lane.words)
+    {
+        mainMemory[address] = u8(value);
+        mainMemory[u16(address + 1)] = u8(value >> 8);
+        MarkMemoryWritten(address, true);
+    }
+}
+
+// One lane per line: "cx=10 bx=0x200 [0x1000]=5", memory values are words.
+// False with the offending line reported when a field isn't a known register or memory word
+bool ParseSweepFile(const char* path, std::vector<SweepLane>& lanes)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "!!! Can't open sweep file " << path << " !!!\n";
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        std::istringstream fields(line);
+        std::string field;
+        SweepLane lane{};
+        bool any = false;
+        while (fields >> field && field[0] != '#')
+        {
+            const auto separator = field.find('=');
+            bool valid = separator != std::string::npos;
+            if (valid && field[0] == '[')
+            {
+                long address = 0;
+                long value = 0;
+                valid = separator >= 2 && field[separator - 1] == ']'
+                    && ParseInteger(field.substr(1, separator - 2), address) && address >= 0 && address <= 0xFFFF
+                    && ParseInteger(field.substr(separator + 1), value) && value >= -0x8000 && value <= 0xFFFF;
+                if (valid)
+                {
+                    lane.words.emplace_back(u16(address), u16(value));
+                }
+            }
+            else if (valid)
+            {
+                RegisterCondition condition{};
+                valid = ParseRegisterCondition(field, condition);
+                lane.registers.push_back(condition);
+            }
+            if (!valid)
+            {
+                std::cerr << "!!! " << path << ":" << lineNumber << ": bad field " << field << ", expected reg=value or [address]=value !!!\n";
+                return false;
+            }
+            any = true;
+        }
+        if (any)
+        {
+            lanes.push_back(std::move(lane));
+        }
+    }
+    return true;
+}
+
+void PrintLane(size_t index, const u16* registers, bool zero, bool sign, u16 ip)
+{
+    std::cout << "lane " << index << ":";
+    for (int slot = 0; slot < 8; slot++)
+    {
+        std::cout << " " << registerNames[registersMap[slot][1]] << "=" << HexString(registers[slot]);
+    }
+    std::cout << " ip=" << HexString(ip) << " flags=" << (zero ? "Z" : "") << (sign ? "S" : "") << '\n';
+}
+
+// Runs sweep in lockstep, with compare also runs every lane on the interpreter,
+// checks that the results match and reports both times. False when a lane differs
+bool RunSweep(const std::unordered_map<int, Operation>& operations, const std::vector<SweepLane>& lanes, bool compare)
+{
+    SetUndoRingSize(0);
+    const MachineSnapshot initial = TakeSnapshot();
+    const bool lockstep = LockstepSupports(operations);
+    std::cout << "Sweep: " << lanes.size() << " lanes, " << laneVectorWidth << " per vector"
+        << (lockstep ? "" : ", program isn't supported in lockstep, lanes run one by one") << '\n';
+
+    LockstepMachine machine{};
+    double lockstepSeconds = 0.0;
+    if (lockstep)
+    {
+        SetupLockstepMachine(machine, lanes, operations, initial);
+        const auto start = std::chrono::steady_clock::now();
+        RunLockstep(machine);
+        lockstepSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (size_t lane = 0; lane < machine.lanes; lane++)
+        {
+            u16 registers[8];
+            for (int slot = 0; slot < 8; slot++)
+            {
+                registers[slot] = machine.Register(slot)[lane];
+            }
+            PrintLane(lane, registers, machine.zero[lane], machine.sign[lane], machine.finalIps[lane]);
+        }
+    }
+    if (lockstep && !compare)
+    {
+        std::cout << "Lockstep: " << machine.issuedSteps << " issued, " << machine.laneSteps << " lane steps in "
+            << lockstepSeconds << " s\n";
+        return true;
+    }
+
+    u64 interpretedSteps = 0;
+    size_t mismatches = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t lane = 0; lane < lanes.size(); lane++)
+    {
+        RestoreLane(initial, lanes[lane]);
+        executedSteps = 0;
+        RunInterpreter(operations);
+        interpretedSteps += executedSteps;
+        if (!lockstep)
+        {
+            PrintLane(lane, registersMem, flags[Flag::FLAG_ZERO], flags[Flag::FLAG_SIGNED], u16(ipReg));
+            continue;
+        }
+
+        bool matches = u16(ipReg) == machine.finalIps[lane]
+            && flags[Flag::FLAG_ZERO] == (machine.zero[lane] != 0) && flags[Flag::FLAG_SIGNED] == (machine.sign[lane] != 0);
+        for (int slot = 0; slot < 8; slot++)
+        {
+            matches = matches && registersMem[slot] == machine.Register(slot)[lane];
+        }
+        for (unsigned int page = 0; page < memoryPageCount && matches; page++)
+        {
+            const MemoryPage* lanePage = machine.lanePages[lane * memoryPageCount + page].get();
+            const MemoryPage& expected = lanePage ? *lanePage : *machine.basePages[page];
+            matches = std::equal(expected.begin(), expected.end(), &mainMemory[page * memoryPageSize]);
+        }
+        if (!matches)
+        {
+            std::cout << "Lockstep mismatch in lane " << lane << '\n';
+            mismatches++;
+        }
+    }
+    const double interpretedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Interpreter: " << interpretedSteps << " steps in " << interpretedSeconds << " s\n";
+    if (lockstep)
+    {
+        std::cout << "Lockstep: " << machine.issuedSteps << " issued, " << machine.laneSteps << " lane steps in " << lockstepSeconds
+            << " s, " << interpretedSeconds / std::max(lockstepSeconds, 1e-9) << "x, "
+            << (mismatches == 0 ? "all lanes match" : std::to_string(mismatches) + " lanes differ") << '\n';
+    }
+    return mismatches == 0;
+}
@@ -0,0 +1,319 @@
+#pragma once
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "ControlFlowGraph.h"
+#include "CpuSnapshot.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+#include "Framebuffer.h"
+#include "MemoryAnalyzer.h"
+#include "Fusion.h"
+
+// Fast-forwarding of counted loops. A block that jumps back to its own start with jne or loop
+// qualifies when every register it changes is only added to or subtracted from by an immediate
+// or by a register the loop doesn't change, and memory is only written by mov and never read.
+// The exit compare may read registers the loop changes, its difference moves by their stride difference.
+// Then register values, store addresses and stored data are all affine in the iteration number,
+// the trip count follows from the exit compare and all iterations are applied at once.
+// Other loops, and any loop while breakpoints or memory analyzer are on, are stepped as usual.
+
+struct LoopStore
+{
+    u16 address = 0;
+    u16 addressStride = 0;
+    u16 value = 0;
+    u16 valueStride = 0;
+    u8 valueShift = 0;          // 8 for high byte registers
+    bool wide = false;
+};
+
+u64 fastForwardedLoops = 0;
+u64 fastForwardedIterations = 0;
+
+bool IsWordRegisterOperand(const Operand& operand)
+{
+    return operand.type == Operand::Type::Register && !IsByteRegister(operand.reg);
+}
+
+// Applies all remaining iterations of the loop at block start, false if the loop doesn't qualify
+bool FastForwardLoop(const BasicBlock& block, const std::unordered_map<int, Operation>& operations, u64& cycles)
+{
+    const Operation& exit = operations.at(block.operationIps.back());
+    const bool isLoopInstruction = exit.type == Operation::Type::Loop && exit.opLoopIndex == OpLoop::loop;
+    if (!isLoopInstruction && !(exit.type == Operation::Type::Jump && exit.opJumpIndex == OpJump::jne))
+    {
+        return false;
+    }
+
+    // Per iteration change of every register slot
+    bool changed[8] = {};
+    u16 stride[8] = {};
+    for (size_t i = 0; i + 1 < block.operationIps.size(); i++)
+    {
+        const Operation& op = operations.at(block.operationIps[i]);
+        if (op.type != Operation::Type::Operation || op.operands[1].type == Operand::Type::Memory)
+        {
+            return false;
+        }
+        if (op.opIndex == OpIndex::MOV)
+        {
+            if (op.operands[0].type != Operand::Type::Memory)
+            {
+                return false;
+            }
+        }
+        else if (!IsWordRegisterOperand(op.operands[0])
+            || (op.operands[1].type != Operand::Type::Immediate && !IsWordRegisterOperand(op.operands[1])))
+        {
+            return false;
+        }
+        else if (op.opIndex != OpIndex::CMP)
+        {
+            changed[GetRegisterSlot(op.operands[0].reg)] = true;
+        }
+    }
+    if (isLoopInstruction)
+    {
+        changed[GetRegisterSlot(RegisterIndex::cx)] = true;
+    }
+
+    const auto sourceValue = [&](const Operand& operand, u16& value) {
+        if (operand.type == Operand::Type::Immediate)
+        {
+            value = (u16)operand.immVal.value;
+            return true;
+        }
+        value = *GetRegisterMem(operand.reg);
+        return !changed[GetRegisterSlot(operand.reg)];
+    };
+
+    for (size_t i = 0; i + 1 < block.operationIps.size(); i++)
+    {
+        const Operation& op = operations.at(block.operationIps[i]);
+        if (op.opIndex != OpIndex::ADD && op.opIndex != OpIndex::SUB)
+        {
+            continue;
+        }
+        u16 data;
+        if (!sourceValue(op.operands[1], data))
+        {
+            return false;
+        }
+        u16& slotStride = stride[GetRegisterSlot(op.operands[0].reg)];
+        slotStride += op.opIndex == OpIndex::ADD ? data : u16(-data);
+    }
+    if (isLoopInstruction)
+    {
+        stride[GetRegisterSlot(RegisterIndex::cx)] -= 1;
+    }
+
+    // Walk one iteration from current registers, recording stores and the last flags result
+    u16 current[8];
+    std::copy(std::begin(registersMem), std::end(registersMem), current);
+    std::vector<LoopStore> stores;
+    bool hasFlagsResult = false;
+    u16 flagsResult = 0;
+    u16 flagsStride = 0;
+    u64 iterationCycles = 0;
+    for (size_t i = 0; i + 1 < block.operationIps.size(); i++)
+    {
+        const Operation& op = operations.at(block.operationIps[i]);
+        iterationCycles += CycleEstimation(op, staticStringRepetitions);
+        if (op.opIndex == OpIndex::MOV)
+        {
+            const MemoryExpr& mem = op.operands[0].mem;
+            LoopStore store{};
+            store.wide = mem.pointsToWord;
+            store.address = (u16)mem.disp;
+            for (RegisterIndex reg : mem.registers)
+            {
+                if (reg != RegisterIndex::None)
+                {
+                    store.address += current[GetRegisterSlot(reg)];
+                    store.addressStride += stride[GetRegisterSlot(reg)];
+                }
+            }
+            if (op.operands[1].type == Operand::Type::Immediate)
+            {
+                store.value = (u16)op.operands[1].immVal.value;
+            }
+            else
+            {
+                const int slot = GetRegisterSlot(op.operands[1].reg);
+                store.value = current[slot];
+                store.valueStride = stride[slot];
+                store.valueShift = IsByteRegister(op.operands[1].reg)
+                    && GetByteRegisterMem(op.operands[1].reg) == reinterpret_cast<u8*>(&registersMem[slot]) + 1 ? 8 : 0;
+            }
+            stores.push_back(store);
+            continue;
+        }
+
+        // Only cmp may read a register the loop changes, its result then moves by the difference of strides
+        const int slot = GetRegisterSlot(op.operands[0].reg);
+        const bool registerSource = op.operands[1].type == Operand::Type::Register;
+        const int sourceSlot = registerSource ? GetRegisterSlot(op.operands[1].reg) : -1;
+        const u16 data = registerSource ? current[sourceSlot] : (u16)op.operands[1].immVal.value;
+        const u16 sourceStride = registerSource && op.opIndex == OpIndex::CMP ? stride[sourceSlot] : 0;
+        const u16 result = op.opIndex == OpIndex::ADD ? u16(current[slot] + data) : u16(current[slot] - data);
+        if (op.opIndex != OpIndex::CMP)
+        {
+            current[slot] = result;
+        }
+        hasFlagsResult = true;
+        flagsResult = result;
+        flagsStride = op.opIndex == OpIndex::ADD ? u16(stride[slot] + sourceStride) : u16(stride[slot] - sourceStride);
+    }
+    iterationCycles += CycleEstimation(exit, staticStringRepetitions);
+
+    // Value whose zero ends the loop, taken at the exit of the first iteration
+    u16 exitValue = flagsResult;
+    u16 exitStride = flagsStride;
+    if (isLoopInstruction)
+    {
+        const int slot = GetRegisterSlot(RegisterIndex::cx);
+        exitValue = u16(current[slot] - 1);
+        exitStride = stride[slot];
+    }
+    else if (!hasFlagsResult)
+    {
+        return false;
+    }
+
+    const int lastIteration = SolveTripIndex(exitValue, exitStride);
+    if (lastIteration < 0)
+    {
+        return false;
+    }
+    const u64 iterations = u64(lastIteration) + 1;
+
+    for (u64 iteration = 0; iteration < iterations; iteration++)
+    {
+        for (const LoopStore& store : stores)
+        {
+            const u16 address = u16(store.address + iteration * store.addressStride);
+            const u16 value = u16(store.value + iteration * store.valueStride) >> store.valueShift;
+            mainMemory[address] = value & 0xFF;
+            if (store.wide)
+            {
+                mainMemory[u16(address + 1)] = value >> 8;
+            }
+            MarkMemoryWritten(address, store.wide);
+            if (framebufferEnabled)
+            {
+                MarkFramebufferWritten(address, store.wide);
+            }
+        }
+    }
+
+    for (int slot = 0; slot < 8; slot++)
+    {
+        registersMem[slot] = u16(registersMem[slot] + iterations * stride[slot]);
+    }
+    if (hasFlagsResult)
+    {
+        const u16 lastResult = u16(flagsResult + (iterations - 1) * flagsStride);
+        flags[Flag::FLAG_ZERO] = lastResult == 0;
+        flags[Flag::FLAG_SIGNED] = lastResult & 0x8000;
+    }
+    ipReg = s16(block.operationIps.back() + exit.size + 1);
+
+    executedSteps += iterations * block.operationIps.size();
+    cycles += iterations * iterationCycles;
+    fastForwardedLoops++;
+    fastForwardedIterations += iterations;
+    return true;
+}
+
+// Clocks of what ExecuteStepFast runs from op, fused sequences included
+u64 StepCycles(const std::unordered_map<int, Operation>& operations, int ip, const Operation& op)
+{
+    if (op.fused.count == 0 || breakpointsArmed)
+    {
+        return CycleEstimation(op, lastStringRepetitions);
+    }
+    u64 cycles = 0;
+    for (int i = 0; i <= op.fused.count; i++)
+    {
+        const Operation& fusedOp = operations.at(ip);
+        cycles += CycleEstimation(fusedOp, staticStringRepetitions);
+        ip += fusedOp.size + 1;
+    }
+    return cycles;
+}
+
+// Untraced run that fast-forwards qualifying loops, returns estimated clocks.
+// Fast-forwarded iterations don't record undo entries
+u64 RunWithLoopAcceleration(const std::unordered_map<int, Operation>& operations)
+{
+    const ControlFlowGraph cfg = BuildControlFlowGraph(operations, (u16)ipReg);
+    std::vector<bool> rejectedLoops(mainMemoryLimit);
+    u64 cycles = 0;
+
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend())
+    {
+        const BasicBlock* block = cfg.Find(ipReg);
+        if (block && block->taken == block->start && !rejectedLoops[block->start]
+            && undoRing.empty() && !breakpointsArmed && !memoryAnalyzerEnabled)
+        {
+            if (FastForwardLoop(*block, operations, cycles))
+            {
+                operationIt = operations.find(ipReg);
+                continue;
+            }
+            // Shape is static, and a loop whose exit can't be reached never leaves anyway
+            rejectedLoops[block->start] = true;
+        }
+
+        // After the step, string operations are estimated from their repetitions
+        ExecuteStepFast(operationIt->second);
+        cycles += StepCycles(operations, operationIt->first, operationIt->second);
+        operationIt = operations.find(ipReg);
+    }
+    return cycles;
+}
+
+// Runs program stepping every operation and again with loops fast-forwarded, from the same initial
+// state, and compares the machines, steps and clocks. Leaves machine in the fast-forwarded state
+bool VerifyLoopAcceleration(const std::unordered_map<int, Operation>& operations)
+{
+    const MachineSnapshot initial = TakeSnapshot();
+    const u64 initialSteps = executedSteps;
+
+    u64 steppedCycles = 0;
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend())
+    {
+        ExecuteStepFast(operationIt->second);
+        steppedCycles += StepCycles(operations, operationIt->first, operationIt->second);
+        operationIt = operations.find(ipReg);
+    }
+    const MachineSnapshot stepped = TakeSnapshot();
+    const u64 steppedSteps = executedSteps;
+
+    RestoreSnapshot(initial);
+    executedSteps = initialSteps;
+    const u64 cycles = RunWithLoopAcceleration(operations);
+
+    bool matches = MatchesSnapshot(stepped, "Fast-forward");
+    if (executedSteps != steppedSteps)
+    {
+        std::cout << "\nFast-forward mismatch: steps " << steppedSteps << " != " << executedSteps;
+        matches = false;
+    }
+    if (cycles != steppedCycles)
+    {
+        std::cout << "\nFast-forward mismatch: clocks " << steppedCycles << " != " << cycles;
+        matches = false;
+    }
+    std::cout << (matches ? "\nFast-forwarded loops match stepping" : "") << " (" << fastForwardedIterations
+        << " iterations in " << fastForwardedLoops << " loops, " << executedSteps - initialSteps << " steps)";
+    return matches;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <cassert>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "DecoderOperands.h"
+
+// mov/add/sub/cmp are written once for every machine that runs them. ArithmeticResult and
+// ArithmeticSign are the rules, ExecuteOp applies them to the globals between its trace, watch
+// and undo hooks and the kernels emitted by --emit-cpp apply them to their operand types.
+// Machines without hooks describe their state with an accessor and run ExecuteArithmetic:
+//     u16& Slot(int slot)                                  word register, slots as in registersMem
+//     u16 ReadMemory(u16 address, bool wide)
+//     void WriteMemory(u16 address, bool wide, u16 value)
+//     void SetFlags(bool zero, bool sign)
+// ConstexprMachine is its own accessor, Lockstep wraps one lane of its machine in LaneState.
+
+// Result of op on the previous destination value, mov passes data through unmasked
+constexpr u16 ArithmeticResult(OpIndex opIndex, u16 previous, u16 data, bool wide)
+{
+    const u16 mask = wide ? 0xFFFF : 0xFF;
+    switch (opIndex)
+    {
+    case OpIndex::MOV:  return data;
+    case OpIndex::ADD:  return u16((previous + data) & mask);
+    case OpIndex::SUB:
+    case OpIndex::CMP:  return u16((previous - data) & mask);
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+constexpr bool ArithmeticSign(u16 result, bool wide)
+{
+    return (result & (wide ? 0x8000 : 0x80)) != 0;
+}
+
+// Width of an operation is the width of its destination
+constexpr bool IsWideOperand(const Operand& operand)
+{
+    return operand.type == Operand::Type::Memory ? operand.mem.pointsToWord : !IsByteRegister(operand.reg);
+}
+
+template<typename State>
+constexpr u16 ReadRegister(State& state, RegisterIndex reg)
+{
+    const u16 word = state.Slot(GetRegisterSlot(reg));
+    return !IsByteRegister(reg) ? word : IsHighByteRegister(reg) ? u16(word >> 8) : u16(word & 0xFF);
+}
+
+template<typename State>
+constexpr void WriteRegister(State& state, RegisterIndex reg, u16 value)
+{
+    u16& word = state.Slot(GetRegisterSlot(reg));
+    word = !IsByteRegister(reg) ? value
+         : IsHighByteRegister(reg) ? u16((word & 0x00FF) | ((value & 0xFF) << 8))
+         : u16((word & 0xFF00) | (value & 0xFF));
+}
+
+template<typename State>
+constexpr u16 EffectiveAddress(State& state, const MemoryExpr& mem)
+{
+    u16 address = u16(mem.disp);
+    for (RegisterIndex reg : mem.registers)
+    {
+        if (reg != RegisterIndex::None)
+        {
+            address += state.Slot(GetRegisterSlot(reg));
+        }
+    }
+    return address;
+}
+
+template<typename State>
+constexpr u16 LoadOperand(State& state, const Operand& operand)
+{
+    switch (operand.type)
+    {
+    case Operand::Type::Register:   return ReadRegister(state, operand.reg);
+    case Operand::Type::Immediate:  return u16(operand.immVal.value);
+    case Operand::Type::Memory:     return state.ReadMemory(EffectiveAddress(state, operand.mem), operand.mem.pointsToWord);
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+template<typename State>
+constexpr void StoreOperand(State& state, const Operand& operand, u16 value)
+{
+    if (operand.type == Operand::Type::Memory)
+    {
+        state.WriteMemory(EffectiveAddress(state, operand.mem), operand.mem.pointsToWord, value);
+    }
+    else
+    {
+        WriteRegister(state, operand.reg, value);
+    }
+}
+
+template<typename State>
+constexpr void ExecuteArithmetic(State& state, const Operation& op)
+{
+    const Operand& destination = op.operands[0];
+    const bool wide = IsWideOperand(destination);
+    const u16 data = LoadOperand(state, op.operands[1]);
+    const u16 previous = op.opIndex == OpIndex::MOV ? 0 : LoadOperand(state, destination);
+    const u16 result = ArithmeticResult(op.opIndex, previous, data, wide);
+    if (op.opIndex != OpIndex::CMP)
+    {
+        StoreOperand(state, destination, result);
+    }
+    if (op.opIndex != OpIndex::MOV)
+    {
+        state.SetFlags(result == 0, ArithmeticSign(result, wide));
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Helpers.h"
+#include "Framebuffer.h"
+
+// Collects per-address access counters, strides between consecutive accesses
+// and word accesses at odd addresses. Per-address counters are allocated by EnableMemoryAnalyzer,
+// the per-ip unaligned counters are bounded by the program size. Counters are per thread,
+// a batch worker never has the analyzer enabled so it never pays for them
+
+constexpr int strideHistogramRange = 64; // strides outside [-range, range] share the edge buckets
+constexpr int unalignedWordPenalty = 4;  // extra clocks for each word transfer at an odd address
+
+thread_local bool memoryAnalyzerEnabled = false;
+thread_local std::vector<u32> memoryReadCounts;    // mainMemoryLimit entries once enabled
+thread_local std::vector<u32> memoryWriteCounts;
+thread_local u64 strideHistogram[strideHistogramRange * 2 + 3] = {};
+thread_local std::unordered_map<u16, u32> unalignedAccessesByIp;
+thread_local u64 memoryReadTransfers = 0;   // one per access, byte or word
+thread_local u64 memoryWriteTransfers = 0;
+thread_local int lastAccessAddress = -1;
+
+void RecordMemoryAccess(u16 address, bool wide, bool write)
+{
+    auto& counts = write ? memoryWriteCounts : memoryReadCounts;
+    (write ? memoryWriteTransfers : memoryReadTransfers)++;
+    counts[address]++;
+    if (wide)
+    {
+        counts[u16(address + 1)]++;
+        if (address & 1)
+        {
+            unalignedAccessesByIp[(u16)ipReg]++;
+        }
+    }
+
+    if (lastAccessAddress >= 0)
+    {
+        const int stride = std::clamp(address - lastAccessAddress, -strideHistogramRange - 1, strideHistogramRange + 1);
+        strideHistogram[stride + strideHistogramRange + 1]++;
+    }
+    lastAccessAddress = address;
+}
+
+void ResetMemoryAnalysis()
+{
+    std::fill(memoryReadCounts.begin(), memoryReadCounts.end(), 0);
+    std::fill(memoryWriteCounts.begin(), memoryWriteCounts.end(), 0);
+    std::memset(strideHistogram, 0, sizeof(strideHistogram));
+    unalignedAccessesByIp.clear();
+    memoryReadTransfers = memoryWriteTransfers = 0;
+    lastAccessAddress = -1;
+}
+
+// Allocates counters on first use and starts counting from zero
+void EnableMemoryAnalyzer()
+{
+    memoryReadCounts.resize(mainMemoryLimit);
+    memoryWriteCounts.resize(mainMemoryLimit);
+    ResetMemoryAnalysis();
+    memoryAnalyzerEnabled = true;
+}
+
+u64 UnalignedAccessCount()
+{
+    u64 total = 0;
+    for (const auto& [ip, count] : unalignedAccessesByIp)
+    {
+        total += count;
+    }
+    return total;
+}
+
+std::string StrideBucketStr(int bucket)
+{
+    const int stride = bucket - strideHistogramRange - 1;
+    if (stride < -strideHistogramRange) return "<" + std::to_string(-strideHistogramRange);
+    if (stride > strideHistogramRange)  return ">" + std::to_string(strideHistogramRange);
+    return std::to_string(stride);
+}
+
+void PrintMemoryAnalysis()
+{
+    std::vector<u16> hot;
+    for (unsigned int i = 0; i < mainMemoryLimit; i++)
+    {
+        if (memoryReadCounts[i] || memoryWriteCounts[i])
+            hot.push_back((u16)i);
+    }
+    const auto total = [](u16 a) { return (u64)memoryReadCounts[a] + memoryWriteCounts[a]; };
+    const size_t hotCount = std::min<size_t>(hot.size(), 10);
+    std::partial_sort(hot.begin(), hot.begin() + hotCount, hot.end(), [&](u16 a, u16 b) { return total(a) > total(b); });
+
+    std::cout << "\nMemory accesses: " << hot.size() << " addresses touched";
+    for (size_t i = 0; i < hotCount; i++)
+    {
+        std::cout << "\n\t" << HexString(hot[i]) << " reads: " << memoryReadCounts[hot[i]] << " writes: " << memoryWriteCounts[hot[i]];
+    }
+
+    std::cout << "\nStrides:";
+    for (int bucket = 0; bucket < (int)std::size(strideHistogram); bucket++)
+    {
+        if (strideHistogram[bucket])
+            std::cout << "\n\t" << StrideBucketStr(bucket) << ": " << strideHistogram[bucket];
+    }
+
+    u64 unalignedTotal = 0;
+    std::cout << "\nUnaligned word accesses:";
+    for (const auto& [ip, count] : unalignedAccessesByIp)
+    {
+        unalignedTotal += count;
+        std::cout << "\n\tip:" << HexString(ip) << " " << count;
+    }
+    std::cout << "\n\ttotal: " << unalignedTotal << " (+" << unalignedTotal * unalignedWordPenalty << " clocks)";
+}
+
+// Writes <prefix>.csv, <prefix>_strides.csv, <prefix>_unaligned.csv and <prefix>_heatmap.png
+void ExportMemoryAnalysis(const std::string& prefix)
+{
+    std::ofstream counts{ prefix + ".csv" };
+    counts << "address,reads,writes\n";
+    for (unsigned int i = 0; i < mainMemoryLimit; i++)
+    {
+        if (memoryReadCounts[i] || memoryWriteCounts[i])
+            counts << i << ',' << memoryReadCounts[i] << ',' << memoryWriteCounts[i] << '\n';
+    }
+
+    std::ofstream strides{ prefix + "_strides.csv" };
+    strides << "stride,count\n";
+    for (int bucket = 0; bucket < (int)std::size(strideHistogram); bucket++)
+    {
+        if (strideHistogram[bucket])
+            strides << StrideBucketStr(bucket) << ',' << strideHistogram[bucket] << '\n';
+    }
+
+    std::ofstream unaligned{ prefix + "_unaligned.csv" };
+    unaligned << "ip,count\n";
+    for (const auto& [ip, count] : unalignedAccessesByIp)
+    {
+        unaligned << ip << ',' << count << '\n';
+    }
+
+    // 256x256 image, one pixel per address: red for writes, green for reads, log2 scaled
+    u32 maxCount = 1;
+    for (unsigned int i = 0; i < mainMemoryLimit; i++)
+    {
+        maxCount = std::max({maxCount, memoryReadCounts[i], memoryWriteCounts[i]});
+    }
+    const int maxBits = std::bit_width(maxCount);
+    std::vector<u8> rgb(mainMemoryLimit * 3, 0);
+    for (unsigned int i = 0; i < mainMemoryLimit; i++)
+    {
+        rgb[i * 3 + 0] = (u8)(std::bit_width(memoryWriteCounts[i]) * 255 / maxBits);
+        rgb[i * 3 + 1] = (u8)(std::bit_width(memoryReadCounts[i]) * 255 / maxBits);
+    }
+    const auto png = EncodePng(rgb, 256, 256);
+    std::ofstream heatmap{ prefix + "_heatmap.png", std::ios::binary };
+    heatmap.write(reinterpret_cast<const char*>(png.data()), png.size());
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuNames.h"
+#include "CpuOperations.h"
+#include "CpuExecution.h"
+#include "CpuSnapshot.h"
+#include "CycleEstimation.h"
+#include "ControlFlowGraph.h"
+#include "ExecutionPolicies.h"
+#include "MemoryAnalyzer.h"
+#include "Breakpoints.h"
+#include "Helpers.h"
+
+// A/B comparison of two versions of a routine, e.g. listing_0056 against listing_0057.
+// Both images run from the same initial machine state, their final registers and memory are
+// compared and clocks, steps, memory transfers and unaligned word penalties are reported side
+// by side. Blocks of two different programs don't share addresses, so they are paired by their
+// order in the listing, which lines up as long as the optimized version keeps the same shape.
+
+constexpr u64 routineCompareStepLimit = 100'000'000;
+
+struct BlockProfile
+{
+    u64 executions = 0;
+    u64 steps = 0;
+    u64 clocks = 0;
+};
+
+struct RoutineProfile
+{
+    std::string name;
+    u64 clocks = 0;
+    u64 steps = 0;
+    u64 reads = 0;
+    u64 writes = 0;
+    u64 unaligned = 0;
+    std::map<u16, BlockProfile> blocks;
+    MachineSnapshot final{};
+};
+
+// Registers left out of the final state comparison, e.g. loop counters of only one version
+std::vector<RegisterIndex> compareIgnoredRegisters;
+
+// "cx,si", false at the first name that isn't a register
+bool ParseCompareIgnore(const std::string& str)
+{
+    size_t begin = 0;
+    while (begin <= str.size())
+    {
+        const auto end = std::min(str.find(',', begin), str.size());
+        const RegisterIndex reg = ParseRegisterName(str.substr(begin, end - begin));
+        if (reg == RegisterIndex::None)
+        {
+            return false;
+        }
+        compareIgnoredRegisters.push_back(reg);
+        begin = end + 1;
+    }
+    return true;
+}
+
+RoutineProfile ProfileRoutine(const std::string& name, const std::unordered_map<int, Operation>& operations,
+    const ControlFlowGraph& cfg, const MachineSnapshot& initial)
+{
+    RoutineProfile profile{};
+    profile.name = name;
+    std::vector<BlockProfile*> blockAt(mainMemoryLimit, nullptr);
+    for (const auto& [start, block] : cfg.blocks)
+    {
+        blockAt[start] = &profile.blocks[start];
+    }
+
+    RestoreSnapshot(initial);
+    executedSteps = 0;
+    EnableMemoryAnalyzer();
+
+    BlockProfile* block = nullptr;
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend() && profile.steps < routineCompareStepLimit)
+    {
+        if (BlockProfile* entered = blockAt[(u16)ipReg])
+        {
+            block = entered;
+            block->executions++;
+        }
+        const Operation& op = operationIt->second;
+        ExecuteStepWith<false, NoWatchpoints, MemoryProfiler>(op);
+        const int clocks = CycleEstimation(op, lastStringRepetitions);
+        profile.clocks += clocks;
+        profile.steps++;
+        if (block)
+        {
+            block->steps++;
+            block->clocks += clocks;
+        }
+        operationIt = operations.find(ipReg);
+    }
+    if (profile.steps == routineCompareStepLimit)
+    {
+        std::cout << "\n" << name << " stopped after " << routineCompareStepLimit << " steps";
+    }
+
+    memoryAnalyzerEnabled = false;
+    profile.reads = memoryReadTransfers;
+    profile.writes = memoryWriteTransfers;
+    profile.unaligned = UnalignedAccessCount();
+    profile.final = TakeSnapshot();
+    return profile;
+}
+
+std::string SignedDiffStr(u64 a, u64 b)
+{
+    return b >= a ? "+" + std::to_string(b - a) : "-" + std::to_string(a - b);
+}
+
+void PrintCompareRow(const std::string& label, u64 a, u64 b)
+{
+    std::cout << "\n\t" << std::left << std::setw(22) << label << std::right
+        << std::setw(12) << a << std::setw(12) << b << std::setw(12) << SignedDiffStr(a, b);
+}
+
+// Prints differences of registers and memory, returns true when final states are equivalent
+bool CompareFinalStates(const RoutineProfile& a, const RoutineProfile& b)
+{
+    bool equivalent = true;
+    std::cout << "\nFinal state:";
+    for (auto reg : {RegisterIndex::ax, RegisterIndex::bx, RegisterIndex::cx, RegisterIndex::dx, RegisterIndex::sp, RegisterIndex::bp, RegisterIndex::si, RegisterIndex::di})
+    {
+        const int slot = GetRegisterSlot(reg);
+        if (a.final.registers[slot] != b.final.registers[slot]
+            && std::find(compareIgnoredRegisters.cbegin(), compareIgnoredRegisters.cend(), reg) == compareIgnoredRegisters.cend())
+        {
+            std::cout << "\n\t" << registerNames[reg] << ": " << HexString(a.final.registers[slot]) << " != " << HexString(b.final.registers[slot]);
+            equivalent = false;
+        }
+    }
+
+    // Ranges of differing bytes, only the first few are listed
+    constexpr int listedRanges = 8;
+    int ranges = 0;
+    u64 differingBytes = 0;
+    int rangeBegin = -1;
+    for (unsigned int address = 0; address <= mainMemoryLimit; address++)
+    {
+        const bool differs = address < mainMemoryLimit
+            && (*a.final.pages[address / memoryPageSize])[address % memoryPageSize] != (*b.final.pages[address / memoryPageSize])[address % memoryPageSize];
+        if (differs)
+        {
+            differingBytes++;
+            if (rangeBegin < 0)
+            {
+                rangeBegin = int(address);
+            }
+        }
+        else if (rangeBegin >= 0)
+        {
+            if (ranges++ < listedRanges)
+            {
+                std::cout << "\n\tmemory " << HexString(u16(rangeBegin)) << ".." << HexString(u16(address - 1)) << " differs";
+            }
+            rangeBegin = -1;
+        }
+    }
+    if (differingBytes != 0)
+    {
+        std::cout << "\n\t" << differingBytes << " bytes in " << ranges << " ranges differ";
+        equivalent = false;
+    }
+    if (equivalent)
+    {
+        std::cout << "\n\tequivalent";
+    }
+    return equivalent;
+}
+
+// Runs both routines from the current machine state, which is left as it was. Returns true when
+// their final registers and memory are equivalent
+bool CompareRoutines(const std::string& nameA, const std::unordered_map<int, Operation>& operationsA,
+    const std::string& nameB, const std::unordered_map<int, Operation>& operationsB)
+{
+    const MachineSnapshot initial = TakeSnapshot();
+    const RoutineProfile a = ProfileRoutine(nameA, operationsA, BuildControlFlowGraph(operationsA), initial);
+    const RoutineProfile b = ProfileRoutine(nameB, operationsB, BuildControlFlowGraph(operationsB), initial);
+    RestoreSnapshot(initial);
+    executedSteps = 0;
+
+    std::cout << "\nA: " << a.name << "\nB: " << b.name;
+    std::cout << "\n\t" << std::left << std::setw(22) << "" << std::right
+        << std::setw(12) << "A" << std::setw(12) << "B" << std::setw(12) << "B - A";
+    PrintCompareRow("clocks", a.clocks, b.clocks);
+    PrintCompareRow("steps", a.steps, b.steps);
+    PrintCompareRow("memory reads", a.reads, b.reads);
+    PrintCompareRow("memory writes", a.writes, b.writes);
+    PrintCompareRow("unaligned words", a.unaligned, b.unaligned);
+    PrintCompareRow("unaligned clocks", a.unaligned * unalignedWordPenalty, b.unaligned * unalignedWordPenalty);
+    PrintCompareRow("clocks with penalty", a.clocks + a.unaligned * unalignedWordPenalty, b.clocks + b.unaligned * unalignedWordPenalty);
+
+    std::cout << "\nBlocks (paired by order):";
+    auto blockA = a.blocks.cbegin();
+    auto blockB = b.blocks.cbegin();
+    while (blockA != a.blocks.cend() || blockB != b.blocks.cend())
+    {
+        const BlockProfile profileA = blockA != a.blocks.cend() ? blockA->second : BlockProfile{};
+        const BlockProfile profileB = blockB != b.blocks.cend() ? blockB->second : BlockProfile{};
+        const std::string startA = blockA != a.blocks.cend() ? HexString(blockA->first) : "-";
+        const std::string startB = blockB != b.blocks.cend() ? HexString(blockB->first) : "-";
+        std::cout << "\n\t" << startA << " / " << startB
+            << " runs: " << profileA.executions << " / " << profileB.executions
+            << " steps: " << profileA.steps << " / " << profileB.steps
+            << " clocks: " << profileA.clocks << " / " << profileB.clocks << " (" << SignedDiffStr(profileA.clocks, profileB.clocks) << ")";
+        if (blockA != a.blocks.cend()) ++blockA;
+        if (blockB != b.blocks.cend()) ++blockB;
+    }
+
+    const bool equivalent = CompareFinalStates(a, b);
+    std::cout << '\n';
+    return equivalent;
+}
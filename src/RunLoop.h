@@ -0,0 +1,228 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "CpuExecution.h"
+#include "CycleEstimation.h"
+#include "ExecutionPolicies.h"
+#include "Breakpoints.h"
+#include "Framebuffer.h"
+#include "Devices.h"
+#include "Fusion.h"
+#include "Disassembly.h"
+#include "TraceFilter.h"
+
+// Executing run loop is a template over its policies: trace, cycle model, watchpoints,
+// profiler, undo log and framebuffer. One instantiation per combination is picked at startup,
+// so a plain run has no instrumentation branches left in it. String, stack and system operations
+// and fused sequences still test the undo log and framebuffer at runtime, they are rare next to
+// mov/add/sub/cmp and jumps. Fused sequences are only run when nothing has to see single operations.
+
+struct NoTrace
+{
+    static constexpr bool enabled = false;
+    static bool Begin(u16) { return false; }
+    static void End() {}
+};
+
+struct PrintTrace
+{
+    static constexpr bool enabled = true;
+    static bool Begin(u16) { return true; }
+    static void End() {}
+};
+
+// Steps picked by traceFilter, see TraceFilter.h
+struct FilteredTrace
+{
+    static constexpr bool enabled = true;
+    static bool Begin(u16 ip) { return BeginFilteredStep(ip); }
+    static void End() { EndFilteredStep(); }
+};
+
+// Estimated clocks are totalled when Estimate is set, device clock is advanced when Devices is
+template<bool Estimate, bool Devices>
+struct CycleModel
+{
+    static constexpr bool enabled = Estimate || Devices;
+    u64 total = 0;
+
+    template<typename Trace>
+    void Step(const Operation& op, bool traced)
+    {
+        if constexpr (Devices)
+        {
+            const int vector = AdvanceDevices(op);
+            if constexpr (Trace::enabled)
+            {
+                if (traced && vector >= 0)
+                {
+                    std::cout << " | interrupt " << vector;
+                }
+            }
+        }
+        if constexpr (Estimate)
+        {
+            const int cyclesCount = CycleEstimation(op, lastStringRepetitions);
+            total += cyclesCount;
+            if constexpr (Trace::enabled)
+            {
+                if (traced)
+                {
+                    std::cout << " | Clocks: +" << cyclesCount << " = " << total;
+                }
+            }
+        }
+    }
+};
+
+// Frames policies double as the framebuffer policy of operand writes
+struct NoFrames : NoFramebuffer
+{
+    static void Step() {}
+};
+
+// Framebuffer written as one image after the run
+struct MarkFrames
+{
+    static constexpr bool enabled = false;
+    static void Step() {}
+    static void Written(u16 address, bool wide) { MarkFramebufferWritten(address, wide); }
+};
+
+struct ExportFrames
+{
+    static constexpr bool enabled = true;
+    static void Step()
+    {
+        if (executedSteps % framebuffer.frameEvery == 0)
+        {
+            WriteFramebufferFrame();
+        }
+    }
+    static void Written(u16 address, bool wide) { MarkFramebufferWritten(address, wide); }
+};
+
+struct RunOptions
+{
+    bool trace = true;
+    bool filterTrace = false;
+    bool estimateCycles = false;
+    bool devices = false;
+    bool watchpoints = false;
+    bool profile = false;
+    bool undo = false;
+    bool framebuffer = false;
+    bool frames = false;    // framebuffer frames exported while running
+};
+
+// Executes from ipReg until it leaves the program or a breakpoint hits, returns estimated clocks
+template<typename Trace, typename Cycles, typename Watch, typename Profiler, typename Undo, typename Frames>
+u64 RunLoop(const std::unordered_map<int, Operation>& operations)
+{
+    constexpr bool fuse = !Trace::enabled && !Cycles::enabled && !Watch::enabled && !Frames::enabled;
+    Cycles cycles{};
+    auto operationIt = operations.find(ipReg);
+    while (operationIt != operations.cend())
+    {
+        if constexpr (Watch::enabled)
+        {
+            if (CheckCodeBreakpoints())
+            {
+                std::cout << BreakpointHitStr(breakpointHit) << '\n';
+                break;
+            }
+        }
+
+        const Operation& op = operationIt->second;
+        if constexpr (fuse)
+        {
+            if (op.fused.count != 0)
+            {
+                ExecuteFusedGroup(op.fused);
+                operationIt = operations.find(ipReg);
+                continue;
+            }
+        }
+
+        const bool traced = Trace::Begin(u16(ipReg));
+        if (traced)
+        {
+            PrintOperation(op);
+            std::cout << ExecuteStepWith<Trace::enabled, Watch, Profiler, Undo, Frames>(op);
+        }
+        else
+        {
+            ExecuteStepWith<false, Watch, Profiler, Undo, Frames>(op);
+        }
+        Frames::Step();
+        cycles.template Step<Trace>(op, traced);
+
+        operationIt = operations.find(ipReg);
+        if (traced)
+        {
+            std::cout << '\n';
+            Trace::End();
+        }
+
+        if constexpr (Watch::enabled)
+        {
+            if (breakpointHit.kind != BreakpointHit::Kind::None)
+            {
+                std::cout << BreakpointHitStr(breakpointHit) << '\n';
+                break;
+            }
+        }
+    }
+    return cycles.total;
+}
+
+template<typename Fn>
+auto ChoosePolicy(bool condition, Fn fn)
+{
+    return condition ? fn(std::true_type{}) : fn(std::false_type{});
+}
+
+template<typename Fn>
+auto ChooseTracePolicy(const RunOptions& options, Fn fn)
+{
+    if (!options.trace)
+    {
+        return fn(std::type_identity<NoTrace>{});
+    }
+    return options.filterTrace ? fn(std::type_identity<FilteredTrace>{}) : fn(std::type_identity<PrintTrace>{});
+}
+
+template<typename Fn>
+auto ChooseFramesPolicy(const RunOptions& options, Fn fn)
+{
+    if (!options.framebuffer)
+    {
+        return fn(std::type_identity<NoFrames>{});
+    }
+    return options.frames ? fn(std::type_identity<ExportFrames>{}) : fn(std::type_identity<MarkFrames>{});
+}
+
+u64 RunWithPolicies(const std::unordered_map<int, Operation>& operations, const RunOptions& options)
+{
+    return ChooseTracePolicy(options, [&](auto trace) {
+    return ChoosePolicy(options.estimateCycles, [&](auto estimate) {
+    return ChoosePolicy(options.devices, [&](auto devices) {
+    return ChoosePolicy(options.watchpoints, [&](auto watch) {
+    return ChoosePolicy(options.profile, [&](auto profile) {
+    return ChoosePolicy(options.undo, [&](auto undo) {
+    return ChooseFramesPolicy(options, [&](auto frames) {
+        return RunLoop<
+            typename decltype(trace)::type,
+            CycleModel<decltype(estimate)::value, decltype(devices)::value>,
+            std::conditional_t<decltype(watch)::value, ArmedWatchpoints, NoWatchpoints>,
+            std::conditional_t<decltype(profile)::value, MemoryProfiler, NoProfiler>,
+            std::conditional_t<decltype(undo)::value, RecordUndo, NoUndo>,
+            typename decltype(frames)::type>(operations);
+    }); }); }); }); }); }); });
+}
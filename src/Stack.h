@@ -0,0 +1,122 @@
+#pragma once
+#include <string>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Helpers.h"
+#include "CpuOperations.h"
+#include "UndoLog.h"
+#include "DirectMemory.h"
+
+// Stack grows down from sp in mainMemory. There are no segment registers, ss is always 0,
+// so the first push of a fresh machine lands at 0xfffe. push, pop, call and ret read and write
+// the stack directly instead of going through MemoryAccess. push sp stores the already
+// decremented value, as the 8086 does.
+
+// 8086 FLAGS layout: bits 12-15 and 1 always read as set
+constexpr u16 pushedFlagsBase = 0xF002;
+constexpr int zeroFlagBit = 6;
+constexpr int signFlagBit = 7;
+constexpr int interruptFlagBit = 9;
+
+// Defined by Devices.h, popf can unmask a pending interrupt
+void InterruptFlagChanged();
+
+u16& StackPointer()
+{
+    return registersMem[GetRegisterSlot(RegisterIndex::sp)];
+}
+
+void StackPush(u16 value)
+{
+    u16& sp = StackPointer();
+    RecordRegisterWrite(&sp);
+    sp -= 2;
+    DirectWrite(sp, true, value);
+}
+
+u16 StackPop()
+{
+    u16& sp = StackPointer();
+    RecordRegisterWrite(&sp);
+    const u16 value = DirectRead(sp, true);
+    sp += 2;
+    return value;
+}
+
+u16 PackFlags()
+{
+    return pushedFlagsBase | (flags[Flag::FLAG_ZERO] << zeroFlagBit) | (flags[Flag::FLAG_SIGNED] << signFlagBit)
+        | (flags[Flag::FLAG_INTERRUPT] << interruptFlagBit);
+}
+
+void UnpackFlags(u16 value)
+{
+    RecordFlagsWrite();
+    flags[Flag::FLAG_ZERO] = (value >> zeroFlagBit) & 1;
+    flags[Flag::FLAG_SIGNED] = (value >> signFlagBit) & 1;
+    flags[Flag::FLAG_INTERRUPT] = (value >> interruptFlagBit) & 1;
+    InterruptFlagChanged();
+}
+
+// Executes stack operation and moves ipReg, trace is only built when asked for
+void ExecuteStackOp(const Operation& op, std::string* trace)
+{
+    const u16 prevSp = StackPointer();
+    const Operand& operand = op.operands[0];
+    s16 nextIp = s16(ipReg + op.size + 1);
+    switch (op.opStackIndex)
+    {
+    case OpStack::push:
+    {
+        u16& sp = StackPointer();
+        RecordRegisterWrite(&sp);
+        sp -= 2;
+        const u16 value = operand.type == Operand::Type::Register ? *GetRegisterMem(operand.reg) : DirectRead(operand.mem.Evaluate(), true);
+        DirectWrite(sp, true, value);
+        break;
+    }
+    case OpStack::pop:
+    {
+        const u16 value = StackPop();
+        if (operand.type == Operand::Type::Register)
+        {
+            u16* reg = GetRegisterMem(operand.reg);
+            if (trace)
+            {
+                *trace += std::string(" ; ") + registerNames[operand.reg] + ":" + HexString(*reg) + " -> " + HexString(value);
+            }
+            RecordRegisterWrite(reg);
+            *reg = value;
+        }
+        else
+        {
+            DirectWrite(operand.mem.Evaluate(), true, value);
+        }
+        break;
+    }
+    case OpStack::pushf:
+        StackPush(PackFlags());
+        break;
+    case OpStack::popf:
+        UnpackFlags(StackPop());
+        break;
+    case OpStack::call:
+        StackPush((u16)nextIp);
+        nextIp = s16(ipReg + operand.jump.value);
+        break;
+    case OpStack::ret:
+        nextIp = (s16)StackPop();
+        if (operand.type == Operand::Type::Immediate)
+        {
+            StackPointer() += (u16)operand.immVal.value;
+        }
+        break;
+    }
+    ipReg = nextIp;
+
+    if (trace && StackPointer() != prevSp)
+    {
+        *trace += " ; sp:" + HexString(prevSp) + " -> " + HexString(StackPointer());
+    }
+}
@@ -0,0 +1,714 @@
+#pragma once
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuNames.h"
+#include "Helpers.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "ControlFlowGraph.h"
+
+// Cycle estimates without executing anything. Known register values are propagated over
+// the CFG from the zeroed start state. A loop gets a trip count when its only latch ends with
+// jne or loop on a register that is changed only there, by known amounts, and enters the loop
+// with a known value. Other loops show up as a symbol n_<header> in the estimates.
+// REP string operations are estimated from a known cx, compares taken as running to the end;
+// with unknown cx only their fixed clocks count. A call forgets every register, as the callee
+// may change any of them, and blocks of a subroutine count once however often it's called.
+
+struct ConstRegister
+{
+    enum class Kind : u8 { Unset, Known, Varying };
+    Kind kind = Kind::Unset;
+    u16 value = 0;
+
+    bool operator==(const ConstRegister&) const = default;
+};
+
+using ConstRegisters = std::array<ConstRegister, 8>;
+
+ConstRegister KnownRegister(u16 value)
+{
+    return { ConstRegister::Kind::Known, value };
+}
+
+ConstRegister MeetConst(ConstRegister a, ConstRegister b)
+{
+    if (a.kind == ConstRegister::Kind::Unset) return b;
+    if (b.kind == ConstRegister::Kind::Unset) return a;
+    return a == b ? a : ConstRegister{ ConstRegister::Kind::Varying, 0 };
+}
+
+ConstRegister ConstOperandValue(const Operand& operand, const ConstRegisters& registers)
+{
+    switch (operand.type)
+    {
+    case Operand::Type::Immediate:
+        return KnownRegister((u16)operand.immVal.value);
+    case Operand::Type::Register:
+    {
+        const ConstRegister word = registers[GetRegisterSlot(operand.reg)];
+        if (!IsByteRegister(operand.reg) || word.kind != ConstRegister::Kind::Known)
+        {
+            return word;
+        }
+        const bool high = GetByteRegisterMem(operand.reg) != reinterpret_cast<u8*>(GetRegisterMem(operand.reg));
+        return KnownRegister(high ? word.value >> 8 : word.value & 0xFF);
+    }
+    default:
+        return { ConstRegister::Kind::Varying, 0 };
+    }
+}
+
+// Repetitions of a string operation when they don't depend on memory
+ConstRegister StringRepetitionsConst(const Operation& op, const ConstRegisters& registers)
+{
+    if (op.repPrefix == RepPrefix::None)
+    {
+        return KnownRegister(1);
+    }
+    const ConstRegister cx = registers[GetRegisterSlot(RegisterIndex::cx)];
+    return IsCompareString(op) || cx.kind != ConstRegister::Kind::Known ? ConstRegister{ ConstRegister::Kind::Varying, 0 } : cx;
+}
+
+bool StringUsesSource(const Operation& op)
+{
+    return op.opStringIndex == OpString::movs || op.opStringIndex == OpString::cmps || op.opStringIndex == OpString::lods;
+}
+
+bool StringUsesDestination(const Operation& op)
+{
+    return op.opStringIndex != OpString::lods;
+}
+
+void TransferStringConst(const Operation& op, ConstRegisters& registers)
+{
+    const ConstRegister repetitions = StringRepetitionsConst(op, registers);
+    const u16 step = op.wide ? 2 : 1;
+    const auto advance = [&](RegisterIndex reg) {
+        ConstRegister& value = registers[GetRegisterSlot(reg)];
+        value = repetitions.kind == ConstRegister::Kind::Known && value.kind == ConstRegister::Kind::Known
+            ? KnownRegister(u16(value.value + repetitions.value * step))
+            : ConstRegister{ ConstRegister::Kind::Varying, 0 };
+    };
+    if (StringUsesSource(op))
+    {
+        advance(RegisterIndex::si);
+    }
+    if (StringUsesDestination(op))
+    {
+        advance(RegisterIndex::di);
+    }
+    if (op.opStringIndex == OpString::lods)
+    {
+        registers[GetRegisterSlot(RegisterIndex::ax)] = { ConstRegister::Kind::Varying, 0 };
+    }
+    if (op.repPrefix != RepPrefix::None)
+    {
+        registers[GetRegisterSlot(RegisterIndex::cx)] = repetitions.kind == ConstRegister::Kind::Known
+            ? KnownRegister(0) : ConstRegister{ ConstRegister::Kind::Varying, 0 };
+    }
+}
+
+void TransferStackConst(const Operation& op, ConstRegisters& registers)
+{
+    if (op.opStackIndex == OpStack::call)
+    {
+        registers.fill({ ConstRegister::Kind::Varying, 0 });
+        return;
+    }
+
+    ConstRegister& sp = registers[GetRegisterSlot(RegisterIndex::sp)];
+    u16 released = 0;
+    switch (op.opStackIndex)
+    {
+    case OpStack::push:
+    case OpStack::pushf:
+        released = u16(-2);
+        break;
+    case OpStack::ret:
+        released = op.operands[0].type == Operand::Type::Immediate ? u16(2 + op.operands[0].immVal.value) : 2;
+        break;
+    default:
+        released = 2;
+        break;
+    }
+    if (sp.kind == ConstRegister::Kind::Known)
+    {
+        sp.value += released;
+    }
+    if (op.opStackIndex == OpStack::pop && op.operands[0].type == Operand::Type::Register)
+    {
+        registers[GetRegisterSlot(op.operands[0].reg)] = { ConstRegister::Kind::Varying, 0 };
+    }
+}
+
+void TransferSystemConst(const Operation& op, ConstRegisters& registers)
+{
+    // Handler may change anything before iret comes back
+    if (op.opSystemIndex == OpSystem::intN)
+    {
+        registers.fill({ ConstRegister::Kind::Varying, 0 });
+    }
+    else if (op.opSystemIndex == OpSystem::in)
+    {
+        registers[GetRegisterSlot(RegisterIndex::ax)] = { ConstRegister::Kind::Varying, 0 };
+    }
+}
+
+void TransferConst(const Operation& op, ConstRegisters& registers)
+{
+    if (op.type == Operation::Type::String)
+    {
+        TransferStringConst(op, registers);
+        return;
+    }
+    if (op.type == Operation::Type::Stack)
+    {
+        TransferStackConst(op, registers);
+        return;
+    }
+    if (op.type == Operation::Type::System)
+    {
+        TransferSystemConst(op, registers);
+        return;
+    }
+    if (op.type == Operation::Type::Loop)
+    {
+        ConstRegister& cx = registers[GetRegisterSlot(RegisterIndex::cx)];
+        if (op.opLoopIndex != OpLoop::jcxz && cx.kind == ConstRegister::Kind::Known)
+        {
+            cx.value -= 1;
+        }
+        return;
+    }
+    if (op.type != Operation::Type::Operation || op.operands[0].type != Operand::Type::Register || op.opIndex == OpIndex::CMP)
+    {
+        return;
+    }
+
+    const RegisterIndex reg = op.operands[0].reg;
+    ConstRegister& word = registers[GetRegisterSlot(reg)];
+    const ConstRegister src = ConstOperandValue(op.operands[1], registers);
+    const ConstRegister dst = ConstOperandValue(op.operands[0], registers);
+    if (src.kind != ConstRegister::Kind::Known || (op.opIndex != OpIndex::MOV && dst.kind != ConstRegister::Kind::Known)
+        || (IsByteRegister(reg) && word.kind != ConstRegister::Kind::Known))
+    {
+        word = { ConstRegister::Kind::Varying, 0 };
+        return;
+    }
+
+    const u16 result = op.opIndex == OpIndex::MOV ? src.value
+                     : op.opIndex == OpIndex::ADD ? u16(dst.value + src.value)
+                     : u16(dst.value - src.value);
+    if (!IsByteRegister(reg))
+    {
+        word = KnownRegister(result);
+    }
+    else if (GetByteRegisterMem(reg) != reinterpret_cast<u8*>(GetRegisterMem(reg)))
+    {
+        word.value = (word.value & 0x00FF) | ((result & 0xFF) << 8);
+    }
+    else
+    {
+        word.value = (word.value & 0xFF00) | (result & 0xFF);
+    }
+}
+
+bool WritesRegisterSlot(const Operation& op, int slot)
+{
+    if (op.type == Operation::Type::Loop)
+    {
+        return op.opLoopIndex != OpLoop::jcxz && slot == GetRegisterSlot(RegisterIndex::cx);
+    }
+    if (op.type == Operation::Type::String)
+    {
+        return (StringUsesSource(op) && slot == GetRegisterSlot(RegisterIndex::si))
+            || (StringUsesDestination(op) && slot == GetRegisterSlot(RegisterIndex::di))
+            || (op.opStringIndex == OpString::lods && slot == GetRegisterSlot(RegisterIndex::ax))
+            || (op.repPrefix != RepPrefix::None && slot == GetRegisterSlot(RegisterIndex::cx));
+    }
+    if (op.type == Operation::Type::Stack)
+    {
+        return op.opStackIndex == OpStack::call || slot == GetRegisterSlot(RegisterIndex::sp)
+            || (op.opStackIndex == OpStack::pop && op.operands[0].type == Operand::Type::Register && GetRegisterSlot(op.operands[0].reg) == slot);
+    }
+    if (op.type == Operation::Type::System)
+    {
+        return op.opSystemIndex == OpSystem::intN || (op.opSystemIndex == OpSystem::in && slot == GetRegisterSlot(RegisterIndex::ax));
+    }
+    return op.type == Operation::Type::Operation && op.opIndex != OpIndex::CMP
+        && op.operands[0].type == Operand::Type::Register && GetRegisterSlot(op.operands[0].reg) == slot;
+}
+
+struct LoopTripCount
+{
+    enum class Kind { Unknown, Counted, Infinite };
+    Kind kind = Kind::Unknown;
+    u32 count = 0;
+    RegisterIndex counter = RegisterIndex::None;
+};
+
+// Sum of coefficient * product of unknown trip counts, keyed by loop headers of the product
+using CycleTerms = std::map<std::vector<u16>, u64>;
+
+std::string TripSymbol(u16 header)
+{
+    std::stringstream stream;
+    stream << "n_" << std::hex << header;
+    return stream.str();
+}
+
+std::string CycleTermsStr(const CycleTerms& terms)
+{
+    std::string result;
+    for (const auto& [symbols, coefficient] : terms)
+    {
+        if (coefficient == 0)
+        {
+            continue;
+        }
+        std::string term = coefficient != 1 || symbols.empty() ? std::to_string(coefficient) : "";
+        for (u16 header : symbols)
+        {
+            if (!term.empty())
+            {
+                term += '*';
+            }
+            term += TripSymbol(header);
+        }
+        if (!result.empty())
+        {
+            result += " + ";
+        }
+        result += term;
+    }
+    return result.empty() ? "0" : result;
+}
+
+struct StaticCycleEstimate
+{
+    ControlFlowGraph cfg;
+    std::vector<NaturalLoop> loops;
+    std::vector<LoopTripCount> trips;
+    std::map<u16, u64> blockCycles;         // one execution of a block
+    std::map<u16, CycleTerms> blockCounts;  // executions of a block over the whole run
+    std::vector<CycleTerms> loopCycles;     // clocks of one entry into a loop
+    CycleTerms total;
+};
+
+std::map<u16, ConstRegisters> PropagateConstants(const ControlFlowGraph& cfg, const std::unordered_map<int, Operation>& operations,
+    const ConstRegisters& initial, std::map<u16, ConstRegisters>& outStates)
+{
+    const std::vector<u16> order = ReversePostOrder(cfg);
+    std::map<u16, ConstRegisters> inStates;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (u16 start : order)
+        {
+            ConstRegisters in = start == cfg.entry ? initial : ConstRegisters{};
+            for (u16 predecessor : cfg.Find(start)->predecessors)
+            {
+                auto outIt = outStates.find(predecessor);
+                if (outIt == outStates.end())
+                {
+                    continue;
+                }
+                for (int slot = 0; slot < 8; slot++)
+                {
+                    in[slot] = MeetConst(in[slot], outIt->second[slot]);
+                }
+            }
+
+            ConstRegisters out = in;
+            for (u16 ip : cfg.Find(start)->operationIps)
+            {
+                TransferConst(operations.at(ip), out);
+            }
+            if (!inStates.count(start) || inStates[start] != in || outStates[start] != out)
+            {
+                inStates[start] = in;
+                outStates[start] = out;
+                changed = true;
+            }
+        }
+    }
+    return inStates;
+}
+
+LoopTripCount FindTripCount(const NaturalLoop& loop, const ControlFlowGraph& cfg, const std::unordered_map<int, Operation>& operations,
+    const ConstRegisters& initial, const std::map<u16, ConstRegisters>& inStates, const std::map<u16, ConstRegisters>& outStates)
+{
+    LoopTripCount trip{};
+    if (loop.latches.size() != 1)
+    {
+        return trip;
+    }
+    const BasicBlock& latch = *cfg.Find(loop.latches[0]);
+    const Operation& exit = operations.at(latch.operationIps.back());
+    const bool isLoopInstruction = exit.type == Operation::Type::Loop && exit.opLoopIndex == OpLoop::loop;
+    if ((!isLoopInstruction && !(exit.type == Operation::Type::Jump && exit.opJumpIndex == OpJump::jne))
+        || latch.taken != loop.header || loop.body.count((u16)latch.fallthrough))
+    {
+        return trip;
+    }
+    for (u16 start : loop.body)
+    {
+        const BasicBlock& block = *cfg.Find(start);
+        for (int next : {block.taken, block.fallthrough})
+        {
+            if (start != latch.start && next >= 0 && !loop.body.count((u16)next))
+            {
+                return trip; // more than one way out
+            }
+        }
+    }
+
+    // Walk the latch: counter register, its change per iteration and the value compared against
+    ConstRegisters registers = inStates.at(latch.start);
+    int flagsIndex = -1;
+    for (size_t i = 0; i + 1 < latch.operationIps.size(); i++)
+    {
+        const Operation& op = operations.at(latch.operationIps[i]);
+        if (op.type == Operation::Type::Operation && (op.opIndex == OpIndex::ADD || op.opIndex == OpIndex::SUB || op.opIndex == OpIndex::CMP))
+        {
+            flagsIndex = int(i);
+        }
+        else if (IsCompareString(op))
+        {
+            flagsIndex = -1; // flags come from memory
+        }
+    }
+    if (isLoopInstruction)
+    {
+        trip.counter = RegisterIndex::cx;
+        flagsIndex = int(latch.operationIps.size()) - 1;
+    }
+    else if (flagsIndex < 0 || operations.at(latch.operationIps[flagsIndex]).operands[0].type != Operand::Type::Register
+        || IsByteRegister(operations.at(latch.operationIps[flagsIndex]).operands[0].reg))
+    {
+        return trip;
+    }
+    else
+    {
+        trip.counter = operations.at(latch.operationIps[flagsIndex]).operands[0].reg;
+    }
+    const int slot = GetRegisterSlot(trip.counter);
+
+    u16 stride = 0;
+    u16 deltaAtFlags = 0;
+    u16 compared = 0;
+    for (size_t i = 0; i < latch.operationIps.size(); i++)
+    {
+        const Operation& op = operations.at(latch.operationIps[i]);
+        if (int(i) == flagsIndex && op.type == Operation::Type::Operation && op.opIndex == OpIndex::CMP)
+        {
+            const ConstRegister value = ConstOperandValue(op.operands[1], registers);
+            if (value.kind != ConstRegister::Kind::Known)
+            {
+                return trip;
+            }
+            compared = value.value;
+        }
+        if (WritesRegisterSlot(op, slot))
+        {
+            if (op.type == Operation::Type::Loop)
+            {
+                stride -= 1;
+            }
+            else if (op.type != Operation::Type::Operation)
+            {
+                return trip;
+            }
+            else
+            {
+                const ConstRegister value = ConstOperandValue(op.operands[1], registers);
+                if (op.opIndex == OpIndex::MOV || IsByteRegister(op.operands[0].reg) || value.kind != ConstRegister::Kind::Known)
+                {
+                    return trip;
+                }
+                stride += op.opIndex == OpIndex::ADD ? value.value : u16(-value.value);
+            }
+        }
+        if (int(i) == flagsIndex)
+        {
+            deltaAtFlags = stride;
+        }
+        TransferConst(op, registers);
+    }
+    for (u16 start : loop.body)
+    {
+        for (u16 ip : cfg.Find(start)->operationIps)
+        {
+            if (start != latch.start && WritesRegisterSlot(operations.at(ip), slot))
+            {
+                return trip;
+            }
+        }
+    }
+
+    // Value of the counter when entering from outside the loop
+    ConstRegister entered = loop.header == cfg.entry ? initial[slot] : ConstRegister{};
+    for (u16 predecessor : cfg.Find(loop.header)->predecessors)
+    {
+        if (!loop.body.count(predecessor) && outStates.count(predecessor))
+        {
+            entered = MeetConst(entered, outStates.at(predecessor)[slot]);
+        }
+    }
+    if (entered.kind != ConstRegister::Kind::Known)
+    {
+        return trip;
+    }
+
+    const int lastIteration = SolveTripIndex(u16(entered.value + deltaAtFlags - compared), stride);
+    if (lastIteration < 0)
+    {
+        trip.kind = LoopTripCount::Kind::Infinite;
+        return trip;
+    }
+    trip.kind = LoopTripCount::Kind::Counted;
+    trip.count = u32(lastIteration) + 1;
+    return trip;
+}
+
+bool IsLoopNestedIn(const std::vector<NaturalLoop>& loops, int inner, int outer)
+{
+    for (int loop = inner; loop >= 0; loop = loops[loop].parent)
+    {
+        if (loop == outer)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Executions of a block per entry into loop "within", or over the whole run when it's -1
+CycleTerms BlockExecutions(const StaticCycleEstimate& estimate, u16 start, int within)
+{
+    u64 coefficient = 1;
+    std::vector<u16> symbols;
+    for (size_t i = 0; i < estimate.loops.size(); i++)
+    {
+        if (!estimate.loops[i].body.count(start) || (within >= 0 && !IsLoopNestedIn(estimate.loops, int(i), within)))
+        {
+            continue;
+        }
+        if (estimate.trips[i].kind == LoopTripCount::Kind::Counted)
+        {
+            coefficient *= estimate.trips[i].count;
+        }
+        else
+        {
+            symbols.push_back(estimate.loops[i].header);
+        }
+    }
+    return { { symbols, coefficient } };
+}
+
+void AddCycleTerms(CycleTerms& sum, const CycleTerms& terms, u64 factor)
+{
+    for (const auto& [symbols, coefficient] : terms)
+    {
+        sum[symbols] += coefficient * factor;
+    }
+}
+
+// Clocks of blocks without string operations, they don't depend on known register values
+std::map<u16, u64> StringFreeBlockCycles(const ControlFlowGraph& cfg, const std::unordered_map<int, Operation>& operations)
+{
+    std::map<u16, u64> blockCycles;
+    for (const auto& [start, block] : cfg.blocks)
+    {
+        u64 cycles = 0;
+        bool hasString = false;
+        for (u16 ip : block.operationIps)
+        {
+            const Operation& op = operations.at(ip);
+            hasString |= op.type == Operation::Type::String;
+            cycles += CycleEstimation(op, staticStringRepetitions);
+        }
+        if (!hasString)
+        {
+            blockCycles[start] = cycles;
+        }
+    }
+    return blockCycles;
+}
+
+// Takes a prebuilt CFG and clocks of string-free blocks, as the decode cache stores them
+StaticCycleEstimate EstimateStaticCycles(const std::unordered_map<int, Operation>& operations, ControlFlowGraph cfg,
+    const std::map<u16, u64>& knownBlockCycles)
+{
+    StaticCycleEstimate estimate{};
+    estimate.cfg = std::move(cfg);
+    estimate.loops = FindNaturalLoops(estimate.cfg);
+
+    // Machine starts with all registers zeroed
+    ConstRegisters initial{};
+    initial.fill(KnownRegister(0));
+    std::map<u16, ConstRegisters> outStates;
+    const auto inStates = PropagateConstants(estimate.cfg, operations, initial, outStates);
+
+    for (const NaturalLoop& loop : estimate.loops)
+    {
+        estimate.trips.push_back(FindTripCount(loop, estimate.cfg, operations, initial, inStates, outStates));
+    }
+
+    for (u16 start : ReversePostOrder(estimate.cfg))
+    {
+        u64 cycles = 0;
+        if (const auto knownIt = knownBlockCycles.find(start); knownIt != knownBlockCycles.cend())
+        {
+            cycles = knownIt->second;
+        }
+        else
+        {
+            ConstRegisters registers = inStates.at(start);
+            for (u16 ip : estimate.cfg.Find(start)->operationIps)
+            {
+                const Operation& op = operations.at(ip);
+                const ConstRegister cx = registers[GetRegisterSlot(RegisterIndex::cx)];
+                const u32 repetitions = op.repPrefix == RepPrefix::None ? 1 : cx.kind == ConstRegister::Kind::Known ? cx.value : 0;
+                cycles += CycleEstimation(op, repetitions);
+                TransferConst(op, registers);
+            }
+        }
+        estimate.blockCycles[start] = cycles;
+        estimate.blockCounts[start] = BlockExecutions(estimate, start, -1);
+        AddCycleTerms(estimate.total, estimate.blockCounts[start], cycles);
+    }
+
+    for (size_t i = 0; i < estimate.loops.size(); i++)
+    {
+        CycleTerms loopCycles;
+        for (u16 start : estimate.loops[i].body)
+        {
+            AddCycleTerms(loopCycles, BlockExecutions(estimate, start, int(i)), estimate.blockCycles[start]);
+        }
+        estimate.loopCycles.push_back(loopCycles);
+    }
+    return estimate;
+}
+
+StaticCycleEstimate EstimateStaticCycles(const std::unordered_map<int, Operation>& operations, u16 entry = 0)
+{
+    return EstimateStaticCycles(operations, BuildControlFlowGraph(operations, entry), {});
+}
+
+std::string TripCountStr(const StaticCycleEstimate& estimate, size_t loop)
+{
+    const LoopTripCount& trip = estimate.trips[loop];
+    switch (trip.kind)
+    {
+    case LoopTripCount::Kind::Counted:
+        return std::to_string(trip.count) + " iterations, counter " + registerNames[trip.counter];
+    case LoopTripCount::Kind::Infinite:
+        return std::string("never exits, counter ") + registerNames[trip.counter];
+    default:
+        return TripSymbol(estimate.loops[loop].header) + " iterations";
+    }
+}
+
+void PrintStaticCycleEstimate(const StaticCycleEstimate& estimate)
+{
+    std::cout << "Static cycle estimate:";
+    for (const auto& [start, cycles] : estimate.blockCycles)
+    {
+        std::cout << "\n\tblock " << HexString(start) << ": " << estimate.cfg.Find(start)->operationIps.size() << " ops, "
+            << cycles << " clocks x " << CycleTermsStr(estimate.blockCounts.at(start));
+    }
+    for (size_t i = 0; i < estimate.loops.size(); i++)
+    {
+        const NaturalLoop& loop = estimate.loops[i];
+        std::cout << "\n\tloop " << HexString(loop.header) << ": " << loop.body.size() << " blocks, " << TripCountStr(estimate, i)
+            << ", " << CycleTermsStr(estimate.loopCycles[i]) << " clocks per entry";
+        if (loop.parent >= 0)
+        {
+            std::cout << " (inside loop " << HexString(estimate.loops[loop.parent].header) << ")";
+        }
+    }
+    std::cout << "\nStatic total clocks: " << CycleTermsStr(estimate.total) << "\n";
+}
+
+void ExportControlFlowDot(const StaticCycleEstimate& estimate, const std::string& path)
+{
+    std::ofstream out{ path };
+    out << "digraph cfg {\n"
+        << "    node [shape=box, fontname=\"monospace\"];\n";
+
+    // Every block sits in the cluster of its innermost loop
+    const auto emitBlocks = [&](int loop, const std::string& indent) {
+        for (const auto& [start, cycles] : estimate.blockCycles)
+        {
+            int innermost = -1;
+            for (size_t i = 0; i < estimate.loops.size(); i++)
+            {
+                if (estimate.loops[i].body.count(start)) innermost = int(i);
+            }
+            if (innermost == loop)
+            {
+                const BasicBlock& block = *estimate.cfg.Find(start);
+                out << indent << "block_" << std::hex << start << std::dec << " [label=\"" << HexString(start) << "\\n"
+                    << block.operationIps.size() << " ops, " << cycles << " clocks\\nx " << CycleTermsStr(estimate.blockCounts.at(start)) << "\"];\n";
+            }
+        }
+    };
+    const auto emitLoop = [&](auto& self, int loop, const std::string& indent) -> void {
+        out << indent << "subgraph cluster_" << std::hex << estimate.loops[loop].header << std::dec << " {\n"
+            << indent << "    label=\"loop " << HexString(estimate.loops[loop].header) << ": " << TripCountStr(estimate, loop)
+            << "\\n" << CycleTermsStr(estimate.loopCycles[loop]) << " clocks per entry\";\n";
+        for (size_t i = 0; i < estimate.loops.size(); i++)
+        {
+            if (estimate.loops[i].parent == loop) self(self, int(i), indent + "    ");
+        }
+        emitBlocks(loop, indent + "    ");
+        out << indent << "}\n";
+    };
+
+    for (size_t i = 0; i < estimate.loops.size(); i++)
+    {
+        if (estimate.loops[i].parent < 0) emitLoop(emitLoop, int(i), "    ");
+    }
+    emitBlocks(-1, "    ");
+
+    for (const auto& [start, cycles] : estimate.blockCycles)
+    {
+        const BasicBlock& block = *estimate.cfg.Find(start);
+        const auto emitEdge = [&](int next, const char* label) {
+            if (next < 0)
+            {
+                return;
+            }
+            if (!estimate.cfg.Find(next))
+            {
+                out << "    exit_" << std::hex << next << std::dec << " [shape=oval, label=\"exit " << HexString((u16)next) << "\"];\n";
+                out << "    block_" << std::hex << start << " -> exit_" << next << std::dec << " [label=\"" << label << "\"];\n";
+                return;
+            }
+            out << "    block_" << std::hex << start << " -> block_" << next << std::dec << " [label=\"" << label << "\"";
+            for (const NaturalLoop& loop : estimate.loops)
+            {
+                if (loop.header == next && std::count(loop.latches.begin(), loop.latches.end(), start))
+                {
+                    out << ", style=bold";
+                }
+            }
+            out << "];\n";
+        };
+        emitEdge(block.taken, "taken");
+        emitEdge(block.fallthrough, block.taken >= 0 ? "not taken" : "next");
+    }
+    out << "}\n";
+}
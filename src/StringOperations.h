@@ -0,0 +1,316 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "Helpers.h"
+#include "CpuOperations.h"
+#include "CycleEstimation.h"
+#include "UndoLog.h"
+#include "Breakpoints.h"
+#include "Framebuffer.h"
+#include "MemoryAnalyzer.h"
+#include "DirectMemory.h"
+
+std::string OutputChangeInFlags(const bool* prevFlags);
+
+// String operations walk si (source) and di (destination) over mainMemory. There are no
+// segments and cld/std aren't decoded, so direction flag is always clear and addresses go up.
+// REP forms run as bulk memset/memmove/memchr style operations when nothing has to see
+// single elements. Watchpoints, the memory analyzer, ranges wrapping past 64K and
+// overlapping moves that copy forward into their own source go element by element.
+
+// Bookkeeping of a bulk write, range must not wrap past the end of memory
+void MarkStringRangeWritten(u16 address, u32 length)
+{
+    if (!undoRing.empty())
+    {
+        for (u32 i = 0; i < length; i++)
+        {
+            RecordMemoryWrite(u16(address + i), false);
+        }
+    }
+    for (u32 page = address / memoryPageSize; page <= (address + length - 1) / memoryPageSize; page++)
+    {
+        dirtyMemoryPages[page] = true;
+    }
+    if (framebufferEnabled)
+    {
+        for (u32 i = 0; i < length; i += 2)
+        {
+            MarkFramebufferWritten(u16(address + i), i + 1 < length);
+        }
+    }
+}
+
+void SetStringFlags(u16 result, bool wide)
+{
+    flags[Flag::FLAG_ZERO] = (wide ? result : u8(result)) == 0;
+    flags[Flag::FLAG_SIGNED] = wide ? (result & 0x8000) : (result & 0x80);
+}
+
+u16 AccumulatorValue(bool wide)
+{
+    return wide ? registersMem[0] : u8(registersMem[0]);
+}
+
+// One element, moves si and di past it
+void ExecuteStringElement(OpString opString, bool wide)
+{
+    u16& si = registersMem[GetRegisterSlot(RegisterIndex::si)];
+    u16& di = registersMem[GetRegisterSlot(RegisterIndex::di)];
+    const u16 step = wide ? 2 : 1;
+    switch (opString)
+    {
+    case OpString::movs:
+        DirectWrite(di, wide, DirectRead(si, wide));
+        si += step;
+        di += step;
+        break;
+    case OpString::cmps:
+        SetStringFlags(u16(DirectRead(si, wide) - DirectRead(di, wide)), wide);
+        si += step;
+        di += step;
+        break;
+    case OpString::stos:
+        DirectWrite(di, wide, AccumulatorValue(wide));
+        di += step;
+        break;
+    case OpString::lods:
+        if (wide)
+        {
+            registersMem[0] = DirectRead(si, wide);
+        }
+        else
+        {
+            *GetByteRegisterMem(RegisterIndex::al) = u8(DirectRead(si, wide));
+        }
+        si += step;
+        break;
+    case OpString::scas:
+        SetStringFlags(u16(AccumulatorValue(wide) - DirectRead(di, wide)), wide);
+        di += step;
+        break;
+    }
+}
+
+// Elements compared up to and including the one that ends the repetition
+template<typename ElementsEqual>
+u32 CountCompared(u32 count, bool repeatWhileEqual, ElementsEqual elementsEqual)
+{
+    for (u32 i = 0; i < count; i++)
+    {
+        if (elementsEqual(i) != repeatWhileEqual)
+        {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+// Elements processed by the last executed string operation, REP forms are estimated from it
+thread_local u32 lastStringRepetitions = 0;
+
+u16 WordAt(u32 address)
+{
+    return u16(mainMemory[address] | (mainMemory[address + 1] << 8));
+}
+
+// Whole REP operation at once, returns elements processed or -1 when it has to go element by element
+int ExecuteStringBulk(const Operation& op, u16 count)
+{
+    u16& si = registersMem[GetRegisterSlot(RegisterIndex::si)];
+    u16& di = registersMem[GetRegisterSlot(RegisterIndex::di)];
+    const u32 step = op.wide ? 2 : 1;
+    const u32 length = count * step;
+    const bool sourceFits = si + length <= mainMemoryLimit;
+    const bool destinationFits = di + length <= mainMemoryLimit;
+    const bool repeatWhileEqual = op.repPrefix == RepPrefix::Rep;
+
+    u32 processed = count;
+    switch (op.opStringIndex)
+    {
+    case OpString::movs:
+        // memmove matches element order unless destination starts inside the source ahead of it
+        if (!sourceFits || !destinationFits || (di > si && di < si + length))
+        {
+            return -1;
+        }
+        MarkStringRangeWritten(di, length);
+        std::memmove(&mainMemory[di], &mainMemory[si], length);
+        break;
+    case OpString::stos:
+        if (!destinationFits)
+        {
+            return -1;
+        }
+        MarkStringRangeWritten(di, length);
+        if (!op.wide || u8(registersMem[0]) == registersMem[0] >> 8)
+        {
+            std::memset(&mainMemory[di], u8(registersMem[0]), length);
+        }
+        else
+        {
+            for (u32 i = 0; i < length; i += 2)
+            {
+                mainMemory[di + i] = u8(registersMem[0]);
+                mainMemory[di + i + 1] = registersMem[0] >> 8;
+            }
+        }
+        break;
+    case OpString::lods:
+        // Only the last element stays in the accumulator
+        if (op.wide)
+        {
+            const u16 last = u16(si + length - 2);
+            registersMem[0] = u16(mainMemory[last] | (mainMemory[u16(last + 1)] << 8));
+        }
+        else
+        {
+            *GetByteRegisterMem(RegisterIndex::al) = mainMemory[u16(si + length - 1)];
+        }
+        break;
+    case OpString::scas:
+    {
+        if (!destinationFits)
+        {
+            return -1;
+        }
+        const u16 accumulator = AccumulatorValue(op.wide);
+        if (!op.wide && !repeatWhileEqual)
+        {
+            const void* found = std::memchr(&mainMemory[di], accumulator, length);
+            processed = found ? u32(static_cast<const u8*>(found) - &mainMemory[di]) + 1 : count;
+        }
+        else if (!op.wide)
+        {
+            const u8* begin = &mainMemory[di];
+            const u8* end = begin + length;
+            const u8* found = std::find_if(begin, end, [&](u8 byte) { return byte != accumulator; });
+            processed = found != end ? u32(found - begin) + 1 : count;
+        }
+        else
+        {
+            processed = CountCompared(count, repeatWhileEqual, [&](u32 i) { return WordAt(di + i * 2) == accumulator; });
+        }
+        const u32 last = di + (processed - 1) * step;
+        SetStringFlags(u16(accumulator - (op.wide ? WordAt(last) : mainMemory[last])), op.wide);
+        break;
+    }
+    case OpString::cmps:
+    {
+        if (!sourceFits || !destinationFits)
+        {
+            return -1;
+        }
+        if (!op.wide && repeatWhileEqual)
+        {
+            const u8* begin = &mainMemory[si];
+            const u8* end = begin + length;
+            const u8* found = std::mismatch(begin, end, static_cast<const u8*>(&mainMemory[di])).first;
+            processed = found != end ? u32(found - begin) + 1 : count;
+        }
+        else
+        {
+            processed = CountCompared(count, repeatWhileEqual, [&](u32 i) {
+                return op.wide ? WordAt(si + i * 2) == WordAt(di + i * 2) : mainMemory[si + i] == mainMemory[di + i];
+            });
+        }
+        const u32 offset = (processed - 1) * step;
+        SetStringFlags(op.wide ? u16(WordAt(si + offset) - WordAt(di + offset)) : u16(mainMemory[si + offset] - mainMemory[di + offset]), op.wide);
+        break;
+    }
+    }
+
+    if (op.opStringIndex != OpString::stos && op.opStringIndex != OpString::scas)
+    {
+        si += u16(processed * step);
+    }
+    if (op.opStringIndex != OpString::lods)
+    {
+        di += u16(processed * step);
+    }
+    return int(processed);
+}
+
+// Executes string operation with its prefix, returns false when a watchpoint stopped
+// it before cx ran out, so ip has to stay on it. Register and flag changes are appended to trace if given
+bool ExecuteStringOp(const Operation& op, std::string* trace)
+{
+    const u16 prevSi = registersMem[GetRegisterSlot(RegisterIndex::si)];
+    const u16 prevDi = registersMem[GetRegisterSlot(RegisterIndex::di)];
+    const u16 prevCx = registersMem[GetRegisterSlot(RegisterIndex::cx)];
+    const u16 prevAx = registersMem[0];
+    bool prevFlags[Flag::FLAG_COUNT] = {};
+    if (trace)
+    {
+        std::copy(std::begin(flags), std::end(flags), prevFlags);
+    }
+
+    for (RegisterIndex reg : {RegisterIndex::si, RegisterIndex::di, RegisterIndex::cx, RegisterIndex::ax})
+    {
+        RecordRegisterWrite(GetRegisterMem(reg));
+    }
+    if (IsCompareString(op))
+    {
+        RecordFlagsWrite();
+    }
+
+    bool finished = true;
+    if (op.repPrefix == RepPrefix::None)
+    {
+        ExecuteStringElement(op.opStringIndex, op.wide);
+        lastStringRepetitions = 1;
+    }
+    else
+    {
+        u16& cx = registersMem[GetRegisterSlot(RegisterIndex::cx)];
+        const int bulk = cx != 0 && !breakpointsArmed && !memoryAnalyzerEnabled ? ExecuteStringBulk(op, cx) : -1;
+        if (bulk >= 0)
+        {
+            cx -= u16(bulk);
+            lastStringRepetitions = u32(bulk);
+        }
+        else
+        {
+            lastStringRepetitions = 0;
+            while (cx != 0)
+            {
+                ExecuteStringElement(op.opStringIndex, op.wide);
+                cx--;
+                lastStringRepetitions++;
+                if (IsCompareString(op) && flags[Flag::FLAG_ZERO] != (op.repPrefix == RepPrefix::Rep))
+                {
+                    break;
+                }
+                if (breakpointHit.kind != BreakpointHit::Kind::None)
+                {
+                    finished = cx == 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!trace)
+    {
+        return finished;
+    }
+    const auto change = [&](const char* name, u16 prev, u16 current) {
+        if (prev != current)
+        {
+            *trace += std::string(" ; ") + name + ":" + HexString(prev) + " -> " + HexString(current);
+        }
+    };
+    change("si", prevSi, registersMem[GetRegisterSlot(RegisterIndex::si)]);
+    change("di", prevDi, registersMem[GetRegisterSlot(RegisterIndex::di)]);
+    change("cx", prevCx, registersMem[GetRegisterSlot(RegisterIndex::cx)]);
+    change("ax", prevAx, registersMem[0]);
+    if (IsCompareString(op))
+    {
+        *trace += "\t" + OutputChangeInFlags(prevFlags);
+    }
+    return finished;
+}
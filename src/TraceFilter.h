@@ -0,0 +1,190 @@
+#pragma once
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "Breakpoints.h"
+#include "UndoLog.h"
+
+// Trace can be narrowed to ip ranges, every Nth step, the first or last N executions of each ip
+// and windows opened and closed by register conditions. Ranges are turned into a per-ip bitmap
+// once the listing is decoded, so a step outside of them costs one bit test; an ip that used up
+// its first N executions is cleared from the bitmap as well. Start and stop conditions are tested
+// at ips that pass the bitmap. Last N executions of an ip are formatted into a ring per ip and
+// printed in execution order after the run, so every step that could be one of them is formatted.
+
+struct TraceFilterConfig
+{
+    std::vector<std::pair<u16, u16>> ranges;    // inclusive, every ip when empty
+    u64 sampleEvery = 0;
+    u32 firstPerIp = 0;
+    u32 lastPerIp = 0;
+    RegisterCondition startWhen{};
+    RegisterCondition stopWhen{};
+
+    bool Enabled() const
+    {
+        return !ranges.empty() || sampleEvery > 1 || firstPerIp != 0 || lastPerIp != 0
+            || startWhen.reg != RegisterIndex::None || stopWhen.reg != RegisterIndex::None;
+    }
+};
+
+enum class TraceGate { Waiting, Open, Closed };
+
+struct CapturedStep
+{
+    u64 step = 0;
+    std::string line;
+};
+
+TraceFilterConfig traceFilter{};
+std::bitset<mainMemoryLimit> tracedIps;
+std::vector<u32> ipExecutions;      // sized only when first or last N is counted
+TraceGate traceGate = TraceGate::Open;
+bool traceGateArmed = false;
+u64 sampledSteps = 0;
+
+std::unordered_map<u16, std::deque<CapturedStep>> capturedSteps;
+std::stringbuf captureBuffer;
+std::streambuf* capturedStream = nullptr;
+u16 capturedIp = 0;
+
+// "ip" or "begin-end"
+bool ParseTraceRange(const std::string& str)
+{
+    const auto separator = str.find('-', 1);
+    long begin = 0;
+    long end = 0;
+    if (!ParseInteger(str.substr(0, separator), begin)
+        || !ParseInteger(separator != std::string::npos ? str.substr(separator + 1) : str.substr(0, separator), end)
+        || begin < 0 || begin > 0xFFFF || end < 0 || end > 0xFFFF)
+    {
+        return false;
+    }
+    traceFilter.ranges.emplace_back(u16(std::min(begin, end)), u16(std::max(begin, end)));
+    return true;
+}
+
+// Called once operations are decoded, before the run
+void PrepareTraceFilter(const std::unordered_map<int, Operation>& operations)
+{
+    tracedIps.reset();
+    for (const auto& [ip, op] : operations)
+    {
+        const bool inRange = traceFilter.ranges.empty() || std::any_of(traceFilter.ranges.cbegin(), traceFilter.ranges.cend(),
+            [ip](const auto& range) { return ip >= range.first && ip <= range.second; });
+        tracedIps[u16(ip)] = inRange;
+    }
+    if (traceFilter.firstPerIp != 0 || traceFilter.lastPerIp != 0)
+    {
+        ipExecutions.assign(mainMemoryLimit, 0);
+    }
+    traceGateArmed = traceFilter.startWhen.reg != RegisterIndex::None || traceFilter.stopWhen.reg != RegisterIndex::None;
+    traceGate = traceFilter.startWhen.reg != RegisterIndex::None ? TraceGate::Waiting : TraceGate::Open;
+    sampledSteps = 0;
+    capturedSteps.clear();
+}
+
+// Stop is tested before start, a window closed by stop opens again once start holds
+bool PassTraceGate()
+{
+    if (traceGate == TraceGate::Open && traceFilter.stopWhen.reg != RegisterIndex::None && traceFilter.stopWhen.Holds())
+    {
+        traceGate = traceFilter.startWhen.reg != RegisterIndex::None ? TraceGate::Waiting : TraceGate::Closed;
+        return false;
+    }
+    if (traceGate == TraceGate::Waiting && traceFilter.startWhen.Holds())
+    {
+        traceGate = TraceGate::Open;
+    }
+    return traceGate == TraceGate::Open;
+}
+
+// Called before the operation at ip runs, true when its step is traced.
+// Output of a step kept for the last N executions goes to the capture buffer until EndFilteredStep
+bool BeginFilteredStep(u16 ip)
+{
+    if (!tracedIps[ip])
+    {
+        return false;
+    }
+    if (traceGateArmed && !PassTraceGate())
+    {
+        return false;
+    }
+    if (traceFilter.sampleEvery > 1 && ++sampledSteps % traceFilter.sampleEvery != 0)
+    {
+        return false;
+    }
+    if (ipExecutions.empty())
+    {
+        return true;
+    }
+
+    const u32 execution = ++ipExecutions[ip];
+    if (execution <= traceFilter.firstPerIp)
+    {
+        if (execution == traceFilter.firstPerIp && traceFilter.lastPerIp == 0)
+        {
+            tracedIps.reset(ip);
+        }
+        return true;
+    }
+    if (traceFilter.lastPerIp == 0)
+    {
+        return false;
+    }
+    capturedIp = ip;
+    captureBuffer.str("");
+    capturedStream = std::cout.rdbuf(&captureBuffer);
+    return true;
+}
+
+void EndFilteredStep()
+{
+    if (capturedStream == nullptr)
+    {
+        return;
+    }
+    std::cout.rdbuf(capturedStream);
+    capturedStream = nullptr;
+
+    std::deque<CapturedStep>& ring = capturedSteps[capturedIp];
+    if (ring.size() == traceFilter.lastPerIp)
+    {
+        ring.pop_front();
+    }
+    ring.push_back({ executedSteps, captureBuffer.str() });
+}
+
+void PrintCapturedSteps()
+{
+    if (capturedSteps.empty())
+    {
+        return;
+    }
+    std::vector<const CapturedStep*> steps;
+    for (const auto& [ip, ring] : capturedSteps)
+    {
+        for (const CapturedStep& step : ring)
+        {
+            steps.push_back(&step);
+        }
+    }
+    std::sort(steps.begin(), steps.end(), [](const CapturedStep* a, const CapturedStep* b) { return a->step < b->step; });
+
+    std::cout << "\nLast " << traceFilter.lastPerIp << " executions of each ip:\n";
+    for (const CapturedStep* step : steps)
+    {
+        std::cout << step->line;
+    }
+}
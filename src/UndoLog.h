@@ -0,0 +1,276 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <string>
+
+#include "Defines.h"
+#include "CpuMemory.h"
+#include "CpuOperations.h"
+#include "CpuSnapshot.h"
+
+// Undo log records old values of everything an instruction overwrites,
+// which makes stepping back in time possible without re-executing the program.
+// Entries live in a ring buffer, so memory usage is bounded by its size.
+// Full checkpoints are taken periodically to go back further than the ring reaches.
+
+struct UndoEntry
+{
+    enum class Kind : u8 { Step, Register, Memory, Flags };
+
+    Kind kind;
+    u16 address;  // ip for Step, index in registersMem for Register, address for Memory
+    u16 oldValue;
+};
+
+struct UndoCheckpoint
+{
+    u64 step;
+    MachineSnapshot snapshot;
+};
+
+constexpr u64 undoCheckpointInterval = 4096;
+constexpr size_t undoCheckpointLimit = 16;
+
+// Per thread like the machine it records, batch workers start with the log disabled
+thread_local std::vector<UndoEntry> undoRing;       // empty means undo log is disabled
+thread_local size_t undoHead = 0;                   // where the next entry is written
+thread_local size_t undoCount = 0;                  // valid entries behind undoHead
+thread_local u64 undoStepsAvailable = 0;            // instructions that can be fully undone from the ring
+thread_local u64 executedSteps = 0;
+thread_local std::deque<UndoCheckpoint> undoCheckpoints;
+
+std::string ExecuteStep(const Operation& op);
+
+void SetUndoRingSize(size_t size)
+{
+    undoRing.assign(size, UndoEntry{});
+    undoHead = 0;
+    undoCount = 0;
+    undoStepsAvailable = 0;
+}
+
+void PushUndo(UndoEntry entry)
+{
+    if (undoCount == undoRing.size())
+    {
+        // Oldest entry gets overwritten, if it starts an instruction,
+        // that instruction can't be undone anymore
+        const size_t oldest = undoHead;
+        if (undoRing[oldest].kind == UndoEntry::Kind::Step)
+        {
+            undoStepsAvailable--;
+        }
+        undoCount--;
+    }
+    undoRing[undoHead] = entry;
+    undoHead = (undoHead + 1) % undoRing.size();
+    undoCount++;
+}
+
+// Push* add entries unconditionally, Record* only while the undo log is enabled.
+// Run loops that know up front whether it is pick one of them through an undo policy
+
+void PushUndoStep()
+{
+    if (executedSteps % undoCheckpointInterval == 0)
+    {
+        while (!undoCheckpoints.empty() && undoCheckpoints.back().step >= executedSteps)
+        {
+            undoCheckpoints.pop_back();
+        }
+        if (undoCheckpoints.size() == undoCheckpointLimit)
+        {
+            undoCheckpoints.pop_front();
+        }
+        undoCheckpoints.push_back({executedSteps, TakeSnapshot()});
+    }
+
+    PushUndo({UndoEntry::Kind::Step, (u16)ipReg, 0});
+    undoStepsAvailable++;
+}
+
+void PushRegisterUndo(const u16* reg)
+{
+    PushUndo({UndoEntry::Kind::Register, u16(reg - registersMem), *reg});
+}
+
+void PushMemoryUndo(u16 address, bool wide)
+{
+    PushUndo({UndoEntry::Kind::Memory, address, mainMemory[address]});
+    if (wide)
+    {
+        PushUndo({UndoEntry::Kind::Memory, u16(address + 1), mainMemory[u16(address + 1)]});
+    }
+}
+
+void PushFlagsUndo()
+{
+    u16 packed = 0;
+    for (int i = 0; i < Flag::FLAG_COUNT; i++)
+    {
+        packed |= flags[i] << i;
+    }
+    PushUndo({UndoEntry::Kind::Flags, 0, packed});
+}
+
+void RecordUndoStep()
+{
+    if (!undoRing.empty())
+    {
+        PushUndoStep();
+    }
+    executedSteps++;
+}
+
+void RecordRegisterWrite(const u16* reg)
+{
+    if (!undoRing.empty())
+    {
+        PushRegisterUndo(reg);
+    }
+}
+
+void RecordMemoryWrite(u16 address, bool wide)
+{
+    if (!undoRing.empty())
+    {
+        PushMemoryUndo(address, wide);
+    }
+}
+
+void RecordFlagsWrite()
+{
+    if (!undoRing.empty())
+    {
+        PushFlagsUndo();
+    }
+}
+
+// Undoes last executed instruction from the ring, returns false if ring has nothing to undo
+bool StepBack()
+{
+    if (undoStepsAvailable == 0)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        undoHead = (undoHead + undoRing.size() - 1) % undoRing.size();
+        undoCount--;
+        const UndoEntry& entry = undoRing[undoHead];
+        switch (entry.kind)
+        {
+        case UndoEntry::Kind::Step:
+            ipReg = entry.address;
+            undoStepsAvailable--;
+            executedSteps--;
+            return true;
+        case UndoEntry::Kind::Register:
+            registersMem[entry.address] = entry.oldValue;
+            break;
+        case UndoEntry::Kind::Memory:
+            mainMemory[entry.address] = (u8)entry.oldValue;
+            MarkMemoryWritten(entry.address, false);
+            break;
+        case UndoEntry::Kind::Flags:
+            for (int i = 0; i < Flag::FLAG_COUNT; i++)
+            {
+                flags[i] = (entry.oldValue >> i) & 1;
+            }
+            break;
+        }
+    }
+}
+
+// Restores closest checkpoint at or before targetStep and executes forward up to it
+bool ReplayFromCheckpoint(u64 targetStep, const std::unordered_map<int, Operation>& operations)
+{
+    auto checkpointIt = undoCheckpoints.rbegin();
+    while (checkpointIt != undoCheckpoints.rend() && checkpointIt->step > targetStep)
+    {
+        checkpointIt++;
+    }
+    if (checkpointIt == undoCheckpoints.rend())
+    {
+        return false;
+    }
+
+    RestoreSnapshot(checkpointIt->snapshot);
+    executedSteps = checkpointIt->step;
+    SetUndoRingSize(undoRing.size());
+
+    while (executedSteps < targetStep)
+    {
+        auto operationIt = operations.find(ipReg);
+        if (operationIt == operations.cend())
+        {
+            return false;
+        }
+        ExecuteStep(operationIt->second);
+    }
+    return true;
+}
+
+bool RunBackToStep(u64 targetStep, const std::unordered_map<int, Operation>& operations)
+{
+    if (targetStep > executedSteps)
+    {
+        return false;
+    }
+    if (executedSteps - targetStep > undoStepsAvailable)
+    {
+        return ReplayFromCheckpoint(targetStep, operations);
+    }
+    while (executedSteps > targetStep)
+    {
+        StepBack();
+    }
+    return true;
+}
+
+// Goes back to the most recent moment when ip was at given address
+bool RunBackToIp(s16 ip, const std::unordered_map<int, Operation>& operations)
+{
+    while (StepBack())
+    {
+        if (ipReg == ip)
+        {
+            return true;
+        }
+    }
+
+    // Ring is exhausted, look for the latest visit between checkpoints by replaying them
+    const u64 limitStep = executedSteps;
+    for (size_t i = undoCheckpoints.size(); i-- > 0;)
+    {
+        const u64 checkpointStep = undoCheckpoints[i].step;
+        if (checkpointStep >= limitStep)
+        {
+            continue;
+        }
+
+        u64 foundStep = limitStep;
+        ReplayFromCheckpoint(checkpointStep, operations);
+        while (executedSteps < limitStep)
+        {
+            if (ipReg == ip)
+            {
+                foundStep = executedSteps;
+            }
+            auto operationIt = operations.find(ipReg);
+            if (operationIt == operations.cend())
+            {
+                break;
+            }
+            ExecuteStep(operationIt->second);
+        }
+
+        if (foundStep != limitStep)
+        {
+            return RunBackToStep(foundStep, operations);
+        }
+    }
+    return false;
+}
@@ -2,6 +2,11 @@
 #include <fstream>
 #include <filesystem>
 #include <string>
+#include <sstream>
+#include <memory>
+#include <cstring>
+#include <vector>
+#include <iterator>
 #include <cassert>
 #include <unordered_map>
 
@@ -12,13 +17,73 @@
 #include "CpuOperations.h"
 #include "DecoderOperands.h"
 #include "CpuExecution.h"
+#include "Disassembly.h"
+#include "Decoder.h"
+#include "ConstexprMachine.h"
+#include "Assembler.h"
 #include "CycleEstimation.h"
-
-u16 CombineLoAndHiToWord(const std::vector<u8>& bytesArr, int* byteIndex)
+#include "CpuSnapshot.h"
+#include "Jit.h"
+#include "AotCompiler.h"
+#include "LoopAccelerator.h"
+#include "StaticCycles.h"
+#include "BatchScheduler.h"
+#include "Lockstep.h"
+#include "RunLoop.h"
+#include "DecodeCache.h"
+#include "RoutineCompare.h"
+
+// Batch file lists one listing per line, optionally followed by how many machines run it
+int RunBatchFile(const char* batchPath, const BatchConfig& config)
 {
-    const u16 byteLow  = bytesArr[++(*byteIndex)];
-    const u16 byteHigh = bytesArr[++(*byteIndex)];
-    return (byteHigh << 8) | byteLow;
+    std::ifstream batchFile(batchPath);
+    if (!batchFile.is_open())
+    {
+        std::cerr << "!!! Can't open batch file !!!\n";
+        return 0;
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<const BatchProgram>> programs;
+    const MachineSnapshot initial = TakeSnapshot();
+    std::vector<BatchJob> jobs;
+    std::string line;
+    while (std::getline(batchFile, line))
+    {
+        std::istringstream fields(line);
+        std::string path;
+        u64 copies = 1;
+        if (!(fields >> path) || path[0] == '#')
+        {
+            continue;
+        }
+        fields >> copies;
+
+        std::shared_ptr<const BatchProgram>& program = programs[path];
+        if (!program)
+        {
+            std::vector<u8> bytes;
+            if (!LoadProgramImage(path, bytes))
+            {
+                continue;
+            }
+            auto decoded = std::make_shared<BatchProgram>();
+            decoded->path = path;
+            decoded->operations = DecodeOperations(bytes);
+            if (!config.countCycles)
+            {
+                FuseOperations(decoded->operations);
+            }
+            program = std::move(decoded);
+        }
+        for (u64 i = 0; i < copies; i++)
+        {
+            jobs.push_back({ program, initial });
+        }
+    }
+
+    const BatchStats stats = RunBatch(jobs, config);
+    PrintBatchReport(jobs, config, stats);
+    return 0;
 }
 
 int main(int argc, char* argv[])
@@ -26,20 +91,274 @@ int main(int argc, char* argv[])
     bool executeInstructions = false;
     bool dumpMemory = false;
     bool cyclesEstimate = false;
-    while (argc--)
+    size_t undoRingSize = 1 << 16;
+    u64 stepBackCount = 0;
+    int runBackToIp = -1;
+    FramebufferConfig framebufferConfig{};
+    bool exportFramebuffer = false;
+    const char* memoryStatsPrefix = nullptr;
+    bool useJit = false;
+    bool verifyJit = false;
+    bool verifySnapshots = false;
+    bool noTrace = false;
+    bool fastLoops = false;
+    bool verifyFastLoops = false;
+    const char* emitCppPath = nullptr;
+    const char* aotBuildPath = nullptr;
+    bool staticCycles = false;
+    const char* cfgDotPath = nullptr;
+    DeviceConfig deviceConfig{};
+    const char* batchPath = nullptr;
+    BatchConfig batchConfig{};
+    const char* sweepPath = nullptr;
+    bool sweepCompare = false;
+    const char* decodeCacheDir = nullptr;
+    const char* assembleCheckDir = nullptr;
+    const char* comparePath = nullptr;
+    const char* listingPath = "listings/listing_0057_challenge_cycles";
+    for (int i = 1; i < argc; i++)
     {
-        if (!strcmp(argv[argc], "--exec"))
+        if (!strcmp(argv[i], "--exec"))
         {
             executeInstructions = true;
         }
-        if (!strcmp(argv[argc], "--dump"))
+        else if (!strcmp(argv[i], "--dump"))
         {
             dumpMemory = true;
         }
-        if (!strcmp(argv[argc], "--cyclesEstimate"))
+        else if (!strcmp(argv[i], "--cyclesEstimate"))
         {
             cyclesEstimate = true;
         }
+        else if (!strcmp(argv[i], "--undo-ring") && i + 1 < argc)
+        {
+            undoRingSize = std::stoul(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--step-back") && i + 1 < argc)
+        {
+            stepBackCount = std::stoull(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--run-back-to") && i + 1 < argc)
+        {
+            runBackToIp = std::stoi(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--break") && i + 1 < argc)
+        {
+            if (!ParseCodeBreakpoint(argv[++i]))
+            {
+                std::cerr << "!!! Bad breakpoint " << argv[i] << ", expected ip or ip:reg=value !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--break-reg") && i + 1 < argc)
+        {
+            RegisterCondition condition{};
+            if (!ParseRegisterCondition(argv[++i], condition))
+            {
+                std::cerr << "!!! Bad register condition " << argv[i] << ", expected reg=value !!!\n";
+                return 1;
+            }
+            AddRegisterBreakpoint(condition);
+        }
+        else if (!strcmp(argv[i], "--watch") && i + 1 < argc)
+        {
+            if (!ParseWatchpoint(argv[++i]))
+            {
+                std::cerr << "!!! Bad watchpoint " << argv[i] << ", expected address[:length][:r|w|rw] !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--framebuffer") && i + 1 < argc)
+        {
+            if (!ParseFramebufferConfig(argv[++i], framebufferConfig))
+            {
+                std::cerr << "!!! Bad framebuffer " << argv[i] << ", expected base,width,height[,rgba8|rgb8|gray8]"
+                    << " inside memory !!!\n";
+                return 1;
+            }
+            exportFramebuffer = true;
+        }
+        else if (!strcmp(argv[i], "--framebuffer-out") && i + 1 < argc)
+        {
+            framebufferConfig.outPath = argv[++i];
+            exportFramebuffer = true;
+        }
+        else if (!strcmp(argv[i], "--frame-every") && i + 1 < argc)
+        {
+            long frameEvery = 0;
+            if (!ParseInteger(argv[++i], frameEvery) || frameEvery < 0)
+            {
+                std::cerr << "!!! Bad frame interval " << argv[i] << ", expected a step count !!!\n";
+                return 1;
+            }
+            framebufferConfig.frameEvery = u64(frameEvery);
+            exportFramebuffer = true;
+        }
+        else if (!strcmp(argv[i], "--memstats") && i + 1 < argc)
+        {
+            memoryStatsPrefix = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--no-trace"))
+        {
+            noTrace = true;
+        }
+        else if (!strcmp(argv[i], "--trace-ip") && i + 1 < argc)
+        {
+            if (!ParseTraceRange(argv[++i]))
+            {
+                std::cerr << "!!! Bad trace range " << argv[i] << ", expected ip or begin-end !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--trace-every") && i + 1 < argc)
+        {
+            traceFilter.sampleEvery = std::stoull(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--trace-first") && i + 1 < argc)
+        {
+            traceFilter.firstPerIp = std::stoul(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--trace-last") && i + 1 < argc)
+        {
+            traceFilter.lastPerIp = std::stoul(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--trace-start") && i + 1 < argc)
+        {
+            if (!ParseRegisterCondition(argv[++i], traceFilter.startWhen))
+            {
+                std::cerr << "!!! Bad trace start condition " << argv[i] << ", expected reg=value !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--trace-stop") && i + 1 < argc)
+        {
+            if (!ParseRegisterCondition(argv[++i], traceFilter.stopWhen))
+            {
+                std::cerr << "!!! Bad trace stop condition " << argv[i] << ", expected reg=value !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--fast-loops"))
+        {
+            fastLoops = true;
+        }
+        else if (!strcmp(argv[i], "--fast-loops-verify"))
+        {
+            verifyFastLoops = true;
+        }
+        else if (!strcmp(argv[i], "--jit"))
+        {
+            useJit = true;
+        }
+        else if (!strcmp(argv[i], "--jit-verify"))
+        {
+            verifyJit = true;
+        }
+        else if (!strcmp(argv[i], "--snapshot-verify"))
+        {
+            verifySnapshots = true;
+        }
+        else if (!strcmp(argv[i], "--jit-threshold") && i + 1 < argc)
+        {
+            jitHotThreshold = std::stoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--emit-cpp") && i + 1 < argc)
+        {
+            emitCppPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--aot-build") && i + 1 < argc)
+        {
+            aotBuildPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--static-cycles"))
+        {
+            staticCycles = true;
+        }
+        else if (!strcmp(argv[i], "--cfg-dot") && i + 1 < argc)
+        {
+            cfgDotPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--devices"))
+        {
+            deviceConfig.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--timer") && i + 1 < argc)
+        {
+            deviceConfig.timerPeriod = std::stoull(argv[++i]);
+            deviceConfig.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--keys") && i + 1 < argc)
+        {
+            deviceConfig.keys = argv[++i];
+            deviceConfig.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--key-interval") && i + 1 < argc)
+        {
+            deviceConfig.keyInterval = std::stoull(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--batch") && i + 1 < argc)
+        {
+            batchPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+        {
+            batchConfig.workers = std::stoul(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--slice") && i + 1 < argc)
+        {
+            batchConfig.sliceBudget = std::stoull(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--slice-cycles") && i + 1 < argc)
+        {
+            batchConfig.sliceBudget = std::stoull(argv[++i]);
+            batchConfig.countCycles = true;
+        }
+        else if (!strcmp(argv[i], "--job-budget") && i + 1 < argc)
+        {
+            batchConfig.jobBudget = std::stoull(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--sweep") && i + 1 < argc)
+        {
+            sweepPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--sweep-compare"))
+        {
+            sweepCompare = true;
+        }
+        else if (!strcmp(argv[i], "--assemble-check") && i + 1 < argc)
+        {
+            assembleCheckDir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--compare") && i + 1 < argc)
+        {
+            comparePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--compare-ignore") && i + 1 < argc)
+        {
+            if (!ParseCompareIgnore(argv[++i]))
+            {
+                std::cerr << "!!! Bad register list " << argv[i] << ", expected names like cx,si !!!\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--decode-cache") && i + 1 < argc)
+        {
+            decodeCacheDir = argv[++i];
+        }
+        else if (argv[i][0] != '-')
+        {
+            listingPath = argv[i];
+        }
+    }
+
+    if (assembleCheckDir)
+    {
+        return CheckAssemblerRoundTrip(assembleCheckDir) == 0 ? 0 : 1;
+    }
+
+    if (batchPath)
+    {
+        return RunBatchFile(batchPath, batchConfig);
     }
 
     //std::ifstream file("listings/listing_0038_many_register_mov", std::ios::binary);
@@ -55,279 +374,225 @@ int main(int argc, char* argv[])
     //std::ifstream file("listings/listing_0054_draw_rectangle", std::ios::binary);
     //std::ifstream file("listings/draw_rect_better", std::ios::binary);
     //std::ifstream file("listings/listing_0056_estimating_cycles", std::ios::binary);
-    std::ifstream file("listings/listing_0057_challenge_cycles", std::ios::binary);
-    if (!file.is_open())
+    std::vector<u8> bytes;
+    if (!LoadProgramImage(listingPath, bytes))
     {
-        std::cerr << "!!! Can't open file !!!\n";
         return 0;
     }
-    std::vector<u8> bytes(
-        (std::istreambuf_iterator<char>(file)),
-        (std::istreambuf_iterator<char>())
-    );
 
     std::cout << "bits 16\n";
 
-    std::unordered_map<int, Operation> operations;
-
-    int byteIndex = 0, opBeginByte = 0;
-    while (byteIndex < bytes.size())
+    DecodedProgram program{};
+    const bool cachedDecode = decodeCacheDir && LoadDecodeCache(decodeCacheDir, bytes, program);
+    if (!cachedDecode)
     {
-        opBeginByte = byteIndex;
-        Operation operation{};
-        Operand left{}, right{};
-
-        u8 instructionByte = bytes[byteIndex];
-        u8 bitD = (instructionByte & 2) >> 1;
-        u8 bitW = (instructionByte & 1);
-
-        if (operation.opIndex = IsReg_Mem_Reg(instructionByte); operation.opIndex != OpIndex::UNDEFINED)
+        program.operations = DecodeOperations(bytes);
+        FuseOperations(program.operations);
+        if (decodeCacheDir)
         {
-            u8 adjByte = bytes[++byteIndex];
-
-            u8 mod = (adjByte >> 6);
-            u8 reg = (adjByte & 0b00'111'000) >> 3;
-            u8 rm =  (adjByte & 0b00'000'111);
-            if (mod == 3) // register mode
-            {
-                left.type = Operand::Type::Register;
-                left.reg = registersMap[rm][bitW];
-                right.type = Operand::Type::Register;
-                right.reg = registersMap[reg][bitW];
-            }
-            else
-            {
-                left.type = Operand::Type::Register;
-                left.reg = registersMap[reg][bitW];
-                right.type = Operand::Type::Memory;
-                right.mem.pointsToWord = bitW == 1;
-                right.mem.explicitWide = bitW == 1 ? MemoryExpr::ExplicitWide::Word : MemoryExpr::ExplicitWide::Byte;
-                right.mem.SetRegistersOfExpression(rm, mod);
-
-                if (mod == 0)
-                {
-                    if (rm == 0b0110)
-                    {
-                        right.mem.disp = bitW == 1 ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
-                    }
-                }
-                else if (mod == 1) // memory mode, 8-bit displacement follows
-                {
-                    right.mem.disp = bytes[++byteIndex];
-                }
-                else if (mod == 2) // memory mode, 16-bit displacement follows
-                {
-                    right.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
-                }
+            program.cfg = BuildControlFlowGraph(program.operations);
+            program.blockCycles = StringFreeBlockCycles(program.cfg, program.operations);
+            StoreDecodeCache(decodeCacheDir, bytes, program);
+        }
+    }
+    std::unordered_map<int, Operation>& operations = program.operations;
 
-                if (bitD == 0)
-                {
-                    std::swap(left, right);
-                }
-            }
+    if (emitCppPath || aotBuildPath)
+    {
+        const ControlFlowGraph cfg = decodeCacheDir ? program.cfg : BuildControlFlowGraph(operations);
+        if (const int unsupportedIp = AotUnsupportedIp(operations, cfg); unsupportedIp >= 0)
+        {
+            std::cerr << "!!! Operation at ip " << unsupportedIp << " can't be compiled into a kernel !!!\n";
+            return 1;
         }
-        else if (IsImm_Reg_Mem(instructionByte))
+        if (emitCppPath)
         {
-            u8 bitS = bitD;
-
-            u8 adjByte = bytes[++byteIndex];
-            u8 mod     = (adjByte >> 6);
-            u8 rm      = (adjByte & 0b111);
-            operation.opIndex = OpIndex((adjByte & 0b111'000) >> 3);
-
-            if ((instructionByte & 0b1111'1110) == 0b1100'0110) // specific MOV instruction
-            {
-                operation.opIndex = OpIndex::MOV;
-            }
-
-            bool dataIsWord = operation.opIndex == OpIndex::MOV  ?  bitW == 1  :  bitS == 0 && bitW == 1;
-
-            if (mod == 3) // register mode
-            {
-                left.type = Operand::Type::Register;
-                left.reg = registersMap[rm][bitW];
-            }
-            else
-            {
-                left.type = Operand::Type::Memory;
-                left.mem.SetRegistersOfExpression(rm, mod);
-                left.mem.pointsToWord = dataIsWord;
-                left.mem.explicitWide = bitW == 1 ? MemoryExpr::ExplicitWide::Word : MemoryExpr::ExplicitWide::Byte;
-
-                if (mod == 0) // memory mode, no displacement follows
-                {
-                    // SPECIAL CASE
-                    if (rm == 0b0110)
-                    {
-                        left.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
-                    }
-                }
-                else if (mod == 1) // memory mode, 8-bit displacement follows
-                {
-                    left.mem.disp = bytes[++byteIndex];
-                }
-                else if (mod == 2) // memory mode, 16-bit displacement follows
-                {
-                    left.mem.disp = CombineLoAndHiToWord(bytes, &byteIndex);
-                }
-            }
-
-            right.type = Operand::Type::Immediate;
-            right.immVal.value = dataIsWord ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
+            EmitCpp(operations, cfg, emitCppPath, listingPath);
         }
-        else if ((instructionByte & 0b1111'0000) == 0b1011'0000) // MOV immediate to register
+        if (aotBuildPath && !BuildAotKernel(operations, cfg, aotBuildPath, listingPath))
         {
-            operation.opIndex = OpIndex::MOV;
-            u8 bitW = (instructionByte & 0b1000) >> 3;
-            u8 reg  = (instructionByte & 0b0111);
-
-            left.type = Operand::Type::Register;
-            left.reg = registersMap[reg][bitW];
-            right.type = Operand::Type::Immediate;
-            right.immVal.value = bitW == 1 ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
-        }
-        else if ((instructionByte & 0b1111'1100) == 0b1010'0000) // MOV accumulator
-        {
-            assert(false);
-            //instructionStr = operationNames[OpIndex::MOV];
-            //const auto data = CombineLoAndHiToString(bytes, &byteIndex);
-            //if (bitD == 0)
-            //{
-            //    leftOperand = "ax";
-            //    rightOperand = '[' + data + ']';
-            //}
-            //else
-            //{
-            //    leftOperand = '[' + data + ']';
-            //    rightOperand = "ax";
-            //}
-        }
-        else if (operation.opIndex = IsImm_Accumulator(instructionByte); operation.opIndex != OpIndex::UNDEFINED)
-        {
-            left.type = Operand::Type::Register;
-            left.reg = bitW == 1 ? RegisterIndex::ax : RegisterIndex::al;
+            std::cerr << "!!! Can't build " << aotBuildPath << " !!!\n";
+            return 1;
+        }
+    }
 
-            right.type = Operand::Type::Immediate;
-            right.immVal.value = bitW == 1 ? CombineLoAndHiToWord(bytes, &byteIndex) : bytes[++byteIndex];
+    if (staticCycles || cfgDotPath)
+    {
+        const StaticCycleEstimate estimate = decodeCacheDir
+            ? EstimateStaticCycles(operations, program.cfg, program.blockCycles)
+            : EstimateStaticCycles(operations);
+        if (staticCycles)
+        {
+            PrintStaticCycleEstimate(estimate);
         }
-        else if (IsJump(instructionByte) || IsLoop(instructionByte))
+        if (cfgDotPath)
         {
-            if (IsJump(instructionByte))
-            {
-                operation.type = Operation::Type::Jump;
-                operation.opJumpIndex = OpJump(instructionByte & 0b1111);
-            }
-            else
-            {
-                operation.type = Operation::Type::Loop;
-                operation.opLoopIndex = OpLoop(instructionByte & 0b0011);
-            }
-
-            left.type = Operand::Type::JumpDisplacement;
-            left.jump.value = (s8)bytes[++byteIndex] + 2;
+            ExportControlFlowDot(estimate, cfgDotPath);
         }
-
-        operation.operands[0] = std::move(left);
-        operation.operands[1] = std::move(right);
-        operation.size = byteIndex - opBeginByte;
-        operations[opBeginByte] = operation;
-
-        byteIndex++;
     }
 
-    s16 ipReg = 0;
-    u16 totalEstimatedCycles = 0;
-    auto operationIt = operations.find(ipReg);
-    while (operationIt != operations.cend())
+    if (sweepPath)
     {
-        const auto& op = operationIt->second;
-        op.PrintOp();
-        op.operands[0].Print();
-        if (op.operands[1].type != Operand::Type::None)
+        std::vector<SweepLane> lanes;
+        if (!ParseSweepFile(sweepPath, lanes))
         {
-            std::cout << ", ";
-            op.operands[1].Print();
+            return 1;
         }
+        return RunSweep(operations, lanes, sweepCompare) ? 0 : 1;
+    }
 
-        if (executeInstructions)
+    if (comparePath)
+    {
+        std::vector<u8> otherBytes;
+        if (!LoadProgramImage(comparePath, otherBytes))
         {
-            switch (op.type)
-            {
-            case Operation::Type::Operation:
-                std::cout << ExecuteOp(op.opIndex, op.operands) << " ip:" << HexString(ipReg) << " -> ";
-                ipReg += op.size + 1;
-                std::cout << HexString(ipReg);
-                break;
-            case Operation::Type::Jump:
-            case Operation::Type::Loop:
-                std::cout << " ip:" << HexString(ipReg) << " -> ";
-                if (flags[Flag::FLAG_ZERO] == 0)
-                {
-                    ipReg += op.operands[0].jump.value; // disp is negative (future me: or is it?) (futurer me: this is handled by default right?)
-                }
-                else
-                {
-                    ipReg += op.size + 1;
-                }
-                std::cout << HexString(ipReg);
-                break;
-            default:
-                break;
-            }
+            return 1;
         }
+        // Profiled runs don't record undo entries
+        SetUndoRingSize(0);
+        return CompareRoutines(listingPath, operations, comparePath, DecodeOperations(otherBytes)) ? 0 : 1;
+    }
 
-        if (cyclesEstimate)
+    if (executeInstructions)
+    {
+        SetUndoRingSize(undoRingSize);
+        if (exportFramebuffer)
         {
-            int cyclesCount = CycleEstimation(op);
-            totalEstimatedCycles += cyclesCount;
-            std::cout << " | Clocks: +" << cyclesCount << " = " << totalEstimatedCycles;
+            EnableFramebuffer(framebufferConfig);
+        }
+        if (memoryStatsPrefix)
+        {
+            EnableMemoryAnalyzer();
+        }
+        if (deviceConfig.enabled)
+        {
+            // Devices need the clock after every operation, JIT and fast-forwarded loops skip it.
+            // Snapshots don't hold device state, so a restored run can't be repeated
+            EnableDevices(deviceConfig);
+            useJit = verifyJit = fastLoops = verifyFastLoops = verifySnapshots = false;
+        }
+        // Compiled code has no hooks for the trace, clocks, breakpoints, watchpoints, memory stats or frames
+        const bool needsHooks = !noTrace || cyclesEstimate || breakpointsArmed || memoryAnalyzerEnabled
+            || (framebufferEnabled && framebuffer.frameEvery != 0);
+        if ((useJit || verifyJit) && needsHooks)
+        {
+            std::cerr << "JIT not used, the trace, --cyclesEstimate, --break, --watch, --memstats and --frame-every need the interpreter (see --no-trace)\n";
+            useJit = verifyJit = false;
         }
-
-        operationIt = operations.find(ipReg);
-        std::cout << '\n';
     }
 
-    if (executeInstructions)
+    u64 totalEstimatedCycles = 0;
+    if (executeInstructions && (useJit || verifyJit))
+    {
+        // Compiled code doesn't record undo entries
+        SetUndoRingSize(0);
+        if (!verifyJit)
+        {
+            RunWithJit(operations);
+        }
+        else if (!VerifyJit(operations))
+        {
+            PrintFinalState();
+            return 1;
+        }
+    }
+    else if (executeInstructions && verifySnapshots)
+    {
+        SetUndoRingSize(0);
+        if (!VerifySnapshotRestore([&] { RunInterpreter(operations); }))
+        {
+            PrintFinalState();
+            return 1;
+        }
+    }
+    else if (executeInstructions && verifyFastLoops)
+    {
+        SetUndoRingSize(0);
+        if (!VerifyLoopAcceleration(operations))
+        {
+            PrintFinalState();
+            return 1;
+        }
+    }
+    else if (executeInstructions && fastLoops)
+    {
+        // Fast-forwarded loops don't record undo entries
+        SetUndoRingSize(0);
+        totalEstimatedCycles = RunWithLoopAcceleration(operations);
+        std::cout << "Fast-forwarded " << fastForwardedIterations << " iterations in " << fastForwardedLoops << " loops\n";
+    }
+    else if (executeInstructions)
     {
-        const auto printRegisterValue = [&](RegisterIndex regIndex) {
-            auto regValue = *GetRegisterMem(regIndex);
-            if (regValue == 0)
+        RunOptions options{};
+        options.trace = !noTrace;
+        options.filterTrace = traceFilter.Enabled();
+        if (options.trace && options.filterTrace)
+        {
+            PrepareTraceFilter(operations);
+        }
+        options.estimateCycles = cyclesEstimate;
+        options.devices = devicesEnabled;
+        options.watchpoints = breakpointsArmed;
+        options.profile = memoryAnalyzerEnabled;
+        options.undo = !undoRing.empty();
+        options.framebuffer = framebufferEnabled;
+        options.frames = framebufferEnabled && framebuffer.frameEvery != 0;
+        totalEstimatedCycles = RunWithPolicies(operations, options);
+        PrintCapturedSteps();
+    }
+    else
+    {
+        // Disassembly only, walk operations in order
+        auto operationIt = operations.find(ipReg);
+        while (operationIt != operations.cend())
+        {
+            const auto& op = operationIt->second;
+            PrintOperation(op);
+            ipReg += op.size + 1;
+            if (cyclesEstimate)
             {
-                return;
+                int cyclesCount = CycleEstimation(op, staticStringRepetitions);
+                totalEstimatedCycles += cyclesCount;
+                std::cout << " | Clocks: +" << cyclesCount << " = " << totalEstimatedCycles;
             }
-            auto regName = registerNames[regIndex]; // TODO: only considering full 16 bit registers
-            std::cout << "\n\t" << regName
-                << ": " << HexString(regValue) 
-                << " (" << regValue << ")";
-        };
-
-        // Order of registers in memory is mixed up just like in 8086
-        // so we manualy reorder values for better order
-        std::cout << "\nFinal registers:";
-        for (auto i : {RegisterIndex::ax, RegisterIndex::bx, RegisterIndex::cx, RegisterIndex::dx, RegisterIndex::sp, RegisterIndex::bp, RegisterIndex::si, RegisterIndex::di, })
-        {
-            printRegisterValue(i);
+            operationIt = operations.find(ipReg);
+            std::cout << '\n';
         }
-        // ip register can be in the registersMem, but it it's considered as a separate "hidden" regitser
-        // so we print it out separately
-        std::cout << "\n\tip: " << HexString(byteIndex) << " (" << byteIndex << ")";
+    }
+
+    if (executeInstructions && (stepBackCount > 0 || runBackToIp >= 0))
+    {
+        const bool wentBack = runBackToIp >= 0
+            ? RunBackToIp((s16)runBackToIp, operations)
+            : RunBackToStep(stepBackCount <= executedSteps ? executedSteps - stepBackCount : 0, operations);
+        std::cout << (wentBack ? "\nWent back to step " : "\nCan't go back that far, stopped at step ") << executedSteps;
+    }
 
-        std::cout << "\nFinal flags:\n\t";
-        for (int i = 0; i < Flag::FLAG_COUNT; i++)
+    if (executeInstructions)
+    {
+        PrintFinalState();
+        PrintDeviceState();
+        if (cyclesEstimate)
         {
-            if (flags[i])
-                std::cout << FlagStr((Flag)i);
+            std::cout << "\nTotal clocks: " << totalEstimatedCycles << " (" << executedSteps << " steps)";
         }
     }
 
+    if (memoryAnalyzerEnabled)
+    {
+        PrintMemoryAnalysis();
+        ExportMemoryAnalysis(memoryStatsPrefix);
+    }
+
     if (dumpMemory)
     {
         std::ofstream memoryDumpFile{ "memoryDump.data", std::ios::binary };
-        std::copy(
-            std::begin(mainMemory),
-            std::end(mainMemory),
-            std::ostream_iterator<u8>(memoryDumpFile)
-        );
+        memoryDumpFile.write(reinterpret_cast<const char*>(mainMemory), mainMemoryLimit);
+    }
+
+    if (framebufferEnabled)
+    {
+        WriteFramebufferImage(framebuffer.outPath);
     }
 
     return 0;